@@ -0,0 +1,239 @@
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "chat_core.h"
+
+
+// Measures the dispatch: the pipeline, the fan-out and the flushes, with the clients in this process on
+// loopback connections (see loopback.h), so no time goes to the kernel. Unlike 'Simulator' it doesn't
+// inject faults, it only goes as fast as it can.
+//
+// Each client logs in, then the clients take turns broadcasting '--messages' messages of '--size' bytes in
+// batches of '--batch'. After each batch the server runs until it's done, and every client reads and
+// acknowledges what it got. With '--private' each message goes to the next client only.
+//
+// At the end it checks that every client got every message meant for it, exactly once.
+
+
+struct BenchmarkClient
+{
+    LoopbackEndpoint* endpoint = nullptr;
+    uint32_t          user_id  = 0;
+    uint64_t          chats    = 0;  // Chat events received.
+    uint64_t          expected = 0;  // Chat events sent to it.
+    uint64_t          sequence = 0;  // Of the last numbered frame received.
+    FrameReader       reader;
+};
+
+
+static std::vector<BenchmarkClient> clients;
+
+
+uint32_t MakeFrame(char* frame, FrameType type, const char* payload, size_t size)
+{
+    FrameHeader header;
+    header.size  = htons((uint16_t) size);
+    header.type  = type;
+    header.flags = 0;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), payload, size);
+    return (uint32_t) (sizeof(header) + size);
+}
+
+
+// Reads what the server sent each client, and acknowledges it. Returns the number of bytes read.
+uint64_t ReadClients()
+{
+    static char scratch[1 << 17];
+    uint64_t    total = 0;
+
+    for (BenchmarkClient& client : clients)
+    {
+        if (client.endpoint == nullptr)
+            continue;
+        uint64_t sequence = client.sequence;
+        bool     malformed = false;
+        while (!malformed)
+        {
+            ssize_t bytes_received = client.reader.Receive(scratch, sizeof(scratch), [&client](char* data, size_t size) {
+                return (ssize_t) client.endpoint->Read(data, size);
+            });
+            total += bytes_received;
+
+            FrameHeader header;
+            FrameTrace  trace;
+            const char* payload      = NULL;
+            size_t      payload_size = 0;
+            while (client.reader.Next(header, trace, payload, payload_size, malformed))
+            {
+                if (header.type == FRAME_WELCOME)
+                {
+                    client.user_id = (uint32_t) strtoul(std::string(payload, payload_size).c_str(), NULL, 10);
+                }
+                else if (header.type == FRAME_EVENT && (header.flags & FRAME_SEQUENCED) && client.reader.sequence > client.sequence)
+                {
+                    client.sequence = client.reader.sequence;
+                    ChatEvent chat;
+                    if (Codec<ChatEvent>::Decode(payload, payload_size, chat))
+                        ++client.chats;
+                }
+            }
+            client.reader.Finish();  // Also when nothing was read, it keeps what's left of the last frame.
+            if (bytes_received == 0)
+                break;
+        }
+        if (client.sequence != sequence)
+        {
+            AckEvent ack;
+            char     encoded[MAXIMUM_FIXED_EVENT_SIZE];
+            char     frame[64];
+            ack.sequence = client.sequence;
+            client.endpoint->Write(frame, MakeFrame(frame, FRAME_ACK, encoded, Codec<AckEvent>::Encode(ack, encoded)));
+        }
+    }
+    return total;
+}
+
+
+// Runs the server and the clients until neither has anything left to do. Returns the time spent in the
+// server.
+uint64_t Settle(ChatServer& server)
+{
+    uint64_t server_time = 0;
+    while (true)
+    {
+        uint64_t start = MonotonicNanoseconds();
+        while (server.Busy())
+            server.Poll();
+        server_time += MonotonicNanoseconds() - start;
+        if (ReadClients() == 0 && !server.Busy())
+            return server_time;
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: <clients> [--messages=<n>] [--size=<bytes>] [--batch=<messages>] [--private]";
+    if (argc < 2)
+    {
+        printf("%s\n", usage);fflush(stdout);
+        return 1;
+    }
+
+    uint32_t count      = (uint32_t) atoi(argv[1]);
+    uint32_t messages   = 10000;
+    uint32_t size       = 64;
+    uint32_t batch      = 16;
+    bool     is_private = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        if      (strncmp(argument, "--messages=", 11) == 0) messages   = (uint32_t) atoi(argument + 11);
+        else if (strncmp(argument, "--size=", 7) == 0)      size       = (uint32_t) atoi(argument + 7);
+        else if (strncmp(argument, "--batch=", 8) == 0)     batch      = (uint32_t) atoi(argument + 8);
+        else if (strcmp(argument, "--private") == 0)        is_private = true;
+        else
+        {
+            printf("%s\n", usage);fflush(stdout);
+            return 1;
+        }
+    }
+    if (count < 2 || batch == 0)
+    {
+        printf("%s\n", usage);fflush(stdout);
+        return 1;
+    }
+    if (size < 2 || size > MAXIMUM_PAYLOAD_SIZE - 16)
+        size = size < 2 ? 2 : MAXIMUM_PAYLOAD_SIZE - 16;
+
+    announce_presence = false;
+    logger.minimum_level = LOG_WARNING;
+    logger.Start();
+    pipeline.Get<Optional<LogStage>>().enabled = false;
+
+    ChatServer server;
+    if (!server.Start())
+    {
+        printf("Couldn't start the server.\n");fflush(stdout);
+        return 1;
+    }
+
+    // ---- JOIN ----
+    clients = std::vector<BenchmarkClient>(count);  // Not copyable, so can't be resized.
+    char frame[MAXIMUM_FRAME_SIZE];
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        clients[i].reader.maximum_payload = 0xFFFF;
+        clients[i].endpoint = server.Connect();
+        if (clients[i].endpoint == nullptr)
+        {
+            printf("Couldn't connect client %u.\n", i);fflush(stdout);
+            return 1;
+        }
+        clients[i].endpoint->Write(frame, MakeFrame(frame, FRAME_LOGIN, "0", 1));
+    }
+    uint64_t join_start = MonotonicNanoseconds();
+    uint64_t join_time  = Settle(server);
+    printf("[Benchmark]: %zu clients joined (%.0fns per join in the server, %.1fms in total)\n", server.Clients(),
+           (double) join_time / count, (MonotonicNanoseconds() - join_start) / 1e6);
+
+    // ---- MESSAGES ----
+    uint64_t deliveries_before = server.Counters().deliveries.load();
+    uint64_t bytes_before      = server.Counters().bytes_sent.load();
+    uint64_t server_time       = 0;
+    uint64_t start             = MonotonicNanoseconds();
+    char     text[MAXIMUM_PAYLOAD_SIZE];
+    for (uint32_t m = 0; m < messages; ++m)
+    {
+        uint32_t         sender    = m % count;
+        BenchmarkClient& recipient = clients[(sender + 1) % count];
+        int              length    = is_private ? snprintf(text, sizeof(text), "/msg %u ", recipient.user_id) : 0;
+        while (length < (int) size - 1)
+            text[length++] = '.';
+        text[length++] = '\n';
+        clients[sender].endpoint->Write(frame, MakeFrame(frame, FRAME_TEXT, text, length));
+
+        if (is_private)
+            ++recipient.expected;
+        else
+            for (uint32_t i = 0; i < count; ++i)
+                clients[i].expected += i != sender;
+
+        if (m % batch == batch - 1 || m == messages - 1)
+            server_time += Settle(server);
+    }
+    uint64_t elapsed = MonotonicNanoseconds() - start;
+
+    // ---- REPORT ----
+    uint64_t deliveries = server.Counters().deliveries.load() - deliveries_before;
+    uint64_t bytes      = server.Counters().bytes_sent.load() - bytes_before;
+    uint64_t wrong      = 0;
+    for (const BenchmarkClient& client : clients)
+        wrong += client.chats != client.expected;
+
+    // Private messages are delivered directly, they aren't counted as deliveries (fan-out) by the server.
+    if (is_private)
+        deliveries = messages;
+    printf("[Benchmark]: %u %s messages of %u bytes, %llu deliveries, %.1fMB in %.1fms (%.1fms in the server)\n",
+           messages, is_private ? "private" : "broadcast", size, (unsigned long long) deliveries, bytes / 1e6,
+           elapsed / 1e6, server_time / 1e6);
+    printf("[Benchmark]: %.0f messages/s, %.0f deliveries/s, %.1fns per delivery in the server\n",
+           server_time ? messages * 1e9 / server_time : 0.0, server_time ? deliveries * 1e9 / server_time : 0.0,
+           deliveries ? (double) server_time / deliveries : 0.0);
+    printf("[Benchmark]: Delivery checked for %u clients: %llu wrong\n", count, (unsigned long long) wrong);
+    fflush(stdout);
+
+    for (BenchmarkClient& client : clients)
+    {
+        client.endpoint->Close();
+        client.endpoint = nullptr;
+    }
+    Settle(server);
+    logger.Stop();
+    return wrong == 0 ? 0 : 1;
+}
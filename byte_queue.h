@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <string.h>
+
+
+// Bytes written at the back and read from the front.
+struct ByteQueue
+{
+    std::vector<char> bytes;
+    size_t            start = 0;
+
+    size_t Size() const { return bytes.size() - start; }
+
+    void Push(const char* data, size_t size) { bytes.insert(bytes.end(), data, data + size); }
+
+    size_t Pop(char* data, size_t size)
+    {
+        size = std::min(size, Size());
+        memcpy(data, Data(), size);
+        Drop(size);
+        return size;
+    }
+
+    // The bytes waiting, to write them out without copying (then 'Drop' what was written).
+    const char* Data() const { return bytes.data() + start; }
+
+    void Drop(size_t size)
+    {
+        start += size;
+        // Move what's left to the front once that's at most as much as what was read, so each byte is moved
+        // at most once on average.
+        if (start == bytes.size())
+        {
+            bytes.clear();
+            start = 0;
+        }
+        else if (start >= bytes.size() / 2)
+        {
+            bytes.erase(bytes.begin(), bytes.begin() + start);
+            start = 0;
+        }
+    }
+};
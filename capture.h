@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "protocol.h"
+#include "timing.h"
+
+
+// A recording of every frame the server received, so real traffic can be played back against a server
+// later with 'Replay'. Records are as small as we can make them without compressing: the time is the
+// delta to the previous record, and numbers are varints (7 bits per byte, the high bit says more follow).
+//
+//     file:   | "CHATCAP1" | record | record | ...
+//     record: | delta (varint, microseconds) | connection (varint) | type (1 byte) | size (varint) | payload |
+//
+// A record with type CAPTURE_CLOSED (and no payload) means the connection went away. Connections are
+// numbered in the order they were accepted, so, unlike sockets, their ids are never reused.
+
+constexpr char    CAPTURE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'C', 'A', 'P', '1' };
+constexpr uint8_t CAPTURE_CLOSED   = 0;
+
+struct CaptureRecord
+{
+    uint64_t    time;        // Microseconds since the first record.
+    uint32_t    connection;
+    uint8_t     type;        // A 'FrameType', or CAPTURE_CLOSED.
+    uint32_t    size;
+    const char* payload;     // Only valid until the next record is read.
+};
+
+
+// Only used by the loop thread, so there's no locking. Records are collected in a buffer and written in
+// big chunks; a crash loses at most the last buffer, and a cut off record at the end is ignored on replay.
+struct CaptureWriter
+{
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+
+    int      fd       = -1;
+    uint64_t start    = 0;  // 'MonotonicNanoseconds' of the first record.
+    uint64_t previous = 0;  // Time of the previous record, in microseconds since 'start'.
+    uint64_t flushed  = 0;  // 'MonotonicNanoseconds' of the last flush.
+    uint8_t  buffer[BUFFER_SIZE];
+    size_t   size     = 0;
+
+    // Counters for the stats.
+    uint64_t records = 0;
+    uint64_t bytes   = 0;
+
+    bool Open(const char* path)
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return false;
+        memcpy(buffer, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        size = sizeof(CAPTURE_MAGIC);
+        return true;
+    }
+
+    bool Enabled() const { return fd != -1; }
+
+    // 'time' is from 'MonotonicNanoseconds'.
+    void Record(uint64_t time, uint32_t connection, uint8_t type, const char* payload, size_t payload_size)
+    {
+        if (fd == -1)
+            return;
+        if (size + 32 + payload_size > BUFFER_SIZE)
+            Flush();
+
+        if (records == 0)
+            start = time;
+        uint64_t now = time > start ? (time - start) / 1000 : 0;
+        if (now < previous)
+            now = previous;
+
+        size_t begin = size;
+        size += PutVarint(&buffer[size], now - previous);
+        size += PutVarint(&buffer[size], connection);
+        buffer[size++] = type;
+        size += PutVarint(&buffer[size], payload_size);
+        memcpy(&buffer[size], payload, payload_size);
+        size += payload_size;
+
+        previous = now;
+        ++records;
+        bytes += size - begin;
+    }
+
+    // Flushes if the last flush was more than a second ago, so a quiet server doesn't sit on its last records.
+    void Tick(uint64_t now)
+    {
+        if (fd != -1 && size > 0 && now - flushed > 1000000000ull)
+            Flush();
+    }
+
+    void Flush()
+    {
+        flushed = MonotonicNanoseconds();
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t bytes_written = write(fd, &buffer[written], size - written);
+            if (bytes_written <= 0)
+                break;  // The disk is broken. Drop the buffer rather than stall the loop.
+            written += bytes_written;
+        }
+        size = 0;
+    }
+
+    void Close()
+    {
+        if (fd == -1)
+            return;
+        Flush();
+        close(fd);
+        fd = -1;
+    }
+};
+
+
+// Reads a capture from start to end.
+struct CaptureReader
+{
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    FILE*    file = nullptr;
+    uint8_t* buffer   = nullptr;
+    size_t   size     = 0;
+    size_t   consumed = 0;
+    uint64_t time     = 0;
+
+    ~CaptureReader()
+    {
+        if (file != nullptr)
+            fclose(file);
+        delete[] buffer;
+    }
+
+    // Returns false if the file can't be opened or isn't a capture.
+    bool Open(const char* path)
+    {
+        file = fopen(path, "rb");
+        if (file == nullptr)
+            return false;
+        buffer = new uint8_t[BUFFER_SIZE];
+
+        char magic[sizeof(CAPTURE_MAGIC)];
+        return fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+    }
+
+    // Returns false at the end of the capture.
+    bool Next(CaptureRecord& record)
+    {
+        // A record is never bigger than this, so that much buffered always holds a whole one.
+        constexpr size_t MAXIMUM_RECORD_SIZE = 32 + MAXIMUM_PAYLOAD_SIZE;
+        if (size - consumed < MAXIMUM_RECORD_SIZE)
+        {
+            memmove(buffer, buffer + consumed, size - consumed);
+            size    -= consumed;
+            consumed = 0;
+            size    += fread(buffer + size, 1, BUFFER_SIZE - size, file);
+        }
+
+        const uint8_t* cursor = buffer + consumed;
+        const uint8_t* end    = buffer + size;
+        uint64_t delta, connection, payload_size;
+        size_t   length;
+        if ((length = GetVarint(cursor, end, delta)) == 0)
+            return false;
+        cursor += length;
+        if ((length = GetVarint(cursor, end, connection)) == 0 || cursor + length >= end)
+            return false;
+        cursor += length;
+        uint8_t type = *cursor++;
+        if ((length = GetVarint(cursor, end, payload_size)) == 0)
+            return false;
+        cursor += length;
+        if (payload_size > MAXIMUM_PAYLOAD_SIZE || (size_t) (end - cursor) < payload_size)
+            return false;  // Cut off (or garbage) at the end.
+
+        time += delta;
+        record.time       = time;
+        record.connection = (uint32_t) connection;
+        record.type       = type;
+        record.size       = (uint32_t) payload_size;
+        record.payload    = (const char*) cursor;
+        consumed = (cursor + payload_size) - buffer;
+        return true;
+    }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "server_core.h"
+#include "loopback.h"
+
+
+// The server as a library (the 'chat_core' target): what 'Server' runs, without its command line, listening
+// socket and signals, for programs that embed it and for benchmarks that drive it directly.
+//
+//     ChatServer server;
+//     server.Start();
+//     server.Listen(socket_fd);                       // Clients over TCP,
+//     LoopbackEndpoint* client = server.Connect();   // and (or) clients in this process.
+//     while (true)
+//         server.RunOnce(-1);
+//
+// The options are the globals at the top of server_core.h (set them before 'Start'), and the stages of the
+// message pipeline are in 'pipeline'. The state behind the object is global too, so there's one per
+// process: 'Start' fails for a second one.
+struct ChatServer
+{
+    bool Start()
+    {
+        if (epoll_fd != -1)
+            return false;
+        return StartEventLoop();
+    }
+
+    // Accepts clients on the (listening) socket from now on.
+    bool Listen(int socket_fd) { return ListenOn(socket_fd); }
+
+    // Serves a socket that's already connected (e.g. one end of a socketpair).
+    Connection* Attach(int socket_fd)
+    {
+        int flags = fcntl(socket_fd, F_GETFL, 0);
+        fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+        return AddConnection(socket_fd);
+    }
+
+    // A client in this process (see loopback.h).
+    LoopbackEndpoint* Connect() { return ConnectLoopback(); }
+
+    // Waits up to 'timeout' milliseconds (-1 is forever) for something to happen, and handles it.
+    int RunOnce(int timeout) { return ::RunOnce(timeout); }
+
+    // Handles what's ready without waiting, and without system calls if all clients are in this process.
+    int Poll() { return ::Poll(); }
+
+    // False once everything that came in was handled and sent (to the clients that take it).
+    bool Busy() const
+    {
+        return !readable_connections.empty() || !backlogged_connections.empty() || !dirty_connections.empty() ||
+               HoldingBroadcasts();
+    }
+
+    size_t              Clients() const  { return active_connections.size(); }
+    const LoopCounters& Counters() const { return loop_counters; }
+
+    // Only call on the loop's thread (other threads use 'RequestStats').
+    void PrintStats() { ::PrintStats(); }
+};
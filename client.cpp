@@ -1,13 +1,26 @@
+#include <algorithm>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <unistd.h>
 
-#include <pthread.h>
+#include "events.h"
+#include "protocol.h"
+#include "sketch.h"
+#include "terminal.h"
+#include "timing.h"
+#include "utf8.h"
 
 
 sa_family_t IPv4 = AF_INET;
@@ -19,96 +32,388 @@ sa_family_t UDP = SOCK_DGRAM;
 
 void Terminate(int code, const char* message)
 {
+    terminal.Stop();
     printf("[Exit %d]: %s\n", errno, message);fflush(stdout);
-    pthread_exit((void *) code);
+    exit(code);
 }
 
 
-void Initialize(int socket_fd)
+// Send one in this many messages with trace fields (0 means never). Set with '--trace-sample=<n>'.
+static unsigned trace_sample_rate = 0;
+
+// The connection is replaced when it drops, so the thread reading stdin always writes to the current one.
+static std::mutex current_lock;
+static int        current_socket = -1;
+
+// What we need to resume the session after reconnecting.
+static std::string user_id = "0";  // 0 lets the server pick one for us.
+static std::string token;          // Empty until the server welcomed us.
+static uint64_t    last_sequence = 0;
+
+// The history we've seen, kept in a file so it's there right away next time, and only what's new has to
+// come from the server (see 'SendSync'). Set with '--cache=<file>'.
+//
+//     | size (4 bytes) | history event (size bytes) |
+static int                   cache_fd = -1;
+static constexpr size_t      HISTORY_LINE_SIZE = MAXIMUM_PAYLOAD_SIZE + 128;
+static std::vector<uint32_t> cached_ids;
+
+
+bool SendFrame(FrameType type, const char* payload, size_t size, const FrameTrace* trace = nullptr)
 {
-    constexpr size_t BUFFER_SIZE = 1000;
-    char buffer[BUFFER_SIZE] = { 0 };
+    std::lock_guard<std::mutex> guard(current_lock);
+    return current_socket != -1 && WriteFrame(current_socket, type, payload, size, trace);
+}
+
+// Shows a line from the client itself, like a warning, right away.
+void Show(const char* format, ...)
+{
+    char    line[256];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    terminal.Print(line, length < (int) sizeof(line) ? (size_t) length : sizeof(line) - 1);
+    terminal.Render();
+}
+
+// Sends a message the user wrote, with trace fields for one in 'trace_sample_rate' of them.
+void SendText(const char* text, size_t size)
+{
+    // Trace ids only need to be unique within a trace file, so mixing in the start time and pid is enough.
+    // The top bit is left clear; it's reserved for ids made by the server.
+    static const uint64_t trace_base = (MonotonicNanoseconds() ^ ((uint64_t) getpid() << 40)) & 0x7FFFFFFFFFFF0000ull;
+    static uint64_t       sent       = 0;
+
+    FrameTrace  trace;
+    FrameTrace* traced = nullptr;
+    if (trace_sample_rate != 0 && sent % trace_sample_rate == 0)
+    {
+        trace.id          = trace_base + sent;
+        trace.client_send = MonotonicNanoseconds();
+        traced            = &trace;
+    }
+    ++sent;
 
-    // http://man7.org/linux/man-pages/man2/recvmsg.2.html
-    //     recv(socket, buffer, size, flags)
-    //          socket: any socket.
-    //          buffer: array to fill with the message.
-    //          size: the size of the buffer.
-    //          flags: options.
-    ssize_t bytes_received = recv(socket_fd, buffer, BUFFER_SIZE, 0);
-    if (bytes_received == -1)
-        Terminate(-1, "Issue with connection.");
-    else if (bytes_received == 0)
-        Terminate(-1, "The server disconnected.");
-
-    int id = atoi(buffer);
-    printf("[Info]: Connected with id %d.\n", id);fflush(stdout);
+    if (!SendFrame(FRAME_TEXT, text, size, traced))
+        Show("[Warning]: Not connected, the message wasn't sent.\n");
 }
 
 
-void ReadIndefinitely(int socket_fd)
+// On a terminal, reads the keys and sends each line when enter is pressed. Otherwise (e.g. piped), sends
+// whatever comes in.
+void ReadIndefinitely()
 {
-    constexpr size_t BUFFER_SIZE = 1024;
+    // Resizing the window interrupts the read here (SIGWINCH is blocked on the other threads).
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGWINCH);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    constexpr size_t BUFFER_SIZE = MAXIMUM_PAYLOAD_SIZE;
     char buffer[BUFFER_SIZE] = { 0 };
 
+    if (terminal.active)
+    {
+        std::vector<std::string> entered;
+        while (true)
+        {
+            ssize_t bytes_read = read(STDIN_FILENO, buffer, BUFFER_SIZE);
+            if (bytes_read == -1 && errno == EINTR)
+            {
+                terminal.Render();
+                continue;
+            }
+            if (bytes_read <= 0 || !terminal.HandleKeys(buffer, (size_t) bytes_read, entered))
+            {
+                terminal.Stop();
+                exit(0);
+            }
+            for (const std::string& line : entered)
+                SendText(line.data(), line.size());
+            entered.clear();
+            terminal.Render();
+        }
+    }
+
+    size_t carried = 0;
     while (true)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        ssize_t bytes_read = read(STDIN_FILENO, buffer, BUFFER_SIZE);
+        memset(buffer + carried, 0, BUFFER_SIZE - carried);
+        ssize_t bytes_read = read(STDIN_FILENO, buffer + carried, BUFFER_SIZE - carried);
 
         if (bytes_read <= 0)
             continue;
 
-        if (buffer[0] != '\0' && buffer[0] != '\n')
+        // A long paste takes several reads, and one can end in the middle of a character. The server drops
+        // text that isn't UTF-8, so the start of that character is kept for the next message.
+        size_t size     = carried + (size_t) bytes_read;
+        size_t complete = CompleteCharacters(buffer, size);
+
+        if (complete > 0 && buffer[0] != '\0' && buffer[0] != '\n')
+            SendText(buffer, complete);
+        carried = size - complete;
+        memmove(buffer, buffer + complete, carried);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+
+// Shows the history in the cache, and remembers which messages it has. A record cut off at the end (we
+// were killed while writing it) is dropped.
+bool LoadCache(const char* path)
+{
+    cache_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (cache_fd == -1)
+        return false;
+
+    std::string contents;
+    char        buffer[1 << 16];
+    ssize_t     bytes_read;
+    while ((bytes_read = read(cache_fd, buffer, sizeof(buffer))) > 0)
+        contents.append(buffer, bytes_read);
+
+    static char text[HISTORY_LINE_SIZE];
+    size_t cursor = 0;
+    while (contents.size() - cursor >= sizeof(uint32_t))
+    {
+        uint32_t size;
+        memcpy(&size, &contents[cursor], sizeof(size));
+        HistoryEvent history;
+        if (contents.size() - cursor - sizeof(size) < size ||
+            !Codec<HistoryEvent>::Decode(&contents[cursor + sizeof(size)], size, history))
+            break;
+        cached_ids.push_back(history.id);
+        int length = FormatEvent(&contents[cursor + sizeof(size)], size, text, sizeof(text));
+        if (length > 0)
+            terminal.Print(text, (size_t) length);
+        cursor += sizeof(size) + size;
+    }
+    if (cursor < contents.size() && ftruncate(cache_fd, cursor) == -1)
+        return false;
+    std::sort(cached_ids.begin(), cached_ids.end());
+    return true;
+}
+
+void CacheHistory(const char* event, size_t size)
+{
+    HistoryEvent history;
+    if (!Codec<HistoryEvent>::Decode(event, size, history))
+        return;
+    uint32_t    length = (uint32_t) size;
+    std::string record((const char*) &length, sizeof(length));
+    record.append(event, size);
+    if (write(cache_fd, record.data(), record.size()) != (ssize_t) record.size())
+        return;  // Only a cache, the message comes again with the next sync.
+    cached_ids.insert(std::upper_bound(cached_ids.begin(), cached_ids.end(), history.id), history.id);
+}
+
+// Asks the server for the history we don't have. The ids we have go into a Bloom filter of about 10 bits
+// each, so it's a few KB instead of a list of every id. One frame holds the filter for about 26000
+// messages, so with more than that cached only the newest are checked (the older ones are there anyway).
+void SendSync()
+{
+    constexpr size_t MAXIMUM_FILTER_SIZE = MAXIMUM_PAYLOAD_SIZE - 16;
+    constexpr size_t BITS_PER_ID         = 10;
+
+    size_t    count = std::min(cached_ids.size(), MAXIMUM_FILTER_SIZE * 8 / BITS_PER_ID);
+    SyncEvent sync;
+    sync.first = count > 0 ? cached_ids[cached_ids.size() - count] : 0;
+
+    BloomFilter held;
+    held.bits.assign(count > 0 ? (count * BITS_PER_ID + 7) / 8 : 0, 0);
+    held.hashes = BloomFilter::HashesFor(held.bits.size() * 8, count);
+    for (size_t i = cached_ids.size() - count; i < cached_ids.size(); ++i)
+        held.Add(cached_ids[i]);
+    sync.hashes = (uint8_t) held.hashes;
+    sync.filter = Bytes{ (const char*) held.bits.data(), (uint32_t) held.bits.size() };
+
+    static char encoded[MAXIMUM_PAYLOAD_SIZE];
+    SendFrame(FRAME_SYNC, encoded, Codec<SyncEvent>::Encode(sync, encoded));
+}
+
+
+// Connects and logs in, resuming the session if we had one. Returns the socket, or -1.
+int Connect(const sockaddr_in& server_address)
+{
+    // http://man7.org/linux/man-pages/man2/socket.2.html
+    int socket_fd = socket(IPv4, TCP, 0);
+    if (socket_fd == -1)
+        return -1;
+    if (connect(socket_fd, (const sockaddr*) &server_address, sizeof(server_address)) == -1)
+    {
+        close(socket_fd);
+        return -1;
+    }
+
+    // Log in with the user id we want to have. We'll get it unless someone else is using it. With the token
+    // and the last message we got, the server sends us only what we missed.
+    char login[64];
+    int  length = token.empty()
+                ? snprintf(login, sizeof(login), "%s", user_id.c_str())
+                : snprintf(login, sizeof(login), "%s %s %llu", user_id.c_str(), token.c_str(), (unsigned long long) last_sequence);
+    if (!WriteFrame(socket_fd, FRAME_LOGIN, login, length))
+    {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+
+void HandleFrame(const FrameHeader& header, const FrameReader& reader, const char* payload, size_t payload_size)
+{
+    if (header.type == FRAME_WELCOME)
+    {
+        // "<user id> <token> new|resumed"
+        std::string welcome(payload, payload_size);
+        size_t first  = welcome.find(' ');
+        size_t second = welcome.find(' ', first + 1);
+        if (first == std::string::npos || second == std::string::npos)
+            return;
+        bool resumed = welcome.compare(second + 1, std::string::npos, "resumed") == 0;
+        if (!resumed)
+            last_sequence = 0;  // A new session numbers from the start again.
+        user_id = welcome.substr(0, first);
+        token   = welcome.substr(first + 1, second - first - 1);
+
+        if (resumed)
         {
-            ssize_t bytes_written = write(socket_fd, buffer, bytes_read);
-            if (bytes_written == -1)
-                Terminate(-1, "Couldn't write to socket.");
+            Show("[Info]: Resumed the session as id %s.\n", user_id.c_str());
         }
+        else
+        {
+            Show("[Info]: Connected with id %s.\n", user_id.c_str());
+            Show("[Info]: Send '/msg <user id> <text>' to message a single user.\n");
+            Show("[Info]: Send '/search [since:<seconds>] <words>' to search the chat history.\n");
+            if (terminal.active)
+                Show("[Info]: Page Up/Page Down scroll back, Ctrl-C quits.\n");
+
+            // A resumed session gets what it missed anyway, a new one catches up on the history.
+            if (cache_fd != -1)
+                SendSync();
+        }
+        return;
+    }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (header.type != FRAME_EVENT)
+        return;
+    if (header.flags & FRAME_SEQUENCED)
+    {
+        // Resuming can send again what we got just before the connection dropped.
+        if (reader.sequence <= last_sequence)
+            return;
+        last_sequence = reader.sequence;
     }
+
+    if (cache_fd != -1 && EncodedType(payload, payload_size) == EVENT_HISTORY)
+        CacheHistory(payload, payload_size);
+
+    static char text[HISTORY_LINE_SIZE];
+    int length = FormatEvent(payload, payload_size, text, sizeof(text));
+    if (length > 0)
+        terminal.Print(text, (size_t) length);
 }
 
 
-void WriteIndefinitely(int socket_fd)
+// Prints whatever the server sends. When the connection drops, reconnects (waiting longer after each
+// failure) and resumes the session.
+void WriteIndefinitely(const sockaddr_in& server_address)
 {
-    constexpr size_t BUFFER_SIZE = 1000;
-    char buffer[BUFFER_SIZE] = { 0 };
+    static char scratch[1 << 17];
+    unsigned    backoff = 1;  // Seconds.
 
     while (true)
     {
-        memset(buffer, 0, 1000);
-        ssize_t bytes_received = recv(socket_fd, buffer, BUFFER_SIZE, 0);
-        if (bytes_received == -1)
-            Terminate(-1, "Couldn't write to socket.");
+        FrameReader reader;
+        reader.maximum_payload = 0xFFFF;  // The server's replies can be bigger than what we may send.
 
-        printf("%s", buffer); fflush(stdout);
+        int socket_fd;
+        {
+            std::lock_guard<std::mutex> guard(current_lock);
+            socket_fd = current_socket;
+        }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        while (true)
+        {
+            uint64_t acknowledged = last_sequence;
+            ssize_t  bytes_received = reader.Receive(socket_fd, scratch, sizeof(scratch));
+
+            FrameHeader header;
+            FrameTrace  trace;
+            const char* payload      = NULL;
+            size_t      payload_size = 0;
+            bool        malformed    = false;
+            while (reader.Next(header, trace, payload, payload_size, malformed))
+                HandleFrame(header, reader, payload, payload_size);
+            reader.Finish();
+            terminal.Render();  // Everything that came in, in one write.
+
+            if (bytes_received <= 0 || malformed)
+                break;
+            backoff = 1;
+
+            // One acknowledgement for everything that came in this read, so the server can let go of it.
+            if (last_sequence != acknowledged)
+            {
+                AckEvent ack;
+                char     encoded[MAXIMUM_FIXED_EVENT_SIZE];
+                ack.sequence = last_sequence;
+                SendFrame(FRAME_ACK, encoded, Codec<AckEvent>::Encode(ack, encoded));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(current_lock);
+            close(current_socket);
+            current_socket = -1;
+        }
+        Show("[Warning]: Lost the connection to the server, reconnecting.\n");
+
+        while (true)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(backoff));
+            backoff = backoff * 2 < 30 ? backoff * 2 : 30;
+
+            int reconnected = Connect(server_address);
+            if (reconnected != -1)
+            {
+                std::lock_guard<std::mutex> guard(current_lock);
+                current_socket = reconnected;
+                break;
+            }
+        }
     }
 }
 
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
-        Terminate(1, "Usage: <address> <port>\n");
+    const char* usage = "Usage: <address> <port> [user id] [--trace-sample=<n>] [--cache=<file>]\n";
+    const char* cache_path = nullptr;
+    if (argc < 3)
+        Terminate(1, usage);
 
     const char* address = argv[1];
     const int   port = atoi(argv[2]);
 
-    int max_size_to_receive = 1024;
+    for (int i = 3; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--trace-sample=", 15) == 0)
+            trace_sample_rate = (unsigned) atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+            cache_path = argv[i] + 8;
+        else if (argv[i][0] != '-')
+            user_id = argv[i];
+        else
+            Terminate(1, usage);
+    }
+
     int success = 0;
 
     printf("[Info]: Trying to connect to server %s on port %d.\n", address, port);fflush(stdout);
 
-    // http://man7.org/linux/man-pages/man2/socket.2.html
-    int client_socket = socket(IPv4, TCP, 0);
-    if (client_socket == -1)
-        Terminate(success, "Couldn't create socket.");
-
-
     // http://man7.org/linux/man-pages/man7/ip.7.html
     // struct sockaddr_in {
     //     sa_family_t    sin_family; /* address family: AF_INET */
@@ -122,39 +427,25 @@ int main(int argc, char* argv[])
     success = inet_pton(IPv4, address, &server_address.sin_addr);  // pton == Pointer (to String) to Number.
     if (success <= 0)
         Terminate(success, "Invalid address.");
-    success = connect(client_socket, (sockaddr*)&server_address, sizeof(server_address));
-    if (success == -1)
+
+    current_socket = Connect(server_address);
+    if (current_socket == -1)
         Terminate(success, "Couldn't connect to server.");
 
     printf("[Info]: Connected to server!\n");fflush(stdout);
 
-
-    // Start by receiving the ID and then the welcome message.
-    char* buffer = new char[max_size_to_receive];
-
-    // http://man7.org/linux/man-pages/man2/recvmsg.2.html
-    //     recv(socket, buffer, size, flags)
-    //          socket: any socket.
-    //          buffer: array to fill with the message.
-    //          size: the size of the buffer.
-    //          flags: options.
-    ssize_t bytes_received = recv(client_socket, buffer, max_size_to_receive, 0);
-    if (bytes_received == -1)
-        Terminate(success, "Issue with connection.");
-    else if (bytes_received == 0)
-        Terminate(success, "The server disconnected.");
-
-    int id = atoi(buffer);
-    printf("[Info]: Connected with id %d.\n", id);fflush(stdout);
+    // Only the input thread handles SIGWINCH (see 'ReadIndefinitely'), a read of the socket shouldn't be
+    // interrupted by it.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    terminal.Start();
+    if (cache_path != nullptr && !LoadCache(cache_path))
+        Terminate(1, "Couldn't open the history cache.");
 
     // This will run until we disconnect. It's from here we'll send/recieve all messages to the server.
-    int pid = fork();
-    if (pid == 0)
-    {
-        ReadIndefinitely(client_socket);
-    }
-    else
-    {
-        WriteIndefinitely(client_socket);
-    }
-}
\ No newline at end of file
+    std::thread input(ReadIndefinitely);
+    input.detach();
+    WriteIndefinitely(server_address);
+}
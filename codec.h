@@ -0,0 +1,282 @@
+#pragma once
+
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <endian.h>
+
+
+// Binary encoding of plain structs, generated at compile time from a table of their fields. A struct is
+// made encodable by specializing 'Schema' for it:
+//
+//     struct LeaveEvent { uint8_t resumable; uint32_t user; };
+//
+//     template<> struct Schema<LeaveEvent>
+//     {
+//         static constexpr uint8_t TYPE   = EVENT_LEAVE;
+//         static constexpr auto    FIELDS = std::make_tuple(Fixed(&LeaveEvent::resumable), Varint(&LeaveEvent::user));
+//     };
+//
+//     char   buffer[64];
+//     size_t size = Codec<LeaveEvent>::Encode(leave, buffer);
+//     bool   ok   = Codec<LeaveEvent>::Decode(buffer, size, leave);
+//
+// An encoded struct starts with its type, then all fixed size fields (in network order, at offsets known
+// at compile time), and then the varints and byte strings in the order they're listed:
+//
+//     | type (1 byte) | fixed fields ... | varints and byte strings ... |
+//
+// A byte string is its size (a varint) followed by the bytes. Decoding doesn't copy it, the 'Bytes' points
+// into the input. Nothing allocates. Decoders skip bytes after the last field they know, so fields can be
+// added at the end without breaking older readers.
+
+
+// ---- VARINTS ----
+// 7 bits per byte, least significant first. The high bit says more bytes follow.
+
+inline size_t PutVarint(uint8_t* out, uint64_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (uint8_t) value;
+    return size;
+}
+
+// Returns the number of bytes read, or 0 if the varint doesn't end before 'end'.
+inline size_t GetVarint(const uint8_t* in, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for (size_t i = 0; in + i < end && i < 10; ++i)
+    {
+        value |= (uint64_t) (in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+constexpr size_t VarintSize(uint64_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+
+// ---- FIELDS ----
+
+// A view of bytes somewhere else: in the input when decoding, wherever the caller keeps them when encoding.
+struct Bytes
+{
+    const char* data = nullptr;
+    uint32_t    size = 0;
+};
+
+template<typename Struct, typename T>
+struct FixedField
+{
+    static_assert(std::is_integral<T>::value && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8),
+                  "Fixed fields are integers of 1, 2, 4 or 8 bytes.");
+    static constexpr size_t WIDTH = sizeof(T);  // Bytes in the fixed part.
+    T Struct::* member;
+};
+
+template<typename Struct, typename T>
+struct VarintField
+{
+    static_assert(std::is_unsigned<T>::value, "Varint fields are unsigned integers.");
+    static constexpr size_t WIDTH = 0;
+    T Struct::* member;
+};
+
+template<typename Struct>
+struct BytesField
+{
+    static constexpr size_t WIDTH = 0;
+    Bytes Struct::* member;
+};
+
+template<typename Struct, typename T> constexpr FixedField<Struct, T>  Fixed(T Struct::* member)      { return { member }; }
+template<typename Struct, typename T> constexpr VarintField<Struct, T> Varint(T Struct::* member)     { return { member }; }
+template<typename Struct>             constexpr BytesField<Struct>     String(Bytes Struct::* member) { return { member }; }
+
+template<typename Struct>
+struct Schema;  // Specialized for every encodable struct, see above.
+
+
+template<typename T>
+inline void StoreFixed(char* out, T value)
+{
+    if constexpr (sizeof(T) == 1) { uint8_t  v = (uint8_t) value;           memcpy(out, &v, 1); }
+    if constexpr (sizeof(T) == 2) { uint16_t v = htobe16((uint16_t) value); memcpy(out, &v, 2); }
+    if constexpr (sizeof(T) == 4) { uint32_t v = htobe32((uint32_t) value); memcpy(out, &v, 4); }
+    if constexpr (sizeof(T) == 8) { uint64_t v = htobe64((uint64_t) value); memcpy(out, &v, 8); }
+}
+
+template<typename T>
+inline T LoadFixed(const char* in)
+{
+    if constexpr (sizeof(T) == 1) { uint8_t  v; memcpy(&v, in, 1); return (T) v; }
+    if constexpr (sizeof(T) == 2) { uint16_t v; memcpy(&v, in, 2); return (T) be16toh(v); }
+    if constexpr (sizeof(T) == 4) { uint32_t v; memcpy(&v, in, 4); return (T) be32toh(v); }
+    if constexpr (sizeof(T) == 8) { uint64_t v; memcpy(&v, in, 8); return (T) be64toh(v); }
+}
+
+
+// ---- CODEC ----
+
+template<typename Struct>
+struct Codec
+{
+    using Fields = std::remove_const_t<decltype(Schema<Struct>::FIELDS)>;
+    static constexpr size_t COUNT = std::tuple_size<Fields>::value;
+
+    template<size_t... I>
+    static constexpr size_t Widths(std::index_sequence<I...>) { return (size_t(0) + ... + std::tuple_element_t<I, Fields>::WIDTH); }
+
+    // Where the fixed field I starts, and where the variable part starts.
+    template<size_t I>
+    static constexpr size_t OFFSET     = 1 + Widths(std::make_index_sequence<I>());
+    static constexpr size_t FIXED_SIZE = 1 + Widths(std::make_index_sequence<COUNT>());
+
+
+    // The exact number of bytes 'Encode' writes.
+    static size_t Size(const Struct& value)
+    {
+        return Size(value, std::make_index_sequence<COUNT>());
+    }
+
+    // Writes the struct to 'out', which must have room for 'Size(value)' bytes, and returns the size. A byte
+    // string that's already where it would be written (the caller built the message around it) isn't copied.
+    static size_t Encode(const Struct& value, char* out)
+    {
+        out[0] = (char) Schema<Struct>::TYPE;
+        char* cursor = out + FIXED_SIZE;
+        Encode(value, out, cursor, std::make_index_sequence<COUNT>());
+        return (size_t) (cursor - out);
+    }
+
+    // Returns false if the input isn't this struct, or is cut off.
+    static bool Decode(const char* data, size_t size, Struct& value)
+    {
+        if (size < FIXED_SIZE || (uint8_t) data[0] != Schema<Struct>::TYPE)
+            return false;
+        const char* cursor = data + FIXED_SIZE;
+        return Decode(value, data, cursor, data + size, std::make_index_sequence<COUNT>());
+    }
+
+
+private:
+    template<size_t I>
+    static size_t FieldSize(const Struct& value)
+    {
+        using Field = std::tuple_element_t<I, Fields>;
+        constexpr auto field = std::get<I>(Schema<Struct>::FIELDS);
+        if constexpr (Field::WIDTH != 0)
+            return 0;  // Counted in FIXED_SIZE.
+        else if constexpr (std::is_same<Field, BytesField<Struct>>::value)
+            return VarintSize((value.*field.member).size) + (value.*field.member).size;
+        else
+            return VarintSize((uint64_t) (value.*field.member));
+    }
+
+    template<size_t... I>
+    static size_t Size(const Struct& value, std::index_sequence<I...>)
+    {
+        return (FIXED_SIZE + ... + FieldSize<I>(value));
+    }
+
+    template<size_t I>
+    static void EncodeField(const Struct& value, char* out, char*& cursor)
+    {
+        using Field = std::tuple_element_t<I, Fields>;
+        constexpr auto field = std::get<I>(Schema<Struct>::FIELDS);
+        if constexpr (Field::WIDTH != 0)
+        {
+            StoreFixed(out + OFFSET<I>, value.*field.member);
+        }
+        else if constexpr (std::is_same<Field, BytesField<Struct>>::value)
+        {
+            const Bytes& bytes = value.*field.member;
+            cursor += PutVarint((uint8_t*) cursor, bytes.size);
+            if (bytes.data != cursor)
+                memmove(cursor, bytes.data, bytes.size);
+            cursor += bytes.size;
+        }
+        else
+        {
+            cursor += PutVarint((uint8_t*) cursor, (uint64_t) (value.*field.member));
+        }
+    }
+
+    template<size_t... I>
+    static void Encode(const Struct& value, char* out, char*& cursor, std::index_sequence<I...>)
+    {
+        (EncodeField<I>(value, out, cursor), ...);
+    }
+
+    template<size_t I>
+    static bool DecodeField(Struct& value, const char* data, const char*& cursor, const char* end)
+    {
+        using Field = std::tuple_element_t<I, Fields>;
+        constexpr auto field = std::get<I>(Schema<Struct>::FIELDS);
+        if constexpr (Field::WIDTH != 0)
+        {
+            using T = std::remove_reference_t<decltype(value.*field.member)>;
+            value.*field.member = LoadFixed<T>(data + OFFSET<I>);
+            return true;
+        }
+        else
+        {
+            uint64_t number;
+            size_t   length = GetVarint((const uint8_t*) cursor, (const uint8_t*) end, number);
+            if (length == 0)
+                return false;
+            cursor += length;
+
+            if constexpr (std::is_same<Field, BytesField<Struct>>::value)
+            {
+                if (number > (uint64_t) (end - cursor))
+                    return false;
+                (value.*field.member).data = cursor;
+                (value.*field.member).size = (uint32_t) number;
+                cursor += number;
+            }
+            else
+            {
+                using T = std::remove_reference_t<decltype(value.*field.member)>;
+                if (number > (uint64_t) std::numeric_limits<T>::max())
+                    return false;
+                value.*field.member = (T) number;
+            }
+            return true;
+        }
+    }
+
+    template<size_t... I>
+    static bool Decode(Struct& value, const char* data, const char*& cursor, const char* end, std::index_sequence<I...>)
+    {
+        return (true && ... && DecodeField<I>(value, data, cursor, end));
+    }
+};
+
+
+// The type of an encoded struct, to pick the codec to decode it with. Returns 0 for an empty input.
+inline uint8_t EncodedType(const char* data, size_t size)
+{
+    return size > 0 ? (uint8_t) data[0] : 0;
+}
@@ -1,6 +1,7 @@
 #include <thread>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
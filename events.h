@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+#include "codec.h"
+
+
+// What the server tells clients, and what clients tell the server besides text, as structs encoded with
+// 'Codec' (see codec.h). Everything the server sends in a FRAME_EVENT is one of these.
+//
+//     chat     | 1 | sender (varint) | recipient (varint, 0 for everyone) | text (bytes) |
+//     join     | 2 | user (varint) |
+//     leave    | 3 | resumable (1 byte) | user (varint) |
+//     notice   | 4 | text (bytes) |
+//     ack      | 5 | sequence (varint) |
+//     sync     | 6 | first (varint) | hashes (1 byte) | filter (bytes) |
+//     history  | 7 | id (varint) | sender (varint) | time (varint) | text (bytes) |
+//
+// Join and leave are the presence events; they're only sent if the server announces presence.
+
+enum EventType : uint8_t
+{
+    EVENT_CHAT    = 1,
+    EVENT_JOIN    = 2,
+    EVENT_LEAVE   = 3,
+    EVENT_NOTICE  = 4,  // Text from the server itself (command usage, search results, ...).
+    EVENT_ACK     = 5,  // Client to server, in a FRAME_ACK.
+    EVENT_SYNC    = 6,  // Client to server, in a FRAME_SYNC.
+    EVENT_HISTORY = 7,  // A message from the history, in reply to a sync.
+};
+
+struct ChatEvent
+{
+    uint32_t sender    = 0;
+    uint32_t recipient = 0;
+    Bytes    text;
+};
+
+struct JoinEvent
+{
+    uint32_t user = 0;
+};
+
+struct LeaveEvent
+{
+    uint8_t  resumable = 0;  // The user's session is kept, so it may be back with everything it missed.
+    uint32_t user      = 0;
+};
+
+struct NoticeEvent
+{
+    Bytes text;
+};
+
+// Everything up to and including 'sequence' arrived.
+struct AckEvent
+{
+    uint64_t sequence = 0;
+};
+
+// Asks for the history from message 'first' on, except what the client already has: the ids in the Bloom
+// filter (see 'BloomFilter' in sketch.h) of 'hashes' hashes over the bits in 'filter'. The server sends
+// the newest of the others, as history events, and then a notice.
+struct SyncEvent
+{
+    uint32_t first  = 0;
+    uint8_t  hashes = 0;
+    Bytes    filter;
+};
+
+// A broadcast message from the history. 'time' is in ms since the epoch.
+struct HistoryEvent
+{
+    uint32_t id     = 0;
+    uint32_t sender = 0;
+    uint64_t time   = 0;
+    Bytes    text;
+};
+
+
+template<> struct Schema<ChatEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_CHAT;
+    static constexpr auto    FIELDS = std::make_tuple(Varint(&ChatEvent::sender), Varint(&ChatEvent::recipient), String(&ChatEvent::text));
+};
+
+template<> struct Schema<JoinEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_JOIN;
+    static constexpr auto    FIELDS = std::make_tuple(Varint(&JoinEvent::user));
+};
+
+template<> struct Schema<LeaveEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_LEAVE;
+    static constexpr auto    FIELDS = std::make_tuple(Fixed(&LeaveEvent::resumable), Varint(&LeaveEvent::user));
+};
+
+template<> struct Schema<NoticeEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_NOTICE;
+    static constexpr auto    FIELDS = std::make_tuple(String(&NoticeEvent::text));
+};
+
+template<> struct Schema<AckEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_ACK;
+    static constexpr auto    FIELDS = std::make_tuple(Varint(&AckEvent::sequence));
+};
+
+template<> struct Schema<SyncEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_SYNC;
+    static constexpr auto    FIELDS = std::make_tuple(Varint(&SyncEvent::first), Fixed(&SyncEvent::hashes), String(&SyncEvent::filter));
+};
+
+template<> struct Schema<HistoryEvent>
+{
+    static constexpr uint8_t TYPE   = EVENT_HISTORY;
+    static constexpr auto    FIELDS = std::make_tuple(Varint(&HistoryEvent::id), Varint(&HistoryEvent::sender),
+                                                      Varint(&HistoryEvent::time), String(&HistoryEvent::text));
+};
+
+// The largest event without a byte string, for stack buffers.
+constexpr size_t MAXIMUM_FIXED_EVENT_SIZE = 32;
+
+
+// Turns an event into the text a client shows for it. Returns the number of characters written (at most
+// 'capacity'), or -1 if it isn't an event we know.
+inline int FormatEvent(const char* data, size_t size, char* out, size_t capacity)
+{
+    int length = -1;
+    switch (EncodedType(data, size))
+    {
+        case EVENT_CHAT:
+        {
+            ChatEvent chat;
+            if (Codec<ChatEvent>::Decode(data, size, chat))
+                length = snprintf(out, capacity, chat.recipient ? "Client %u (private): %.*s" : "Client %u: %.*s",
+                                  chat.sender, (int) chat.text.size, chat.text.data);
+            break;
+        }
+        case EVENT_JOIN:
+        {
+            JoinEvent join;
+            if (Codec<JoinEvent>::Decode(data, size, join))
+                length = snprintf(out, capacity, ">>> Client %u joined <<<\n", join.user);
+            break;
+        }
+        case EVENT_LEAVE:
+        {
+            LeaveEvent leave;
+            if (Codec<LeaveEvent>::Decode(data, size, leave))
+                length = snprintf(out, capacity, ">>> Client %u left <<<\n", leave.user);
+            break;
+        }
+        case EVENT_NOTICE:
+        {
+            NoticeEvent notice;
+            if (Codec<NoticeEvent>::Decode(data, size, notice))
+                length = snprintf(out, capacity, "%.*s", (int) notice.text.size, notice.text.data);
+            break;
+        }
+        case EVENT_HISTORY:
+        {
+            HistoryEvent history;
+            if (!Codec<HistoryEvent>::Decode(data, size, history))
+                break;
+            time_t    seconds = (time_t) (history.time / 1000);
+            struct tm local;
+            localtime_r(&seconds, &local);
+            length = snprintf(out, capacity, "[%04d-%02d-%02d %02d:%02d] Client %u: %.*s", local.tm_year + 1900,
+                              local.tm_mon + 1, local.tm_mday, local.tm_hour, local.tm_min, history.sender,
+                              (int) history.text.size, history.text.data);
+            break;
+        }
+    }
+    return length < 0 ? -1 : (size_t) length < capacity ? length : (int) capacity - 1;
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "timing.h"
+
+
+// Finds any of a (large) set of banned words and links in a message, ignoring ASCII case.
+//
+// Most messages contain none of them, so the scan is split in two:
+//
+//     1. A prefilter (Teddy, from Hyperscan) looks at 16 positions at a time and says where a pattern could
+//        start. Patterns are spread over 8 buckets, and for each of the first 3 bytes of a pattern there's a
+//        table from the low nibble and one from the high nibble of a byte to the buckets that have a pattern
+//        with such a byte there. Looking up both nibbles of 16 bytes is one 'pshufb' each, and ANDing the
+//        results for the 3 offsets leaves the buckets that match all 3 bytes at each position.
+//     2. Only if there's a candidate, an Aho-Corasick automaton runs from there and says if a pattern really
+//        is in the message. It's a full DFA over the bytes that occur in patterns (all other bytes share one
+//        column), so it's one table lookup per byte, and it doesn't matter how many patterns there are.
+//
+// With thousands of patterns the buckets fill up and the prefilter lets more through, but never more than
+// the automaton can handle on its own: it only decides where the automaton starts.
+//
+//     PatternSet* set = PatternSet::Compile({ "spam", "http://" });
+//     set->Find(text, size);  // Index of a pattern that occurs, or -1.
+struct PatternSet
+{
+    static constexpr int      PREFIX  = 3;         // Bytes of each pattern the prefilter looks at.
+    static constexpr int      BUCKETS = 8;
+    static constexpr uint32_t MAXIMUM_STATES = 1 << 20;
+
+    std::vector<std::string> patterns;  // Lowercase.
+
+    // Prefilter. 'low[k][n]' are the buckets with a pattern whose byte k has low nibble n, same for 'high'.
+    int     prefix = 0;  // Offsets used, at most the length of the shortest pattern.
+    uint8_t low[PREFIX][16]  = {};
+    uint8_t high[PREFIX][16] = {};
+
+    // Automaton. The next state is 'transitions[state * classes + byte_class[byte]]', and a state is a
+    // match if 'matches[state]' is a pattern index (not -1).
+    uint8_t               byte_class[256] = {};
+    uint32_t              classes = 1;
+    std::vector<uint32_t> transitions;
+    std::vector<int32_t>  matches;
+
+
+    // Returns nullptr if there are no patterns, or too many to build the automaton for.
+    static PatternSet* Compile(std::vector<std::string> patterns)
+    {
+        std::unique_ptr<PatternSet> set(new PatternSet);
+        for (std::string& pattern : patterns)
+        {
+            for (char& c : pattern)
+                c = Lower(c);
+            if (!pattern.empty())
+                set->patterns.push_back(std::move(pattern));
+        }
+        if (set->patterns.empty() || !set->BuildAutomaton())
+            return nullptr;
+        set->BuildPrefilter();
+        return set.release();
+    }
+
+    // Index of a pattern that occurs in the text, or -1.
+    int Find(const char* text, size_t size) const
+    {
+        size_t start = FirstCandidate((const uint8_t*) text, size);
+        if (start == size)
+            return -1;
+
+        uint32_t state = 0;
+        for (size_t i = start; i < size; ++i)
+        {
+            state = transitions[state * classes + byte_class[(uint8_t) text[i]]];
+            if (matches[state] >= 0)
+                return matches[state];
+        }
+        return -1;
+    }
+
+    size_t Memory() const
+    {
+        return sizeof(PatternSet) + transitions.size() * sizeof(uint32_t) + matches.size() * sizeof(int32_t);
+    }
+
+
+private:
+    static char Lower(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+    bool BuildAutomaton()
+    {
+        // Bytes that don't occur in any pattern all behave the same, so they share class 0.
+        for (const std::string& pattern : patterns)
+            for (char c : pattern)
+                if (byte_class[(uint8_t) c] == 0)
+                    byte_class[(uint8_t) c] = (uint8_t) classes++;
+        for (int c = 'A'; c <= 'Z'; ++c)
+            byte_class[c] = byte_class[c - 'A' + 'a'];
+        if (classes > 256)
+            return false;
+
+        // The trie first, with 0 for "no edge" (the root can't be a child).
+        std::vector<uint32_t> trie(classes, 0);
+        matches.assign(1, -1);
+        for (size_t p = 0; p < patterns.size(); ++p)
+        {
+            uint32_t state = 0;
+            for (char c : patterns[p])
+            {
+                uint32_t& next = trie[state * classes + byte_class[(uint8_t) c]];
+                if (next == 0)
+                {
+                    if (matches.size() == MAXIMUM_STATES)
+                        return false;
+                    next = (uint32_t) matches.size();
+                    matches.push_back(-1);
+                    trie.resize(trie.size() + classes, 0);
+                }
+                state = trie[state * classes + byte_class[(uint8_t) c]];
+            }
+            if (matches[state] < 0)
+                matches[state] = (int32_t) p;
+        }
+
+        // Then breadth first, fill in the missing edges from the failure state (the longest proper suffix
+        // that's also in the trie), which is always shallower and so already complete.
+        transitions = trie;
+        std::vector<uint32_t> failure(matches.size(), 0);
+        std::vector<uint32_t> queue;
+        for (uint32_t c = 0; c < classes; ++c)
+            if (trie[c] != 0)
+                queue.push_back(trie[c]);
+        for (size_t head = 0; head < queue.size(); ++head)
+        {
+            uint32_t state = queue[head];
+            if (matches[state] < 0)
+                matches[state] = matches[failure[state]];  // A pattern that ends in this one.
+            for (uint32_t c = 0; c < classes; ++c)
+            {
+                uint32_t  fallback = transitions[failure[state] * classes + c];
+                uint32_t& next     = transitions[state * classes + c];
+                if (trie[state * classes + c] != 0)
+                {
+                    failure[next] = fallback;
+                    queue.push_back(next);
+                }
+                else
+                {
+                    next = fallback;
+                }
+            }
+        }
+        return true;
+    }
+
+    void BuildPrefilter()
+    {
+        prefix = PREFIX;
+        for (const std::string& pattern : patterns)
+            prefix = (int) pattern.size() < prefix ? (int) pattern.size() : prefix;
+
+        // Patterns with the same first bytes go in the same bucket, so a bucket's bits in the tables stay
+        // as specific as they can.
+        std::vector<size_t> order(patterns.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return patterns[a] < patterns[b]; });
+
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            const std::string& pattern = patterns[order[i]];
+            uint8_t            bucket  = (uint8_t) (1 << (i * BUCKETS / order.size()));
+            for (int k = 0; k < prefix; ++k)
+            {
+                uint8_t c = (uint8_t) pattern[k];
+                uint8_t u = (c >= 'a' && c <= 'z') ? (uint8_t) (c - 'a' + 'A') : c;
+                low[k][c & 15] |= bucket;
+                high[k][c >> 4] |= bucket;
+                low[k][u & 15] |= bucket;
+                high[k][u >> 4] |= bucket;
+            }
+        }
+    }
+
+    // Where the first pattern could start, or 'size' if none can.
+    size_t FirstCandidate(const uint8_t* text, size_t size) const
+    {
+        size_t i = 0;
+#if defined(__x86_64__)
+        static const bool ssse3 = __builtin_cpu_supports("ssse3");
+        if (ssse3 && FirstCandidateSsse3(text, size, i))
+            return i;
+#endif
+        for (; i + prefix <= size; ++i)
+        {
+            uint8_t buckets = 0xFF;
+            for (int k = 0; k < prefix; ++k)
+                buckets &= low[k][text[i + k] & 15] & high[k][text[i + k] >> 4];
+            if (buckets)
+                return i;
+        }
+        return size;
+    }
+
+#if defined(__x86_64__)
+    // Looks at blocks of 16 positions as long as all 'PREFIX' bytes after them are in the text, and leaves
+    // 'i' at the first position it didn't look at (for the scalar loop to go on from).
+    __attribute__((target("ssse3")))
+    bool FirstCandidateSsse3(const uint8_t* text, size_t size, size_t& i) const
+    {
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i       low_table[PREFIX];
+        __m128i       high_table[PREFIX];
+        for (int k = 0; k < PREFIX; ++k)
+        {
+            // Offsets past 'prefix' match everything.
+            low_table[k]  = k < prefix ? _mm_loadu_si128((const __m128i*) low[k]) : _mm_set1_epi8((char) 0xFF);
+            high_table[k] = k < prefix ? _mm_loadu_si128((const __m128i*) high[k]) : _mm_set1_epi8((char) 0xFF);
+        }
+
+        for (; i + 16 + PREFIX - 1 <= size; i += 16)
+        {
+            __m128i buckets = _mm_set1_epi8((char) 0xFF);
+            for (int k = 0; k < PREFIX; ++k)
+            {
+                __m128i bytes = _mm_loadu_si128((const __m128i*) (text + i + k));
+                __m128i lo    = _mm_shuffle_epi8(low_table[k], _mm_and_si128(bytes, nibble));
+                __m128i hi    = _mm_shuffle_epi8(high_table[k], _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+                buckets = _mm_and_si128(buckets, _mm_and_si128(lo, hi));
+            }
+            int none = _mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128()));
+            if (none != 0xFFFF)
+            {
+                i += __builtin_ctz(~none & 0xFFFF);
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+};
+
+
+// The pattern set in use, replaced as a whole when the file changes. Any thread can load a new set (it's
+// compiled there, so nothing waits for it), and the thread that filters picks it up with its next message
+// and frees the old one. Messages are never held up by a reload.
+//
+//     filter.Load("banned.txt");       // At startup.
+//     filter.Reload();                 // On SIGHUP, from any thread.
+//     int pattern = filter.Find(text, size);
+struct ContentFilter
+{
+    std::string              path;
+    std::atomic<PatternSet*> pending{ nullptr };
+    PatternSet*              current = nullptr;  // Only touched by the filtering thread.
+
+    // Counters for the stats.
+    std::atomic<uint64_t> loads{ 0 };
+    std::atomic<uint32_t> pattern_count{ 0 };
+    std::atomic<uint64_t> memory{ 0 };
+    std::atomic<uint64_t> scanned{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> blocked{ 0 };
+    std::atomic<uint64_t> nanoseconds{ 0 };
+
+    bool Enabled() const { return !path.empty(); }
+
+    // Reads one pattern per line. Empty lines and lines starting with '#' are skipped. Returns false if the
+    // file can't be read or has too many patterns. Call once at startup, and 'Reload' afterwards.
+    bool Load(const char* file_path)
+    {
+        path = file_path;
+        return Reload();
+    }
+
+    // Reads the file again. If that fails, the current set stays.
+    bool Reload()
+    {
+        FILE* file = fopen(path.c_str(), "r");
+        if (file == nullptr)
+            return false;
+
+        std::vector<std::string> lines;
+        char                     line[1024];
+        while (fgets(line, sizeof(line), file) != nullptr)
+        {
+            size_t length = strlen(line);
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                --length;
+            if (length > 0 && line[0] != '#')
+                lines.emplace_back(line, length);
+        }
+        fclose(file);
+
+        size_t      count = lines.size();
+        PatternSet* set   = PatternSet::Compile(std::move(lines));
+        if (set == nullptr && count > 0)
+            return false;
+
+        pattern_count.store(set ? (uint32_t) set->patterns.size() : 0, std::memory_order_relaxed);
+        memory.store(set ? set->Memory() : 0, std::memory_order_relaxed);
+        loads.fetch_add(1, std::memory_order_relaxed);
+
+        // Replaces a set the filtering thread hasn't picked up yet.
+        PatternSet* previous = pending.exchange(set ? set : &EMPTY, std::memory_order_acq_rel);
+        if (previous != &EMPTY)
+            delete previous;
+        return true;
+    }
+
+    // Index of a banned pattern in the text, or -1. Only call from one thread.
+    int Find(const char* text, size_t size)
+    {
+        if (pending.load(std::memory_order_relaxed) != nullptr)
+        {
+            PatternSet* next = pending.exchange(nullptr, std::memory_order_acq_rel);
+            delete current;
+            current = next == &EMPTY ? nullptr : next;
+        }
+        if (current == nullptr)
+            return -1;
+
+        uint64_t start   = MonotonicNanoseconds();
+        int      pattern = current->Find(text, size);
+        nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+        scanned.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        if (pattern >= 0)
+            blocked.fetch_add(1, std::memory_order_relaxed);
+        return pattern;
+    }
+
+    void PrintStats(FILE* file) const
+    {
+        uint64_t count = scanned.load(std::memory_order_relaxed);
+        uint64_t size  = bytes.load(std::memory_order_relaxed);
+        uint64_t time  = nanoseconds.load(std::memory_order_relaxed);
+        fprintf(file, "    patterns=%u memory=%lluB loads=%llu scanned=%llu blocked=%llu avg=%lluns/message %.2fns/byte\n",
+                pattern_count.load(std::memory_order_relaxed), (unsigned long long) memory.load(std::memory_order_relaxed),
+                (unsigned long long) loads.load(std::memory_order_relaxed), (unsigned long long) count,
+                (unsigned long long) blocked.load(std::memory_order_relaxed),
+                (unsigned long long) (count ? time / count : 0), size ? (double) time / size : 0.0);
+    }
+
+private:
+    // Stands in for "no patterns" in 'pending', where nullptr means "nothing new".
+    static inline PatternSet EMPTY;
+};
@@ -0,0 +1,353 @@
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "byte_queue.h"
+#include "protocol.h"
+
+
+// Sits in front of the server and carries all of its clients over one connection to it (the link). Clients
+// connect to the gateway as they would to the server, and each one gets a channel on the link. What they
+// send goes to the server in FRAME_DATA frames, and what the server sends them comes back the same way (see
+// FRAME_GATEWAY in protocol.h, and 'GATEWAYS' in server_core.h for the other end).
+//
+// The server writes one socket, in a few large writes, instead of one socket per client, and wakes up for
+// one socket instead of thousands. The gateway does the per-client writes, and can run on other cores or
+// other machines, closer to the clients.
+//
+// Each channel has its own window both ways (CHANNEL_WINDOW): a client that doesn't read only stops its own
+// channel, never the link.
+//
+//     Gateway <port> <server port>
+
+
+sa_family_t IPv4 = AF_INET;
+sa_family_t TCP  = SOCK_STREAM;
+
+
+struct GatewayClient
+{
+    int       socket        = -1;
+    uint32_t  channel       = 0;
+    ByteQueue outbound;                    // From the server, not written to the client yet.
+    uint32_t  credit        = CHANNEL_WINDOW;  // What we may still send the server.
+    uint32_t  delivered     = 0;           // Written to the client since the server was last given credit.
+    bool      reading       = true;        // EPOLLIN is watched (not while out of credit).
+    bool      writing       = false;       // EPOLLOUT is watched (while the client's socket is full).
+    bool      server_closed = false;       // The client is disconnected once 'outbound' is written.
+    bool      queued        = false;       // In 'written' (see 'ReadLink').
+};
+
+
+static int       epoll_fd    = -1;
+static int       link_socket = -1;
+static ByteQueue link_outbound;       // Frames for the server, written once per iteration.
+static bool      link_writing = false;
+
+static std::vector<GatewayClient*>                 clients;   // Indexed by socket.
+static std::unordered_map<uint32_t, GatewayClient*> channels;
+static uint32_t                                    next_channel = 1;
+
+
+void Terminate(int code, const char* message)
+{
+    printf("[Exit %d]: %s\n", errno, message);fflush(stdout);
+    exit(code);
+}
+
+
+void SetNonBlocking(int socket_fd)
+{
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void Watch(int socket_fd, bool read, bool write, int operation)
+{
+    epoll_event event{};
+    event.events  = (read ? (uint32_t) EPOLLIN : 0) | (write ? (uint32_t) EPOLLOUT : 0);
+    event.data.fd = socket_fd;
+    epoll_ctl(epoll_fd, operation, socket_fd, &event);
+}
+
+void SendToServer(FrameType type, uint32_t channel, const char* data, size_t size)
+{
+    FrameHeader header;
+    header.size  = htons((uint16_t) (CHANNEL_HEADER_SIZE + size));
+    header.type  = type;
+    header.flags = 0;
+    char prefix[sizeof(FrameHeader) + CHANNEL_HEADER_SIZE];
+    memcpy(prefix, &header, sizeof(header));
+    WriteChannel(prefix + sizeof(header), channel);
+    link_outbound.Push(prefix, sizeof(prefix));
+    link_outbound.Push(data, size);
+}
+
+
+void DisconnectClient(GatewayClient* client)
+{
+    if (!client->server_closed)
+        SendToServer(FRAME_CLOSE, client->channel, nullptr, 0);
+    close(client->socket);  // Also removes it from the epoll set.
+    clients[client->socket] = nullptr;
+    channels.erase(client->channel);
+    delete client;
+}
+
+void AcceptClients(int listen_socket)
+{
+    while (true)
+    {
+        int socket_fd = accept(listen_socket, nullptr, nullptr);
+        if (socket_fd == -1)
+            return;
+        SetNonBlocking(socket_fd);
+
+        GatewayClient* client = new GatewayClient;
+        client->socket  = socket_fd;
+        client->channel = next_channel++;
+        if ((size_t) socket_fd >= clients.size())
+            clients.resize(socket_fd + 1, nullptr);
+        clients[socket_fd]        = client;
+        channels[client->channel] = client;
+        Watch(socket_fd, true, false, EPOLL_CTL_ADD);
+        SendToServer(FRAME_OPEN, client->channel, nullptr, 0);
+    }
+}
+
+// Passes on what the client sent, as much as the channel's credit allows.
+void ReadClient(GatewayClient* client, uint32_t events)
+{
+    if (client->credit == 0)
+    {
+        // A hangup is reported even when EPOLLIN isn't watched, and again on every wait until it's handled.
+        // What the client sent before it is of no use anymore.
+        if (events & (EPOLLHUP | EPOLLERR))
+            DisconnectClient(client);
+        return;
+    }
+    char    buffer[MAXIMUM_CHANNEL_DATA];
+    ssize_t size = recv(client->socket, buffer, std::min(sizeof(buffer), (size_t) client->credit), 0);
+    if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        DisconnectClient(client);
+        return;
+    }
+    if (size <= 0 || client->server_closed)
+        return;
+
+    SendToServer(FRAME_DATA, client->channel, buffer, size);
+    client->credit -= (uint32_t) size;
+    if (client->credit == 0)
+    {
+        // The rest waits in the client's socket until the server has made room for it.
+        client->reading = false;
+        Watch(client->socket, false, client->writing, EPOLL_CTL_MOD);
+    }
+}
+
+// Writes what the server sent the client, and gives the server credit for it.
+void WriteClient(GatewayClient* client)
+{
+    while (client->outbound.Size() > 0)
+    {
+        ssize_t sent = send(client->socket, client->outbound.Data(), client->outbound.Size(), MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                DisconnectClient(client);
+                return;
+            }
+            break;
+        }
+        client->outbound.Drop(sent);
+        client->delivered += (uint32_t) sent;
+    }
+
+    if (client->delivered >= CHANNEL_WINDOW / 2 && !client->server_closed)
+    {
+        uint32_t credit = htonl(client->delivered);
+        SendToServer(FRAME_CREDIT, client->channel, (const char*) &credit, sizeof(credit));
+        client->delivered = 0;
+    }
+    if (client->server_closed && client->outbound.Size() == 0)
+    {
+        DisconnectClient(client);
+        return;
+    }
+    bool writing = client->outbound.Size() > 0;
+    if (writing != client->writing)
+    {
+        client->writing = writing;
+        Watch(client->socket, client->reading, writing, EPOLL_CTL_MOD);
+    }
+}
+
+// Takes in what the server sent, and hands it to the clients. Each client is written once, after all the
+// frames for it are in, however many there were.
+void ReadLink()
+{
+    static char        scratch[1 << 20];
+    static FrameReader reader;
+    static std::vector<GatewayClient*> written;
+    written.clear();
+
+    ssize_t size = reader.Receive(link_socket, scratch, sizeof(scratch));
+    if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        Terminate(1, "Lost the connection to the server.");
+
+    FrameHeader header;
+    FrameTrace  trace;
+    const char* payload      = NULL;
+    size_t      payload_size = 0;
+    bool        malformed    = false;
+    while (reader.Next(header, trace, payload, payload_size, malformed))
+    {
+        if (payload_size < CHANNEL_HEADER_SIZE)
+            Terminate(1, "The server sent a malformed frame.");
+        auto found = channels.find(ReadChannel(payload));
+        if (found == channels.end())
+            continue;  // The client is gone, and the server will hear about it.
+        GatewayClient* client = found->second;
+        payload      += CHANNEL_HEADER_SIZE;
+        payload_size -= CHANNEL_HEADER_SIZE;
+
+        if (header.type == FRAME_DATA)
+        {
+            if (!client->queued)
+                written.push_back(client);
+            client->queued = true;
+            client->outbound.Push(payload, payload_size);
+        }
+        else if (header.type == FRAME_CREDIT && payload_size >= sizeof(uint32_t))
+        {
+            client->credit += ReadChannel(payload);
+            if (!client->reading)
+            {
+                client->reading = true;
+                Watch(client->socket, true, client->writing, EPOLL_CTL_MOD);
+            }
+        }
+        else if (header.type == FRAME_CLOSE)
+        {
+            client->server_closed = true;
+            if (!client->queued)
+                written.push_back(client);
+            client->queued = true;
+        }
+    }
+    reader.Finish();
+    if (malformed)
+        Terminate(1, "The server sent a malformed frame.");
+
+    // Each client is in the list once, so one that's disconnected here isn't seen again.
+    for (GatewayClient* client : written)
+    {
+        client->queued = false;
+        if (!client->writing)  // Otherwise it's written when the socket has room.
+            WriteClient(client);
+    }
+}
+
+// Everything for the server in one write (a few, if the socket is full).
+void WriteLink()
+{
+    while (link_outbound.Size() > 0)
+    {
+        ssize_t sent = send(link_socket, link_outbound.Data(), link_outbound.Size(), MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                Terminate(1, "Lost the connection to the server.");
+            break;
+        }
+        link_outbound.Drop(sent);
+    }
+    bool writing = link_outbound.Size() > 0;
+    if (writing != link_writing)
+    {
+        link_writing = writing;
+        Watch(link_socket, true, writing, EPOLL_CTL_MOD);
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: <port> <server port>";
+    if (argc != 3)
+        Terminate(1, usage);
+    const int port        = atoi(argv[1]);
+    const int server_port = atoi(argv[2]);
+
+    sockaddr_in address{};
+    address.sin_family = IPv4;
+    inet_pton(IPv4, "127.0.0.1", &address.sin_addr);
+
+    // The link first: there's no point taking clients without it.
+    link_socket = socket(IPv4, TCP, 0);
+    address.sin_port = htons(server_port);
+    if (link_socket == -1 || connect(link_socket, (const sockaddr*) &address, sizeof(address)) == -1)
+        Terminate(1, "Couldn't connect to the server.");
+    SetNonBlocking(link_socket);
+    SendToServer(FRAME_GATEWAY, 0, nullptr, 0);
+
+    int listen_socket = socket(IPv4, TCP, 0);
+    int reuse         = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address.sin_port = htons(port);
+    if (listen_socket == -1 || bind(listen_socket, (const sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(listen_socket, SOMAXCONN) == -1)
+        Terminate(1, "Couldn't listen for clients.");
+    SetNonBlocking(listen_socket);
+
+    // http://man7.org/linux/man-pages/man7/epoll.7.html
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
+        Terminate(1, "Couldn't create epoll instance.");
+    Watch(link_socket, true, false, EPOLL_CTL_ADD);
+    Watch(listen_socket, true, false, EPOLL_CTL_ADD);
+
+    printf("[Gateway]: Clients on port %d, server on port %d.\n", port, server_port);fflush(stdout);
+
+    static epoll_event events[256];
+    while (true)
+    {
+        WriteLink();
+        int count = epoll_wait(epoll_fd, events, 256, -1);
+        for (int i = 0; i < count; ++i)
+        {
+            int socket_fd = events[i].data.fd;
+            if (socket_fd == listen_socket)
+            {
+                AcceptClients(listen_socket);
+            }
+            else if (socket_fd == link_socket)
+            {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    ReadLink();
+            }
+            else
+            {
+                // May have been disconnected by an earlier event of this round.
+                GatewayClient* client = (size_t) socket_fd < clients.size() ? clients[socket_fd] : nullptr;
+                if (client != nullptr && (events[i].events & EPOLLOUT))
+                    WriteClient(client);
+                client = (size_t) socket_fd < clients.size() ? clients[socket_fd] : nullptr;
+                if (client != nullptr && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    ReadClient(client, events[i].events);
+            }
+        }
+    }
+}
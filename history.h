@@ -0,0 +1,221 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+
+// The history of all broadcast messages, kept in an append-only file. Every message gets an id, which is
+// simply its position in the history, so ids are dense and increase with time.
+//
+// Appending only copies the record into a pending buffer; the file is written by whoever calls 'Flush'
+// (the search worker), so persisting a message doesn't cost the client thread a syscall.
+//
+//     | size (4 bytes) | sender (4 bytes) | time (8 bytes, ms since the epoch) | text (size bytes) |
+
+struct HistoryRecord
+{
+    uint32_t size;
+    uint32_t sender;
+    uint64_t time;
+};
+
+struct HistoryStore
+{
+    static constexpr uint32_t MAXIMUM_TEXT_SIZE = MAXIMUM_PAYLOAD_SIZE;  // Anything a client may send.
+    static constexpr uint32_t NOT_KEPT          = UINT32_MAX;
+
+    int fd = -1;
+
+    // Only touched by the thread calling 'Open', 'Flush' and 'Read'.
+    std::vector<uint64_t> offsets;
+    uint64_t              file_size = 0;
+    uint32_t              restored  = 0;
+
+    // Shared with the threads calling 'Append'.
+    std::mutex        lock;
+    std::vector<char> pending;
+    uint32_t          next_id   = 0;
+    uint64_t          last_time = 0;
+
+
+    // Opens (or creates) the history file and finds where every record starts. A partially written record
+    // at the end (from a crash) is cut off.
+    //
+    // Where the first 'count' records start can be given ('known', from a snapshot, see snapshot.h), then
+    // only the records after them are read. 'last' is the last of them, if it isn't where it should be the
+    // file isn't the one they're from, and everything is read (check 'Restored' to see which it was).
+    bool Open(const char* path, const uint64_t* known = nullptr, uint32_t count = 0, const HistoryRecord* last = nullptr)
+    {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return false;
+
+        uint64_t position = 0;  // File offset of buffer[0].
+        if (count > 0)
+        {
+            HistoryRecord found;
+            off_t end = lseek(fd, 0, SEEK_END);
+            if (pread(fd, &found, sizeof(found), known[count - 1]) == (ssize_t) sizeof(found) &&
+                memcmp(&found, last, sizeof(found)) == 0 && known[count - 1] + sizeof(found) + found.size <= (uint64_t) end)
+            {
+                offsets.assign(known, known + count);
+                restored  = count;
+                last_time = found.time;
+                position  = known[count - 1] + sizeof(found) + found.size;
+            }
+        }
+
+        std::vector<char> buffer(1 << 20);
+        size_t buffered = 0;
+        while (true)
+        {
+            ssize_t bytes_read = pread(fd, buffer.data() + buffered, buffer.size() - buffered, position + buffered);
+            if (bytes_read <= 0)
+                break;
+            buffered += bytes_read;
+
+            size_t cursor = 0;
+            while (buffered - cursor >= sizeof(HistoryRecord))
+            {
+                HistoryRecord record;
+                memcpy(&record, buffer.data() + cursor, sizeof(record));
+                if (record.size > MAXIMUM_TEXT_SIZE || buffered - cursor < sizeof(record) + record.size)
+                    break;
+                offsets.push_back(position + cursor);
+                last_time = record.time;
+                cursor   += sizeof(record) + record.size;
+            }
+            memmove(buffer.data(), buffer.data() + cursor, buffered - cursor);
+            buffered -= cursor;
+            position += cursor;
+        }
+
+        file_size = position;
+        if (ftruncate(fd, file_size) == -1)
+            return false;
+        next_id = (uint32_t) offsets.size();
+        return true;
+    }
+
+    // Returns the id of the message, or NOT_KEPT if it's too long (it isn't cut short, that could split a
+    // character and would be served as if it were the whole message).
+    uint32_t Append(uint32_t sender, const char* text, uint32_t size)
+    {
+        if (size > MAXIMUM_TEXT_SIZE)
+            return NOT_KEPT;
+
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Keep the times in the same order as the ids even if the wall clock jumps backwards, so a time
+        // range can be turned into an id range.
+        HistoryRecord record;
+        record.size   = size;
+        record.sender = sender;
+        record.time   = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        if (record.time < last_time)
+            record.time = last_time;
+        last_time = record.time;
+
+        size_t offset = pending.size();
+        pending.resize(offset + sizeof(record) + size);
+        memcpy(pending.data() + offset, &record, sizeof(record));
+        memcpy(pending.data() + offset + sizeof(record), text, size);
+        return next_id++;
+    }
+
+    // Writes everything appended so far to the file, and calls 'callback(id, record, text)' for each of
+    // the new messages. Returns the number of messages written.
+    template <typename Callback>
+    uint32_t Flush(Callback&& callback)
+    {
+        std::vector<char> batch;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            batch.swap(pending);
+        }
+        if (batch.empty())
+            return 0;
+
+        size_t written = 0;
+        while (written < batch.size())
+        {
+            ssize_t bytes_written = pwrite(fd, batch.data() + written, batch.size() - written, file_size + written);
+            if (bytes_written <= 0)
+                break;  // The disk is broken. The messages still get ids, they just can't be read back.
+            written += bytes_written;
+        }
+
+        uint32_t count  = 0;
+        size_t   cursor = 0;
+        while (cursor < batch.size())
+        {
+            HistoryRecord record;
+            memcpy(&record, batch.data() + cursor, sizeof(record));
+            uint32_t id = (uint32_t) offsets.size();
+            offsets.push_back(file_size + cursor);
+            callback(id, record, batch.data() + cursor + sizeof(record));
+            cursor += sizeof(record) + record.size;
+            ++count;
+        }
+        file_size += batch.size();
+        return count;
+    }
+
+    uint32_t Count() const { return (uint32_t) offsets.size(); }
+
+    // How many records 'Open' was given, rather than read.
+    uint32_t Restored() const { return restored; }
+
+    // Reads a flushed message. 'text' must have room for MAXIMUM_TEXT_SIZE bytes.
+    bool Read(uint32_t id, HistoryRecord& record, char* text) const
+    {
+        if (id >= offsets.size())
+            return false;
+        if (pread(fd, &record, sizeof(record), offsets[id]) != (ssize_t) sizeof(record))
+            return false;
+        if (record.size > MAXIMUM_TEXT_SIZE)
+            return false;
+        return pread(fd, text, record.size, offsets[id] + sizeof(record)) == (ssize_t) record.size;
+    }
+
+    // Calls 'callback(id, record, text)' for every message already in the file from 'first' on, in order.
+    template <typename Callback>
+    void ForEach(Callback&& callback, uint32_t first = 0) const
+    {
+        std::vector<char> buffer(1 << 20);
+        uint32_t id = first;
+        while (id < offsets.size())
+        {
+            uint64_t start = offsets[id];
+            uint64_t size  = file_size - start;
+            if (size > buffer.size())
+                size = buffer.size();
+            ssize_t bytes_read = pread(fd, buffer.data(), size, start);
+            if (bytes_read <= 0)
+                return;
+
+            // Hand out all records that are completely in the buffer.
+            while (id < offsets.size() && offsets[id] - start + sizeof(HistoryRecord) <= (uint64_t) bytes_read)
+            {
+                HistoryRecord record;
+                memcpy(&record, buffer.data() + (offsets[id] - start), sizeof(record));
+                if (offsets[id] - start + sizeof(record) + record.size > (uint64_t) bytes_read)
+                    break;
+                callback(id, record, buffer.data() + (offsets[id] - start) + sizeof(record));
+                ++id;
+            }
+        }
+    }
+};
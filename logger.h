@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+
+
+// An asynchronous logger. Calling 'Log' doesn't format anything or make any syscalls; it copies the format
+// string pointer and the raw arguments into a ring buffer owned by the calling thread. A background thread
+// drains all rings, does the formatting and writes the result in large batches.
+//
+// The format string must outlive the logger (i.e. be a string literal) since only the pointer is stored.
+// Strings are copied, so pass 'LogText' for strings that aren't null-terminated.
+//
+//     Log(LOG_INFO, "Client %u joined from socket %d.", user_id, socket_fd);
+//     Log(LOG_INFO, "%s", LogText(message.data, message.size));
+
+
+enum LogLevel : uint8_t
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+};
+
+struct LogText
+{
+    const char* data;
+    int         size;
+
+    LogText(const char* data, int size) : data(data), size(size) {}
+};
+
+
+// Single producer (the owning thread), single consumer (the logger thread). 'head' and 'tail' only ever
+// increase and are wrapped when indexing into the buffer.
+struct LogRing
+{
+    static constexpr uint32_t SIZE = 1 << 16;
+
+    char                  buffer[SIZE];
+    std::atomic<uint64_t> head{ 0 };
+    std::atomic<uint64_t> tail{ 0 };
+    std::atomic<bool>     abandoned{ false };  // Set when the owning thread exits.
+    LogRing*              next = nullptr;
+
+    bool Push(const char* record, uint32_t size)
+    {
+        uint64_t write = head.load(std::memory_order_relaxed);
+        uint64_t read  = tail.load(std::memory_order_acquire);
+        if (SIZE - (write - read) < size)
+            return false;
+
+        uint32_t offset = write % SIZE;
+        uint32_t first  = size < SIZE - offset ? size : SIZE - offset;
+        memcpy(&buffer[offset], record, first);
+        memcpy(&buffer[0], record + first, size - first);
+        head.store(write + size, std::memory_order_release);
+        return true;
+    }
+
+    void Read(uint64_t position, char* destination, uint32_t size) const
+    {
+        uint32_t offset = position % SIZE;
+        uint32_t first  = size < SIZE - offset ? size : SIZE - offset;
+        memcpy(destination, &buffer[offset], first);
+        memcpy(destination + first, &buffer[0], size - first);
+    }
+};
+
+
+struct Logger
+{
+    static constexpr uint32_t MAXIMUM_RECORD_SIZE = 2048;
+    static constexpr uint32_t OUTPUT_BUFFER_SIZE  = 1 << 16;
+
+    // A record starts with its total size and level, followed by the format string pointer and the
+    // arguments. Each argument is a one byte tag followed by its value.
+    struct RecordHeader
+    {
+        uint16_t    size;
+        uint8_t     level;
+        uint8_t     argument_count;
+        const char* format;
+    };
+
+    enum Tag : uint8_t { TAG_SIGNED = 'i', TAG_UNSIGNED = 'u', TAG_DOUBLE = 'f', TAG_STRING = 's' };
+
+    std::atomic<uint8_t>  minimum_level{ LOG_INFO };
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<uint64_t> written{ 0 };
+    std::atomic<bool>     running{ false };
+    int                   output_fd = STDOUT_FILENO;
+
+    std::mutex  rings_lock;
+    LogRing*    rings = nullptr;
+    std::thread thread;
+
+    char     output[OUTPUT_BUFFER_SIZE];
+    uint32_t output_size = 0;
+
+
+    void Start(int fd = STDOUT_FILENO)
+    {
+        output_fd = fd;
+        running   = true;
+        thread    = std::thread([this]() { Run(); });
+    }
+
+    // Writes out everything that has been logged so far. Call before exiting.
+    void Stop()
+    {
+        if (!running.exchange(false))
+            return;
+        thread.join();
+        Drain();
+        Flush();
+    }
+
+    bool Enabled(LogLevel level) const { return level >= minimum_level.load(std::memory_order_relaxed); }
+
+    template <typename... Arguments>
+    void Log(LogLevel level, const char* format, const Arguments&... arguments)
+    {
+        if (!Enabled(level))
+            return;
+
+        char  record[MAXIMUM_RECORD_SIZE];
+        char* end    = record + sizeof(record);
+        char* cursor = record + sizeof(RecordHeader);
+        int   encoded[] = { 0, Encode(cursor, end, arguments)... };
+        (void) encoded;
+        (void) end;  // Unused when there are no arguments.
+
+        RecordHeader header;
+        header.size           = (uint16_t) (cursor - record);
+        header.level          = level;
+        header.argument_count = sizeof...(Arguments);
+        header.format         = format;
+        memcpy(record, &header, sizeof(header));
+
+        if (!ThreadRing()->Push(record, header.size))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+private:
+    template <typename T>
+    static int Encode(char*& cursor, char* end, T value)
+    {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "Unsupported log argument.");
+        if (end - cursor < 9)
+            return 0;
+
+        if constexpr (std::is_floating_point<T>::value)
+        {
+            double x = (double) value;
+            *cursor++ = TAG_DOUBLE;
+            memcpy(cursor, &x, 8);
+        }
+        else if constexpr (std::is_signed<T>::value)
+        {
+            int64_t x = (int64_t) value;
+            *cursor++ = TAG_SIGNED;
+            memcpy(cursor, &x, 8);
+        }
+        else
+        {
+            uint64_t x = (uint64_t) value;
+            *cursor++ = TAG_UNSIGNED;
+            memcpy(cursor, &x, 8);
+        }
+        cursor += 8;
+        return 0;
+    }
+
+    static int Encode(char*& cursor, char* end, LogText text)
+    {
+        // Strings that don't fit are truncated rather than dropping the whole record.
+        if (end - cursor < 3)
+            return 0;
+        uint16_t size = (uint16_t) (text.size < end - cursor - 3 ? text.size : end - cursor - 3);
+        *cursor++ = TAG_STRING;
+        memcpy(cursor, &size, 2);
+        memcpy(cursor + 2, text.data, size);
+        cursor += 2 + size;
+        return 0;
+    }
+
+    static int Encode(char*& cursor, char* end, const char* text) { return Encode(cursor, end, LogText(text, strlen(text))); }
+    static int Encode(char*& cursor, char* end, char* text)       { return Encode(cursor, end, (const char*) text); }
+
+
+    // Every thread gets its own ring the first time it logs. When the thread exits the ring is marked as
+    // abandoned and the logger thread frees it once it has been drained.
+    LogRing* ThreadRing()
+    {
+        struct Owner
+        {
+            LogRing* ring = nullptr;
+            ~Owner() { if (ring) ring->abandoned.store(true, std::memory_order_release); }
+        };
+        thread_local Owner owner;
+
+        if (owner.ring == nullptr)
+        {
+            owner.ring = new LogRing;
+            std::lock_guard<std::mutex> lock(rings_lock);
+            owner.ring->next = rings;
+            rings = owner.ring;
+        }
+        return owner.ring;
+    }
+
+
+    void Run()
+    {
+        while (running.load(std::memory_order_relaxed))
+        {
+            if (!Drain())
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            Flush();
+        }
+    }
+
+    // Formats all pending records of all rings. Returns false if there was nothing to do.
+    bool Drain()
+    {
+        bool did_work = false;
+
+        std::lock_guard<std::mutex> lock(rings_lock);
+        for (LogRing** link = &rings; *link != nullptr; )
+        {
+            LogRing* ring      = *link;
+            bool     abandoned = ring->abandoned.load(std::memory_order_acquire);
+            uint64_t read      = ring->tail.load(std::memory_order_relaxed);
+            uint64_t write     = ring->head.load(std::memory_order_acquire);
+
+            while (read != write)
+            {
+                char         record[MAXIMUM_RECORD_SIZE];
+                RecordHeader header;
+                ring->Read(read, (char*) &header, sizeof(header));
+                ring->Read(read, record, header.size);
+                Format(header, record + sizeof(header), record + header.size);
+                read += header.size;
+                did_work = true;
+            }
+            ring->tail.store(read, std::memory_order_release);
+
+            if (abandoned)
+            {
+                *link = ring->next;
+                delete ring;
+            }
+            else
+            {
+                link = &ring->next;
+            }
+        }
+        return did_work;
+    }
+
+    void Flush()
+    {
+        uint32_t offset = 0;
+        while (offset < output_size)
+        {
+            ssize_t bytes_written = write(output_fd, output + offset, output_size - offset);
+            if (bytes_written <= 0)
+                break;
+            offset += bytes_written;
+        }
+        output_size = 0;
+    }
+
+    void Append(const char* text, uint32_t size)
+    {
+        if (output_size + size > OUTPUT_BUFFER_SIZE)
+            Flush();
+        if (size > OUTPUT_BUFFER_SIZE)
+            size = OUTPUT_BUFFER_SIZE;
+        memcpy(output + output_size, text, size);
+        output_size += size;
+    }
+
+    // printf-style formatting where the arguments come from the record instead of a va_list. Each
+    // conversion is handed to snprintf on its own, with the length modifier replaced to match how the
+    // argument was stored.
+    void Format(const RecordHeader& header, const char* arguments, const char* end)
+    {
+        static const char* PREFIXES[] = { "[Debug]: ", "[Info]: ", "[Warning]: ", "[Error]: " };
+        const char* prefix = PREFIXES[std::min<uint8_t>(header.level, LOG_ERROR)];
+        Append(prefix, strlen(prefix));
+
+        char        text[MAXIMUM_RECORD_SIZE + 64];
+        const char* format = header.format;
+        while (*format)
+        {
+            const char* percent = strchr(format, '%');
+            if (percent == nullptr)
+            {
+                Append(format, strlen(format));
+                break;
+            }
+            Append(format, percent - format);
+
+            if (percent[1] == '%')
+            {
+                Append("%", 1);
+                format = percent + 2;
+                continue;
+            }
+
+            // Copy flags, width and precision, skip length modifiers, find the conversion character.
+            char        specification[32] = "%";
+            size_t      length = 1;
+            const char* cursor = percent + 1;
+            while (*cursor && strchr("-+ #0123456789.", *cursor) && length < 24)
+                specification[length++] = *cursor++;
+            while (*cursor && strchr("hlqjzt", *cursor))
+                ++cursor;
+            char conversion = *cursor ? *cursor++ : 's';
+            format = cursor;
+
+            if (arguments >= end)
+            {
+                Append("<missing>", 9);
+                continue;
+            }
+
+            int written_size = 0;
+            uint8_t tag = (uint8_t) *arguments++;
+            if (tag == TAG_STRING)
+            {
+                uint16_t size;
+                memcpy(&size, arguments, 2);
+                specification[length++] = '.';
+                specification[length++] = '*';
+                specification[length++] = 's';
+                specification[length]   = '\0';
+                written_size = snprintf(text, sizeof(text), specification, (int) size, arguments + 2);
+                arguments += 2 + size;
+            }
+            else if (tag == TAG_DOUBLE)
+            {
+                double x;
+                memcpy(&x, arguments, 8);
+                specification[length++] = strchr("eEfFgGaA", conversion) ? conversion : 'f';
+                specification[length]   = '\0';
+                written_size = snprintf(text, sizeof(text), specification, x);
+                arguments += 8;
+            }
+            else
+            {
+                uint64_t x;
+                memcpy(&x, arguments, 8);
+                if (conversion == 'c')
+                {
+                    specification[length++] = 'c';
+                    specification[length]   = '\0';
+                    written_size = snprintf(text, sizeof(text), specification, (int) x);
+                }
+                else
+                {
+                    specification[length++] = 'l';
+                    specification[length++] = 'l';
+                    specification[length++] = strchr("diouxX", conversion) ? conversion : (tag == TAG_SIGNED ? 'd' : 'u');
+                    specification[length]   = '\0';
+                    written_size = snprintf(text, sizeof(text), specification, (unsigned long long) x);
+                }
+                arguments += 8;
+            }
+
+            if (written_size > 0)
+                Append(text, written_size < (int) sizeof(text) ? written_size : (int) sizeof(text) - 1);
+        }
+
+        Append("\n", 1);
+        written.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+
+static Logger logger;
+
+template <typename... Arguments>
+inline void Log(LogLevel level, const char* format, const Arguments&... arguments)
+{
+    logger.Log(level, format, arguments...);
+}
+
+// Logs one in every 'rate' calls from this call site (per thread). For things that happen on every message.
+#define LOG_SAMPLED(rate, level, ...)                                           \
+    do {                                                                        \
+        thread_local unsigned log_sample_counter_ = 0;                          \
+        if ((rate) != 0 && log_sample_counter_++ % (rate) == 0)                 \
+            Log(level, __VA_ARGS__);                                            \
+    } while (0)
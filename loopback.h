@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+#include "byte_queue.h"
+#include "server_core.h"
+
+
+// Connections that stay in this process: the client's end is an object, and bytes go back and forth with
+// 'memcpy' instead of 'recv' and 'sendmsg'. Made for benchmarks that want to measure the dispatch rather
+// than the kernel, and for programs that embed the server and talk to it directly. Everything, both ends,
+// runs on the loop's thread.
+//
+//     LoopbackEndpoint* client = ConnectLoopback();
+//     client->Write(login, login_size);
+//     Poll();
+//     client->Read(buffer, sizeof(buffer));
+//     client->Close();  // The server sees the client disconnect, and frees the endpoint when it's done.
+//
+// The server's end behaves like a non-blocking socket with a send buffer of 'capacity' bytes, so a client
+// that doesn't read is cut off the same way as over TCP.
+
+
+struct LoopbackEndpoint
+{
+    static constexpr size_t DEFAULT_CAPACITY = 256 << 10;  // About what a local TCP socket buffers.
+
+    Connection* connection    = nullptr;  // The server's end, nullptr once the server closed it.
+    bool        client_closed = false;
+    size_t      capacity      = DEFAULT_CAPACITY;  // Of 'outbound'.
+    ByteQueue   inbound;                            // From the client to the server.
+    ByteQueue   outbound;                           // From the server to the client.
+
+    // Returns false if the server closed the connection.
+    bool Write(const char* data, size_t size)
+    {
+        if (connection == nullptr)
+            return false;
+        inbound.Push(data, size);
+        MarkReadable(connection);
+        return true;
+    }
+
+    // Takes what the server sent, up to 'size' bytes. What was sent before the server closed the connection
+    // can still be read.
+    size_t Read(char* data, size_t size)
+    {
+        size_t read = outbound.Pop(data, size);
+        if (read > 0 && connection != nullptr)
+            MarkWritable(connection);
+        return read;
+    }
+
+    // True if the server closed the connection and everything it sent was read.
+    bool Finished() const { return connection == nullptr && outbound.Size() == 0; }
+
+    // Don't use the endpoint after this.
+    void Close()
+    {
+        client_closed = true;
+        if (connection != nullptr)
+            MarkReadable(connection);  // To see the end.
+        else
+            delete this;
+    }
+};
+
+
+inline ssize_t ReceiveFromLoopback(Connection* connection, char* data, size_t size)
+{
+    LoopbackEndpoint* endpoint = (LoopbackEndpoint*) connection->endpoint;
+    if (endpoint->inbound.Size() == 0)
+    {
+        if (endpoint->client_closed)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t received = endpoint->inbound.Pop(data, size);
+    if (endpoint->inbound.Size() > 0 || endpoint->client_closed)
+        MarkReadable(connection);  // Like a level triggered epoll, it comes back while there's more.
+    return (ssize_t) received;
+}
+
+inline ssize_t SendOnLoopback(Connection* connection, iovec* chunks, size_t count, int)
+{
+    LoopbackEndpoint* endpoint = (LoopbackEndpoint*) connection->endpoint;
+    if (endpoint->client_closed)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t room = endpoint->capacity - std::min(endpoint->capacity, endpoint->outbound.Size());
+    if (room == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t sent = 0;
+    for (size_t i = 0; i < count && sent < room; ++i)
+    {
+        size_t size = std::min(chunks[i].iov_len, room - sent);
+        endpoint->outbound.Push((const char*) chunks[i].iov_base, size);
+        sent += size;
+    }
+    return (ssize_t) sent;
+}
+
+inline void CloseLoopback(Connection* connection)
+{
+    LoopbackEndpoint* endpoint = (LoopbackEndpoint*) connection->endpoint;
+    endpoint->connection = nullptr;
+    if (endpoint->client_closed)
+        delete endpoint;
+}
+
+static const Transport loopback_transport = { "loopback", false, ReceiveFromLoopback, SendOnLoopback, CloseLoopback };
+
+
+// Connects a new client to the server. The client is expected to log in first, as over TCP. Returns
+// nullptr if there are too many clients.
+inline LoopbackEndpoint* ConnectLoopback()
+{
+    LoopbackEndpoint* endpoint = new LoopbackEndpoint;
+    endpoint->connection = AddVirtualConnection(&loopback_transport, endpoint);
+    if (endpoint->connection == nullptr)
+    {
+        delete endpoint;
+        return nullptr;
+    }
+    return endpoint;
+}
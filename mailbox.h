@@ -0,0 +1,333 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Keeps messages for users that aren't connected until they resume their session. What the store holds for
+// a user is only of use as long as the user's session is, the server discards it along with the session.
+//
+// Messages are first appended to a small in-memory buffer per mailbox. When the buffers of all mailboxes
+// together go over the memory budget, the oldest buffers are written to the end of an append-only segment
+// file and freed, leaving only an (segment, offset, size) extent behind. An idle mailbox whose messages
+// have all been spilled costs a map entry and a few extents, so millions of them stay cheap.
+//
+// When the user resumes its session the mailbox is drained: extents are read back with large 'pread's (adjacent ones are merged
+// when spilling) and handed to the client's outbound queue in batches. A segment file is deleted when
+// nothing refers to it anymore.
+//
+// The store only sees bytes. The server puts in each message as the encoded event it sends the client,
+// with its size in front as a varint, and splits them apart again when the mailbox is drained.
+struct MailboxStore
+{
+    static constexpr uint32_t MAXIMUM_MAILBOX_SIZE = 1 << 20;   // Per user, in memory and on disk together.
+    static constexpr uint64_t SEGMENT_SIZE         = 64 << 20;  // Start a new segment file after this.
+    static constexpr uint32_t READ_SIZE            = 1 << 16;
+    static constexpr size_t   MAXIMUM_MAILBOXES    = 1 << 20;
+
+    struct Extent
+    {
+        uint32_t segment;
+        uint32_t size;
+        uint64_t offset;
+    };
+
+    struct Mailbox
+    {
+        char*               memory = nullptr;  // Messages not yet spilled.
+        uint32_t            memory_size     = 0;
+        uint32_t            memory_capacity = 0;
+        uint32_t            spilled_size    = 0;
+        std::vector<Extent> extents;           // Spilled messages, oldest first.
+    };
+
+    struct Segment
+    {
+        int      fd   = -1;
+        uint64_t size = 0;
+        uint64_t live = 0;  // Bytes still referred to by some mailbox.
+    };
+
+    const char* directory     = "mailboxes";
+    uint64_t    memory_budget = 64 << 20;
+
+    std::mutex                            lock;
+    std::unordered_map<uint32_t, Mailbox> mailboxes;
+    std::unordered_map<uint32_t, Segment> segments;
+    std::vector<uint32_t>                 spill_order;  // Users with in-memory messages, roughly oldest first.
+    uint32_t current_segment = 0;
+    uint64_t memory_used     = 0;  // Capacity of all in-memory buffers.
+    uint64_t in_memory       = 0;  // Number of mailboxes with an in-memory buffer.
+
+    // Counters for the stats.
+    uint64_t stored   = 0;
+    uint64_t spills   = 0;
+    uint64_t drained  = 0;
+    uint64_t rejected  = 0;
+    uint64_t discarded = 0;
+
+
+    // Returns false if the message couldn't be kept (the mailbox is full, there are too many mailboxes, or
+    // the disk failed).
+    bool Store(uint32_t user_id, const char* message, uint32_t size)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (mailboxes.size() >= MAXIMUM_MAILBOXES && mailboxes.count(user_id) == 0)
+        {
+            ++rejected;
+            return false;
+        }
+        Mailbox& mailbox = mailboxes[user_id];
+        if (mailbox.memory_size + mailbox.spilled_size + size > MAXIMUM_MAILBOX_SIZE)
+        {
+            ++rejected;
+            if (mailbox.memory_size == 0 && mailbox.extents.empty())
+                mailboxes.erase(user_id);
+            return false;
+        }
+
+        if (mailbox.memory_size + size > mailbox.memory_capacity)
+        {
+            uint32_t capacity = mailbox.memory_capacity ? mailbox.memory_capacity : 256;
+            while (capacity < mailbox.memory_size + size)
+                capacity *= 2;
+            char* memory = (char*) realloc(mailbox.memory, capacity);
+            if (memory == nullptr)
+                return false;
+            if (mailbox.memory_capacity == 0)
+            {
+                spill_order.push_back(user_id);
+                ++in_memory;
+            }
+            memory_used            += capacity - mailbox.memory_capacity;
+            mailbox.memory          = memory;
+            mailbox.memory_capacity = capacity;
+        }
+
+        memcpy(mailbox.memory + mailbox.memory_size, message, size);
+        mailbox.memory_size += size;
+        ++stored;
+
+        // Spill until we're comfortably below the budget, so we don't end up spilling on every message.
+        // The ones that couldn't be written stay at the front, to be tried again first.
+        size_t next = 0, kept = 0;
+        while (memory_used > memory_budget - memory_budget / 4 && next < spill_order.size())
+        {
+            uint32_t id = spill_order[next++];
+            if (!Spill(id))
+                spill_order[kept++] = id;
+        }
+        spill_order.erase(spill_order.begin() + kept, spill_order.begin() + next);
+
+        // Mailboxes that were drained before being spilled are still in the list. Clean them out every now
+        // and then so the list doesn't grow forever.
+        if (spill_order.size() > 2 * in_memory + 64)
+        {
+            size_t kept = 0;
+            for (uint32_t id : spill_order)
+            {
+                auto other = mailboxes.find(id);
+                if (other != mailboxes.end() && other->second.memory_capacity != 0)
+                    spill_order[kept++] = id;
+            }
+            spill_order.resize(kept);
+        }
+        return true;
+    }
+
+    // Hands everything in the user's mailbox to 'sink(data, size)' in chunks, oldest first, and empties it.
+    // The sink returns false to stop early (whatever wasn't handed out is lost). Returns the number of bytes
+    // handed out, or -1 if the sink stopped early.
+    template <typename Sink>
+    int64_t Drain(uint32_t user_id, Sink&& sink)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto found = mailboxes.find(user_id);
+        if (found == mailboxes.end())
+            return 0;
+        Mailbox& mailbox = found->second;
+
+        int64_t written = 0;
+        bool    broken  = false;
+        char*   buffer  = (char*) malloc(READ_SIZE);
+        for (const Extent& extent : mailbox.extents)
+        {
+            Segment& segment = segments[extent.segment];
+            uint64_t offset  = 0;
+            while (!broken && offset < extent.size)
+            {
+                uint32_t chunk = extent.size - offset < READ_SIZE ? (uint32_t) (extent.size - offset) : READ_SIZE;
+                ssize_t  bytes_read = pread(segment.fd, buffer, chunk, extent.offset + offset);
+                if (bytes_read <= 0)
+                    break;
+                broken   = !sink((const char*) buffer, (size_t) bytes_read);
+                written += bytes_read;
+                offset  += bytes_read;
+            }
+            Release(extent);
+        }
+        free(buffer);
+
+        if (!broken && mailbox.memory_size > 0)
+        {
+            broken   = !sink((const char*) mailbox.memory, (size_t) mailbox.memory_size);
+            written += mailbox.memory_size;
+        }
+
+        Remove(found);
+        ++drained;
+        return broken ? -1 : written;
+    }
+
+    // Throws away whatever is in the user's mailbox, without reading it.
+    void Discard(uint32_t user_id)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto found = mailboxes.find(user_id);
+        if (found == mailboxes.end())
+            return;
+        for (const Extent& extent : found->second.extents)
+            Release(extent);
+        Remove(found);
+        ++discarded;
+    }
+
+    void PrintStats(FILE* file)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fprintf(file, "    mailboxes=%zu segments=%zu memory=%llu/%llu stored=%llu spills=%llu drained=%llu rejected=%llu "
+                "discarded=%llu\n", mailboxes.size(), segments.size(), (unsigned long long) memory_used,
+                (unsigned long long) memory_budget, (unsigned long long) stored, (unsigned long long) spills,
+                (unsigned long long) drained, (unsigned long long) rejected, (unsigned long long) discarded);
+    }
+
+
+private:
+    // Frees what's left of the mailbox in memory (its extents are released already).
+    void Remove(std::unordered_map<uint32_t, Mailbox>::iterator found)
+    {
+        Mailbox& mailbox = found->second;
+        if (mailbox.memory_capacity != 0)
+            --in_memory;
+        memory_used -= mailbox.memory_capacity;
+        free(mailbox.memory);
+        mailboxes.erase(found);
+    }
+
+    static bool WriteAll(int fd, const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t bytes_written = write(fd, data, size);
+            if (bytes_written <= 0)
+                return false;
+            data += bytes_written;
+            size -= bytes_written;
+        }
+        return true;
+    }
+
+    // Moves the in-memory part of a mailbox to the end of the current segment. Returns false if it's still
+    // in memory, because the disk failed.
+    bool Spill(uint32_t user_id)
+    {
+        auto found = mailboxes.find(user_id);
+        if (found == mailboxes.end() || found->second.memory_capacity == 0)
+            return true;  // Drained already.
+        Mailbox& mailbox = found->second;
+
+        Segment* segment = CurrentSegment(mailbox.memory_size);
+        if (segment == nullptr)
+            return false;  // Keep it in memory and try again later.
+        if (!WriteAll(segment->fd, mailbox.memory, mailbox.memory_size))
+        {
+            // What was written of it is cut off again, or the next extent's offset would point at it. If even
+            // that fails, the bytes stay as a gap nothing refers to.
+            // http://man7.org/linux/man-pages/man2/truncate.2.html
+            if (ftruncate(segment->fd, (off_t) segment->size) == -1)
+            {
+                off_t end = lseek(segment->fd, 0, SEEK_END);
+                if (end != -1)
+                    segment->size = (uint64_t) end;
+            }
+            return false;
+        }
+
+        Extent* last = mailbox.extents.empty() ? nullptr : &mailbox.extents.back();
+        if (last && last->segment == current_segment && last->offset + last->size == segment->size)
+        {
+            last->size += mailbox.memory_size;
+        }
+        else
+        {
+            Extent extent;
+            extent.segment = current_segment;
+            extent.offset  = segment->size;
+            extent.size    = mailbox.memory_size;
+            mailbox.extents.push_back(extent);
+        }
+        segment->size += mailbox.memory_size;
+        segment->live += mailbox.memory_size;
+
+        mailbox.spilled_size += mailbox.memory_size;
+        memory_used          -= mailbox.memory_capacity;
+        --in_memory;
+        free(mailbox.memory);
+        mailbox.memory          = nullptr;
+        mailbox.memory_size     = 0;
+        mailbox.memory_capacity = 0;
+        ++spills;
+        return true;
+    }
+
+    Segment* CurrentSegment(uint32_t size_to_append)
+    {
+        auto found = segments.find(current_segment);
+        if (found != segments.end() && found->second.size + size_to_append <= SEGMENT_SIZE)
+            return &found->second;
+
+        if (found != segments.end() && found->second.live == 0)
+            RemoveSegment(current_segment);
+
+        mkdir(directory, 0700);
+        char path[512];
+        snprintf(path, sizeof(path), "%s/segment-%u.bin", directory, ++current_segment);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return nullptr;
+
+        Segment& segment = segments[current_segment];
+        segment.fd = fd;
+        return &segment;
+    }
+
+    void Release(const Extent& extent)
+    {
+        Segment& segment = segments[extent.segment];
+        segment.live -= extent.size;
+        if (segment.live == 0 && extent.segment != current_segment)
+            RemoveSegment(extent.segment);
+    }
+
+    void RemoveSegment(uint32_t id)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/segment-%u.bin", directory, id);
+        close(segments[id].fd);
+        unlink(path);
+        segments.erase(id);
+    }
+};
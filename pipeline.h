@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <tuple>
+#include <utility>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "timing.h"
+
+
+// A message travelling from 'recv' to 'DispatchMessage'. The text lives in 'data' and there's always
+// 'headroom' bytes free in front of it, so stages can prepend things (like the header of the chat event)
+// without having to copy the message.
+struct Message
+{
+    uint32_t sender;     // User id.
+    uint32_t recipient;  // User id for private messages, 0 for broadcasts.
+    int      socket;     // Socket the message was received on.
+    char*    data;
+    int      size;
+    int      headroom;
+    int      capacity;   // Bytes available from 'data' and forward, always at least 'size' + 1.
+    uint64_t received;   // When it was received, from 'MonotonicNanoseconds'.
+    uint64_t trace_id;   // Non-zero if the message is being traced (see trace.h).
+};
+
+
+// Each stage counts how many messages it has seen, how many it dropped and how long it spent on them.
+// The counters are shared between all client threads, so they're relaxed atomics.
+struct StageCounter
+{
+    const char*           name = "";
+    std::atomic<uint64_t> calls{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<uint64_t> nanoseconds{ 0 };
+
+    void Add(uint64_t elapsed, bool kept)
+    {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
+        if (!kept)
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Print(FILE* file) const
+    {
+        uint64_t count = calls.load(std::memory_order_relaxed);
+        uint64_t time  = nanoseconds.load(std::memory_order_relaxed);
+        fprintf(file, "    %-12s calls=%-10llu dropped=%-10llu total=%-12lluns avg=%lluns\n",
+                name, (unsigned long long) count, (unsigned long long) dropped.load(std::memory_order_relaxed),
+                (unsigned long long) time, (unsigned long long) (count ? time / count : 0));
+    }
+};
+
+
+// A pipeline composed at compile time. Every stage is a type with
+//
+//     static constexpr const char* name;
+//     bool operator()(Message& message);   // Return false to drop the message.
+//
+// The stages are stored by value in a tuple and called by index, so there is no virtual dispatch and
+// the compiler is free to inline the whole chain into 'Process'.
+template <typename... Stages>
+struct Pipeline
+{
+    static constexpr size_t COUNT = sizeof...(Stages);
+
+    std::tuple<Stages...> stages;
+    StageCounter          counters[COUNT];
+
+    Pipeline()
+    {
+        const char* names[] = { Stages::name... };
+        for (size_t i = 0; i < COUNT; ++i)
+            counters[i].name = names[i];
+    }
+
+    template <typename Stage>
+    Stage& Get() { return std::get<Stage>(stages); }
+
+    bool Process(Message& message) { return Run<0>(message); }
+
+    void PrintStats(FILE* file) const
+    {
+        for (size_t i = 0; i < COUNT; ++i)
+            counters[i].Print(file);
+    }
+
+private:
+    template <size_t I>
+    bool Run(Message& message)
+    {
+        if constexpr (I == COUNT)
+        {
+            return true;
+        }
+        else
+        {
+            uint64_t start = MonotonicNanoseconds();
+            bool     kept  = std::get<I>(stages)(message);
+            counters[I].Add(MonotonicNanoseconds() - start, kept);
+            return kept && Run<I + 1>(message);
+        }
+    }
+};
+
+
+// Wraps a stage so it can be turned on and off at runtime. The check is a single branch on a flag
+// and the wrapped stage is still called directly.
+template <typename Stage>
+struct Optional
+{
+    static constexpr const char* name = Stage::name;
+
+    Stage             stage;
+    std::atomic<bool> enabled{ true };
+
+    bool operator()(Message& message)
+    {
+        if (!enabled.load(std::memory_order_relaxed))
+            return true;
+        return stage(message);
+    }
+};
+
+
+// The runtime-configurable part of the pipeline. Optional stages that are only known at startup
+// (e.g. depending on the command line) are registered here as plain function pointers. It's itself
+// a stage, so it slots into a compile time 'Pipeline' like any other.
+struct RuntimeStages
+{
+    static constexpr const char* name = "runtime";
+    static constexpr unsigned    MAXIMUM_NUMBER_OF_STAGES = 8;
+
+    using Function = bool (*)(void* context, Message& message);
+
+    struct Entry
+    {
+        Function     function;
+        void*        context;
+        StageCounter counter;
+    };
+
+    Entry    entries[MAXIMUM_NUMBER_OF_STAGES];
+    unsigned count = 0;
+
+    // Not thread safe! Register all stages before any client is accepted.
+    bool Add(const char* stage_name, Function function, void* context = nullptr)
+    {
+        if (count == MAXIMUM_NUMBER_OF_STAGES)
+            return false;
+        Entry& entry = entries[count++];
+        entry.function     = function;
+        entry.context      = context;
+        entry.counter.name = stage_name;
+        return true;
+    }
+
+    bool operator()(Message& message)
+    {
+        for (unsigned i = 0; i < count; ++i)
+        {
+            Entry&   entry = entries[i];
+            uint64_t start = MonotonicNanoseconds();
+            bool     kept  = entry.function(entry.context, message);
+            entry.counter.Add(MonotonicNanoseconds() - start, kept);
+            if (!kept)
+                return false;
+        }
+        return true;
+    }
+
+    void PrintStats(FILE* file) const
+    {
+        for (unsigned i = 0; i < count; ++i)
+            entries[i].counter.Print(file);
+    }
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <linux/mempolicy.h>
+
+
+// Where threads run and where their memory lives. On a machine with several NUMA nodes (e.g. two sockets),
+// memory is attached to one node, and a CPU reading memory of another node goes through the interconnect,
+// which is slower and shared by everyone. So the loop should run on one CPU, keep its connections and
+// buffers on that CPU's node, and ideally be on the node the network card delivers the packets to.
+//
+//     Topology topology;
+//     topology.Load();
+//     PinThread(pthread_self(), 2);
+//     PreferNode(topology.NodeOf(2));
+//
+// Nothing here needs libnuma: the topology comes from sysfs, and the memory policy is one syscall.
+
+
+// Parses a CPU list like "0-3,8,10-11", the format of 'taskset -c' and of sysfs. Returns false if it's
+// malformed or empty.
+inline bool ParseCpuList(const char* text, std::vector<int>& cpus)
+{
+    cpus.clear();
+    while (*text != '\0' && *text != '\n')
+    {
+        char* end   = nullptr;
+        long  first = strtol(text, &end, 10);
+        long  last  = first;
+        if (end == text || first < 0)
+            return false;
+        if (*end == '-')
+        {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first)
+                return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back((int) cpu);
+
+        text = end;
+        if (*text == ',')
+            ++text;
+        else if (*text != '\0' && *text != '\n')
+            return false;
+    }
+    return !cpus.empty();
+}
+
+
+// Which node each CPU is on. Machines without NUMA (or without sysfs) look like a single node with every CPU.
+struct Topology
+{
+    static constexpr int MAXIMUM_NODES = 64;
+
+    std::vector<int16_t> node_of_cpu;
+    std::vector<int>     cpus_of_node[MAXIMUM_NODES];
+    int                  nodes = 1;
+
+    // https://www.kernel.org/doc/html/latest/admin-guide/mm/numaperf.html
+    //     /sys/devices/system/node/node<N>/cpulist lists the CPUs of node N.
+    void Load()
+    {
+        long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+        node_of_cpu.assign(cpu_count > 0 ? cpu_count : 1, 0);
+        nodes = 0;
+
+        for (int node = 0; node < MAXIMUM_NODES; ++node)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE* file = fopen(path, "r");
+            if (file == nullptr)
+                continue;  // Node numbers can have holes.
+
+            char             line[4096];
+            std::vector<int> cpus;
+            if (fgets(line, sizeof(line), file) != nullptr && ParseCpuList(line, cpus))
+            {
+                for (int cpu : cpus)
+                {
+                    if ((size_t) cpu >= node_of_cpu.size())
+                        node_of_cpu.resize(cpu + 1, 0);
+                    node_of_cpu[cpu] = (int16_t) node;
+                }
+                cpus_of_node[node] = cpus;
+                nodes = node + 1;
+            }
+            fclose(file);
+        }
+
+        if (nodes == 0)
+        {
+            nodes = 1;
+            for (size_t cpu = 0; cpu < node_of_cpu.size(); ++cpu)
+                cpus_of_node[0].push_back((int) cpu);
+        }
+    }
+
+    // -1 for a CPU we don't know about (e.g. SO_INCOMING_CPU on a socket that never received anything).
+    int NodeOf(int cpu) const
+    {
+        return cpu >= 0 && (size_t) cpu < node_of_cpu.size() ? node_of_cpu[cpu] : -1;
+    }
+};
+
+
+// http://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+//     Restricts the thread to a single CPU. Threads it creates afterwards inherit that, so pin threads
+//     after creating the ones that should run elsewhere.
+inline bool PinThread(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+// http://man7.org/linux/man-pages/man2/set_mempolicy.2.html
+//     Makes the kernel place the pages the calling thread touches first on 'node', and only fall back to
+//     other nodes when that one is out of memory. For a pinned thread that's also what the default policy
+//     does; setting it explicitly keeps it that way if the thread is later allowed on more CPUs, and threads
+//     it creates inherit it. Pages that are already in use stay where they are.
+inline bool PreferNode(int node)
+{
+    if (node < 0 || node >= Topology::MAXIMUM_NODES)
+        return false;
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) == 0;
+}
+
+// http://man7.org/linux/man-pages/man3/sched_getcpu.3.html
+//     Cheap (no syscall, it's answered by the vDSO), but only a hint unless the thread is pinned.
+inline int CurrentCpu()
+{
+    return sched_getcpu();
+}
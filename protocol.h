@@ -0,0 +1,279 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+// Everything sent in either direction is wrapped in a frame, since TCP is a stream and doesn't keep the
+// boundaries between our writes. A frame is a fixed header, optionally followed by trace fields and a
+// sequence number, and then the payload.
+//
+//     | size (2 bytes, network order) | type (1 byte) | flags (1 byte) | [trace (16 bytes)] | [sequence (8 bytes)] | payload |
+//
+// 'size' is the number of bytes after the header, i.e. including the trace fields and the sequence number.
+//
+// The chat messages the server sends in a session are numbered, so a client that loses its connection can
+// log in again with the last number it saw and only get what it missed:
+//
+//     client: LOGIN "0"                        server: WELCOME "7 <token> new"
+//                                              server: EVENT #1, EVENT #2, EVENT #3 ...
+//     client: ACK 2                            (the server can forget #1 and #2)
+//     ... the connection drops, #3 and #4 are sent meanwhile ...
+//     client: LOGIN "7 <token> 2"              server: WELCOME "7 <token> resumed"
+//                                              server: EVENT #3, EVENT #4 ...
+//
+// Control frames (the welcome, and events like joins and replies to commands) aren't numbered. The server
+// sends them ahead of the numbered events it has queued, so they can arrive in between.
+
+enum FrameType : uint8_t
+{
+    FRAME_LOGIN   = 1,  // Client to server. Payload is "<user id>", or "<user id> <token> <last sequence>" to resume.
+    FRAME_TEXT    = 2,  // Client to server. Payload is a chat message or a command.
+    FRAME_WELCOME = 3,  // Server to client. Payload is "<user id> <token> new|resumed".
+    FRAME_ACK     = 4,  // Client to server. Payload is an 'AckEvent' with the last sequence number received (see events.h).
+    FRAME_EVENT   = 5,  // Server to client. Payload is an event: a chat message, a join, ... (see events.h).
+
+    // A gateway carries many clients over one connection (see gateway.cpp). It starts with FRAME_GATEWAY
+    // instead of a login, and from then on every frame is about one of its channels, one per client. The
+    // payload starts with the channel id (4 bytes, network order).
+    FRAME_GATEWAY = 6,   // Gateway to server. No payload.
+    FRAME_OPEN    = 7,   // Gateway to server. A client connected, the channel starts out as a new connection.
+    FRAME_DATA    = 8,   // Both ways. The rest is bytes of the channel's stream, i.e. the frames above.
+    FRAME_CLOSE   = 9,   // Both ways. The client disconnected, or the server closed the connection.
+    FRAME_CREDIT  = 10,  // Both ways. The rest is how many more bytes (4 bytes, network order) may be sent.
+
+    FRAME_SYNC    = 11,  // Client to server. Payload is a 'SyncEvent' saying which history it already has.
+};
+
+enum FrameFlags : uint8_t
+{
+    FRAME_TRACED    = 1 << 0,  // The header is followed by a 'FrameTrace'.
+    FRAME_SEQUENCED = 1 << 1,  // A sequence number (8 bytes, network order) comes before the payload.
+};
+
+struct FrameHeader
+{
+    uint16_t size;
+    uint8_t  type;
+    uint8_t  flags;
+};
+
+// Timestamps are CLOCK_MONOTONIC in nanoseconds. That clock is shared by all processes on a machine, so
+// hops measured by the client and the server line up as long as they run on the same host.
+struct FrameTrace
+{
+    uint64_t id;
+    uint64_t client_send;
+};
+
+constexpr size_t MAXIMUM_PAYLOAD_SIZE = 32 << 10;  // What clients may send (e.g. a pasted log). The server's replies can be bigger, see below.
+constexpr size_t MAXIMUM_FRAME_SIZE   = sizeof(FrameHeader) + sizeof(FrameTrace) + MAXIMUM_PAYLOAD_SIZE;
+constexpr size_t SEQUENCE_SIZE        = sizeof(uint64_t);
+
+// What the server may put in one frame, numbered or not: the size in the header is 16 bits, and covers the
+// sequence number too.
+constexpr size_t MAXIMUM_SERVER_PAYLOAD_SIZE = 0xFFFF - SEQUENCE_SIZE;
+
+
+// Each side may send CHANNEL_WINDOW bytes of data on a channel before the other side has to give credit for
+// more, which it does as it gets rid of them (to the client, or into the server). So one slow client only
+// ever holds up its own channel, never the whole gateway connection.
+constexpr uint32_t CHANNEL_WINDOW       = 256 << 10;
+constexpr size_t   CHANNEL_HEADER_SIZE  = sizeof(uint32_t);
+constexpr size_t   MAXIMUM_CHANNEL_DATA = MAXIMUM_PAYLOAD_SIZE - CHANNEL_HEADER_SIZE;  // Per FRAME_DATA.
+
+inline uint32_t ReadChannel(const char* data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+inline void WriteChannel(char* data, uint32_t channel)
+{
+    uint32_t value = htonl(channel);
+    memcpy(data, &value, sizeof(value));
+}
+
+
+inline uint64_t ReadSequence(const char* data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return be64toh(value);
+}
+
+inline void WriteSequence(char* data, uint64_t sequence)
+{
+    uint64_t value = htobe64(sequence);
+    memcpy(data, &value, sizeof(value));
+}
+
+
+// Writes the whole frame with a single call. Returns false if the socket is broken.
+inline bool WriteFrame(int socket_fd, FrameType type, const char* payload, size_t size, const FrameTrace* trace = nullptr)
+{
+    if (size > MAXIMUM_PAYLOAD_SIZE)
+        size = MAXIMUM_PAYLOAD_SIZE;
+
+    char   frame[MAXIMUM_FRAME_SIZE];
+    size_t offset = sizeof(FrameHeader);
+
+    FrameHeader header;
+    header.type  = type;
+    header.flags = 0;
+    if (trace)
+    {
+        header.flags |= FRAME_TRACED;
+        memcpy(&frame[offset], trace, sizeof(FrameTrace));
+        offset += sizeof(FrameTrace);
+    }
+    header.size = htons((uint16_t) (offset - sizeof(FrameHeader) + size));
+    memcpy(&frame[0], &header, sizeof(header));
+    memcpy(&frame[offset], payload, size);
+    offset += size;
+
+    size_t written = 0;
+    while (written < offset)
+    {
+        ssize_t bytes_written = send(socket_fd, &frame[written], offset - written, MSG_NOSIGNAL);
+        if (bytes_written <= 0)
+            return false;
+        written += bytes_written;
+    }
+    return true;
+}
+
+
+// Splits the bytes received on a socket into frames. Bytes are received into a scratch buffer shared by
+// all connections, and only an incomplete frame at the end is copied out and kept with the connection. That
+// way an idle connection doesn't hold on to a receive buffer.
+//
+//     reader.Receive(socket, scratch, sizeof(scratch));
+//     while (reader.Next(...))
+//         ...;
+//     reader.Finish();  // Always, even if 'Receive' failed.
+//
+// Complete frames can be left for later too: 'Finish' keeps everything that wasn't taken with 'Next', and
+// 'Load' gets it back without reading more from the socket.
+struct FrameReader
+{
+    char*    partial      = nullptr;
+    uint32_t partial_size = 0;
+    size_t   maximum_payload = MAXIMUM_PAYLOAD_SIZE;  // Bigger frames are malformed.
+    uint64_t sequence        = 0;  // Of the last frame, if it had FRAME_SEQUENCED.
+
+    // Only valid between 'Receive' and 'Finish'.
+    char*  buffer   = nullptr;
+    size_t size     = 0;
+    size_t consumed = 0;
+
+    FrameReader() = default;
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+    ~FrameReader() { free(partial); }
+
+    // Only takes back what was kept by the last 'Finish'.
+    void Load(char* scratch)
+    {
+        buffer   = scratch;
+        size     = partial_size;
+        consumed = 0;
+        if (partial != nullptr)
+        {
+            memcpy(scratch, partial, partial_size);
+            free(partial);
+            partial      = nullptr;
+            partial_size = 0;
+        }
+    }
+
+    // Reads whatever is available. 'scratch_size' must be larger than the biggest frame plus what was
+    // kept. Returns what 'recv' returned.
+    ssize_t Receive(int socket_fd, char* scratch, size_t scratch_size)
+    {
+        return Receive(scratch, scratch_size, [socket_fd](char* data, size_t size) { return recv(socket_fd, data, size, 0); });
+    }
+
+    // The same for connections that aren't sockets: 'read(data, size)' stands in for 'recv'.
+    template<typename Read>
+    ssize_t Receive(char* scratch, size_t scratch_size, Read read)
+    {
+        Load(scratch);
+        ssize_t bytes_received = read(&buffer[size], scratch_size - size);
+        if (bytes_received > 0)
+            size += bytes_received;
+        return bytes_received;
+    }
+
+    // Returns false if there's no complete frame buffered, or if the frame is malformed (then 'malformed'
+    // is set and the connection should be dropped, as there's no way to find the next frame). 'trace' is
+    // only filled in if the header has the FRAME_TRACED flag. 'payload' points into the scratch buffer.
+    bool Next(FrameHeader& header, FrameTrace& trace, const char*& payload, size_t& payload_size, bool& malformed)
+    {
+        malformed = false;
+        if (size - consumed < sizeof(FrameHeader))
+            return false;
+
+        memcpy(&header, &buffer[consumed], sizeof(header));
+        size_t frame_size    = ntohs(header.size);
+        size_t trace_size    = (header.flags & FRAME_TRACED) ? sizeof(FrameTrace) : 0;
+        size_t sequence_size = (header.flags & FRAME_SEQUENCED) ? SEQUENCE_SIZE : 0;
+        if (Malformed(header))
+        {
+            malformed = true;
+            return false;
+        }
+        if (size - consumed < sizeof(FrameHeader) + frame_size)
+            return false;
+
+        const char* start = &buffer[consumed + sizeof(FrameHeader)];
+        if (trace_size)
+            memcpy(&trace, start, sizeof(trace));
+        if (sequence_size)
+            sequence = ReadSequence(start + trace_size);
+        payload      = start + trace_size + sequence_size;
+        payload_size = frame_size - trace_size - sequence_size;
+        consumed    += sizeof(FrameHeader) + frame_size;
+        return true;
+    }
+
+    // True if 'Next' would return a frame, or report a malformed one.
+    bool Pending() const
+    {
+        if (size - consumed < sizeof(FrameHeader))
+            return false;
+        FrameHeader header;
+        memcpy(&header, &buffer[consumed], sizeof(header));
+        return size - consumed >= sizeof(FrameHeader) + ntohs(header.size) || Malformed(header);
+    }
+
+    bool Malformed(const FrameHeader& header) const
+    {
+        size_t frame_size    = ntohs(header.size);
+        size_t trace_size    = (header.flags & FRAME_TRACED) ? sizeof(FrameTrace) : 0;
+        size_t sequence_size = (header.flags & FRAME_SEQUENCED) ? SEQUENCE_SIZE : 0;
+        return frame_size < trace_size + sequence_size || frame_size - trace_size - sequence_size > maximum_payload;
+    }
+
+    // Keeps what wasn't taken (the incomplete frame at the end, if nothing else) until the next 'Receive'.
+    void Finish()
+    {
+        size_t left = size - consumed;
+        if (left > 0)
+        {
+            partial      = (char*) malloc(left);
+            partial_size = (uint32_t) left;
+            memcpy(partial, &buffer[consumed], left);
+        }
+        buffer   = nullptr;
+        size     = 0;
+        consumed = 0;
+    }
+};
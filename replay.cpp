@@ -0,0 +1,201 @@
+#include <unordered_map>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "capture.h"
+#include "protocol.h"
+#include "timing.h"
+
+
+// Plays a capture made with 'Server --capture=<file>' back against a server. Every captured connection
+// gets its own connection, opened when its first frame is due and closed when it was closed in the
+// capture, and every frame is sent at the time it was received (scaled by '--speed'). With '--copies=<n>'
+// the whole capture is played n times at once, on separate connections, to see how the server copes with
+// n times the traffic of the same shape.
+//
+// Whatever the server sends back is read and thrown away, so the server doesn't cut us off as slow.
+
+
+static int      epoll_fd       = -1;
+static uint64_t bytes_received = 0;
+
+
+void Terminate(int code, const char* message)
+{
+    printf("[Exit %d]: %s\n", errno, message);fflush(stdout);
+    exit(code);
+}
+
+
+// Reads everything that's waiting, waiting up to 'timeout' milliseconds for the first of it.
+void DrainReplies(int timeout)
+{
+    static char buffer[1 << 16];
+    epoll_event events[256];
+
+    int count = epoll_wait(epoll_fd, events, 256, timeout);
+    for (int i = 0; i < count; ++i)
+    {
+        ssize_t bytes;
+        while ((bytes = recv(events[i].data.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+            bytes_received += bytes;
+        if (bytes == 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);  // The server closed it.
+    }
+}
+
+
+int Connect(const sockaddr_in& address)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1)
+        return -1;
+    if (connect(socket_fd, (const sockaddr*) &address, sizeof(address)) == -1)
+    {
+        close(socket_fd);
+        return -1;
+    }
+
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = socket_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event);
+    return socket_fd;
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: <address> <port> <capture file> [--speed=<factor>|max] [--copies=<n>]";
+    if (argc < 4)
+        Terminate(1, usage);
+
+    double   speed  = 1.0;  // 0 means as fast as possible.
+    uint32_t copies = 1;
+    for (int i = 4; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        if (strcmp(argument, "--speed=max") == 0)
+            speed = 0;
+        else if (strncmp(argument, "--speed=", 8) == 0 && atof(argument + 8) > 0)
+            speed = atof(argument + 8);
+        else if (strncmp(argument, "--copies=", 9) == 0 && atoi(argument + 9) > 0)
+            copies = (uint32_t) atoi(argument + 9);
+        else
+            Terminate(1, usage);
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &address.sin_addr) <= 0)
+        Terminate(1, "Invalid address.");
+
+    CaptureReader capture;
+    if (!capture.Open(argv[3]))
+        Terminate(1, "Couldn't open capture file.");
+
+    // Busy captures have a lot of connections open at once.
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        Terminate(1, "Couldn't create epoll instance.");
+
+    // (copy << 32 | captured connection) -> socket.
+    std::unordered_map<uint64_t, int> sockets;
+
+    uint64_t frames      = 0;
+    uint64_t connections = 0;
+    uint64_t failed      = 0;
+    uint64_t scheduled   = 0;
+    uint64_t late_total  = 0;  // How far behind schedule records were played, in nanoseconds.
+    uint64_t late_worst  = 0;
+    uint64_t last_time   = 0;
+    uint64_t start       = MonotonicNanoseconds();
+
+    CaptureRecord record;
+    while (capture.Next(record))
+    {
+        last_time = record.time;
+        if (speed != 0)
+        {
+            uint64_t due = start + (uint64_t) (record.time * 1000 / speed);
+            uint64_t now;
+            while ((now = MonotonicNanoseconds()) < due)
+                DrainReplies((int) ((due - now) / 1000000));
+            ++scheduled;
+            late_total += now - due;
+            late_worst  = now - due > late_worst ? now - due : late_worst;
+        }
+        else if (frames % 64 == 0)
+        {
+            DrainReplies(0);
+        }
+
+        for (uint32_t copy = 0; copy < copies; ++copy)
+        {
+            uint64_t key   = (uint64_t) copy << 32 | record.connection;
+            auto     found = sockets.find(key);
+
+            if (record.type == CAPTURE_CLOSED)
+            {
+                if (found != sockets.end())
+                {
+                    close(found->second);
+                    sockets.erase(found);
+                }
+                continue;
+            }
+
+            if (found == sockets.end())
+            {
+                int socket_fd = Connect(address);
+                if (socket_fd == -1)
+                {
+                    ++failed;
+                    continue;
+                }
+                found = sockets.emplace(key, socket_fd).first;
+                ++connections;
+            }
+
+            if (!WriteFrame(found->second, (FrameType) record.type, record.payload, record.size))
+            {
+                ++failed;
+                close(found->second);
+                sockets.erase(found);
+                continue;
+            }
+            ++frames;
+        }
+    }
+
+    // Give the server a moment to answer the last frames.
+    DrainReplies(100);
+    uint64_t elapsed = MonotonicNanoseconds() - start;
+    for (auto& entry : sockets)
+        close(entry.second);
+
+    printf("[Replay]: %llu frames on %llu connections (%llu failed) in %.1fms, the capture took %.1fms\n",
+           (unsigned long long) frames, (unsigned long long) connections, (unsigned long long) failed,
+           elapsed / 1e6, last_time / 1e3);
+    if (speed != 0)
+        printf("[Replay]: Behind schedule by %.1fus on average, %.1fus at worst\n",
+               scheduled ? late_total / 1e3 / scheduled : 0.0, late_worst / 1e3);
+    printf("[Replay]: %llu bytes received from the server\n", (unsigned long long) bytes_received);
+    fflush(stdout);
+    return 0;
+}
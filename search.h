@@ -0,0 +1,591 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "events.h"
+#include "history.h"
+#include "sketch.h"
+#include "timing.h"
+
+
+// Full-text search over the message history.
+//
+// The index maps every word to a posting list: the sorted ids of the messages containing it. Posting lists
+// are split into blocks of 128 ids, each stored as varint-encoded deltas from the block's first id, with the
+// first and last id kept uncompressed next to it. Queries only decode the blocks they need.
+//
+// Since message ids increase with time, a time range is turned into an id range up front, and blocks
+// outside of it are skipped without being decoded. A query walks the posting list of its rarest word from
+// the newest block backwards, intersects each block with the matching ids of the other words, and stops as
+// soon as it has enough results. So the cost depends on how many blocks are needed, not on the size of
+// the history.
+
+
+// Splits text into lowercase words. Anything that isn't an ASCII letter or digit separates words, except
+// bytes of multi-byte UTF-8 characters, which are kept so non-English words still work.
+template <typename Callback>
+void Tokenize(const char* text, size_t size, Callback&& callback)
+{
+    constexpr size_t MAXIMUM_WORD_SIZE = 32;
+
+    char   word[MAXIMUM_WORD_SIZE];
+    size_t length = 0;
+    for (size_t i = 0; i <= size; ++i)
+    {
+        unsigned char c = i < size ? (unsigned char) text[i] : ' ';
+        bool is_word = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+        if (is_word)
+        {
+            if (length < MAXIMUM_WORD_SIZE)
+                word[length++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+        }
+        else if (length > 0)
+        {
+            callback(word, length);
+            length = 0;
+        }
+    }
+}
+
+
+// Intersection of two sorted arrays without duplicates. 'out' must have room for the smaller of the two.
+// With SSE2, four ids of 'a' are compared against four ids of 'b' at a time (all 16 pairs, by rotating
+// 'b'), and whichever block has the smaller maximum is advanced.
+inline size_t Intersect(const uint32_t* a, size_t a_size, const uint32_t* b, size_t b_size, uint32_t* out)
+{
+    size_t i = 0, j = 0, count = 0;
+
+#if defined(__SSE2__)
+    while (i + 4 <= a_size && j + 4 <= b_size)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + j));
+
+        __m128i m0 = _mm_cmpeq_epi32(va, vb);
+        __m128i m1 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)));
+        __m128i m2 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+        __m128i m3 = _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_or_si128(m0, m1), _mm_or_si128(m2, m3))));
+
+        while (mask)
+        {
+            out[count++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        uint32_t a_max = a[i + 3];
+        uint32_t b_max = b[j + 3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
+    }
+#endif
+
+    while (i < a_size && j < b_size)
+    {
+        if      (a[i] < b[j]) ++i;
+        else if (b[j] < a[i]) ++j;
+        else { out[count++] = a[i]; ++i; ++j; }
+    }
+    return count;
+}
+
+
+struct PostingList
+{
+    static constexpr uint32_t BLOCK_SIZE = 128;
+
+    struct Block
+    {
+        uint32_t first;
+        uint32_t last;
+        uint32_t offset;  // Into 'bytes'.
+        uint32_t count;
+    };
+
+    std::vector<Block>    blocks;
+    std::vector<uint8_t>  bytes;
+    std::vector<uint32_t> tail;   // The newest ids, not yet compressed into a block.
+    uint32_t              total = 0;
+
+    void Add(uint32_t id)
+    {
+        if (total > 0 && Last() == id)
+            return;  // The word appears more than once in the same message.
+        tail.push_back(id);
+        ++total;
+        if (tail.size() == BLOCK_SIZE)
+            Seal();
+    }
+
+    uint32_t Last() const { return tail.empty() ? blocks.back().last : tail.back(); }
+
+    // The tail counts as the last unit, after all blocks.
+    size_t   Units() const                { return blocks.size() + (tail.empty() ? 0 : 1); }
+    uint32_t UnitFirst(size_t unit) const { return unit < blocks.size() ? blocks[unit].first : tail.front(); }
+    uint32_t UnitLast(size_t unit) const  { return unit < blocks.size() ? blocks[unit].last  : tail.back(); }
+
+    // Writes the ids of the unit to 'out' (room for BLOCK_SIZE) and returns how many there were.
+    uint32_t Decode(size_t unit, uint32_t* out) const
+    {
+        if (unit >= blocks.size())
+        {
+            std::copy(tail.begin(), tail.end(), out);
+            return (uint32_t) tail.size();
+        }
+
+        const Block&   block  = blocks[unit];
+        const uint8_t* cursor = &bytes[block.offset];
+        uint32_t       id     = block.first;
+        out[0] = id;
+        for (uint32_t i = 1; i < block.count; ++i)
+        {
+            uint32_t delta = 0;
+            for (int shift = 0; ; shift += 7)
+            {
+                uint8_t byte = *cursor++;
+                delta |= (uint32_t) (byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    break;
+            }
+            id    += delta;
+            out[i] = id;
+        }
+        return block.count;
+    }
+
+    // Index of the first unit whose last id is >= 'id'.
+    size_t FindUnit(uint32_t id) const
+    {
+        auto found = std::lower_bound(blocks.begin(), blocks.end(), id,
+                                      [](const Block& block, uint32_t value) { return block.last < value; });
+        return found - blocks.begin();
+    }
+
+private:
+    void Seal()
+    {
+        Block block;
+        block.first  = tail.front();
+        block.last   = tail.back();
+        block.offset = (uint32_t) bytes.size();
+        block.count  = (uint32_t) tail.size();
+        for (size_t i = 1; i < tail.size(); ++i)
+        {
+            uint32_t delta = tail[i] - tail[i - 1];
+            while (delta >= 0x80)
+            {
+                bytes.push_back((uint8_t) (delta | 0x80));
+                delta >>= 7;
+            }
+            bytes.push_back((uint8_t) delta);
+        }
+        blocks.push_back(block);
+        tail.clear();
+    }
+};
+
+
+struct SearchIndex
+{
+    std::unordered_map<std::string, PostingList> terms;
+    std::vector<uint64_t>                        times;  // Time of every message, indexed by id.
+
+    void Add(uint32_t id, uint64_t time, const char* text, size_t size)
+    {
+        if (times.size() <= id)
+            times.resize(id + 1, time);
+        times[id] = time;
+
+        Tokenize(text, size, [&](const char* word, size_t length) {
+            terms[std::string(word, length)].Add(id);
+        });
+    }
+
+    // Finds the newest messages (at most 'limit') containing all words in 'query' and sent within
+    // [from, to] (ms since the epoch). Returns their ids, newest first.
+    std::vector<uint32_t> Search(const char* query, size_t size, uint64_t from, uint64_t to, size_t limit) const
+    {
+        std::vector<uint32_t> results;
+
+        std::vector<const PostingList*> lists;
+        bool missing = false;
+        Tokenize(query, size, [&](const char* word, size_t length) {
+            auto found = terms.find(std::string(word, length));
+            if (found == terms.end())
+                missing = true;
+            else if (std::find(lists.begin(), lists.end(), &found->second) == lists.end())
+                lists.push_back(&found->second);
+        });
+        if (missing || lists.empty() || times.empty())
+            return results;
+
+        // Time range to id range.
+        uint32_t first_id = (uint32_t) (std::lower_bound(times.begin(), times.end(), from) - times.begin());
+        uint32_t last_id  = (uint32_t) (std::upper_bound(times.begin(), times.end(), to) - times.begin());
+        if (first_id >= last_id)
+            return results;
+        --last_id;
+
+        std::sort(lists.begin(), lists.end(),
+                  [](const PostingList* a, const PostingList* b) { return a->total < b->total; });
+
+        const PostingList& driver = *lists[0];
+        uint32_t candidates[PostingList::BLOCK_SIZE];
+        uint32_t scratch[PostingList::BLOCK_SIZE];
+        std::vector<uint32_t> other;
+
+        for (size_t unit = driver.Units(); unit-- > 0 && results.size() < limit; )
+        {
+            if (driver.UnitFirst(unit) > last_id)
+                continue;
+            if (driver.UnitLast(unit) < first_id)
+                break;
+
+            uint32_t count = driver.Decode(unit, candidates);
+            uint32_t low   = std::max(candidates[0], first_id);
+            uint32_t high  = std::min(candidates[count - 1], last_id);
+
+            for (size_t i = 1; i < lists.size() && count > 0; ++i)
+            {
+                const PostingList& list = *lists[i];
+                size_t first_unit = list.FindUnit(low);
+                size_t end_unit   = std::min(list.FindUnit(high) + 1, list.Units());
+
+                if (end_unit - first_unit <= count)
+                {
+                    // Decode the blocks of the other word that overlap this block and intersect them all at once.
+                    other.clear();
+                    for (size_t u = first_unit; u < end_unit; ++u)
+                    {
+                        size_t start = other.size();
+                        other.resize(start + PostingList::BLOCK_SIZE);
+                        other.resize(start + list.Decode(u, &other[start]));
+                    }
+                    count = (uint32_t) Intersect(candidates, count, other.data(), other.size(), scratch);
+                }
+                else
+                {
+                    // The other word is much more common, so only decode the blocks a candidate could be in.
+                    uint32_t kept         = 0;
+                    size_t   decoded_unit = SIZE_MAX;
+                    uint32_t decoded      = 0;
+                    other.resize(PostingList::BLOCK_SIZE);
+                    for (uint32_t c = 0; c < count; ++c)
+                    {
+                        size_t unit_of_candidate = list.FindUnit(candidates[c]);
+                        if (unit_of_candidate >= list.Units())
+                            break;
+                        if (unit_of_candidate != decoded_unit)
+                        {
+                            decoded      = list.Decode(unit_of_candidate, other.data());
+                            decoded_unit = unit_of_candidate;
+                        }
+                        if (std::binary_search(other.data(), other.data() + decoded, candidates[c]))
+                            scratch[kept++] = candidates[c];
+                    }
+                    count = kept;
+                }
+                std::copy(scratch, scratch + count, candidates);
+            }
+
+            for (uint32_t i = count; i-- > 0 && results.size() < limit; )
+                if (candidates[i] >= first_id && candidates[i] <= last_id)
+                    results.push_back(candidates[i]);
+        }
+        return results;
+    }
+};
+
+
+// Runs the index on its own thread, so neither indexing nor searching ever blocks a client thread. The
+// worker flushes new messages from the history to disk and into the index every few milliseconds, and
+// answers queries as soon as they come in. Replies are handed to 'reply(user_id, text, size)'.
+//
+// It also answers syncs, from clients that keep the history they've seen and only want what's missing
+// (see 'SyncEvent'). Those replies are encoded events, handed to 'send(user_id, events)'.
+struct SearchService
+{
+    static constexpr size_t   MAXIMUM_RESULTS    = 10;
+    static constexpr int      MAXIMUM_HIT_SIZE   = 4096;  // Of the text shown per result,
+    static constexpr int      MAXIMUM_ECHO_SIZE  = 256;   // and of the query repeated above them.
+    static_assert(MAXIMUM_RESULTS * (MAXIMUM_HIT_SIZE + 128) + MAXIMUM_ECHO_SIZE + 128 <= MAXIMUM_SERVER_PAYLOAD_SIZE,
+                  "A search reply has to fit in one frame.");
+    static constexpr uint32_t MAXIMUM_SYNC_COUNT = 1000;     // Messages per sync, the newest ones.
+    static constexpr size_t   MAXIMUM_SYNC_SIZE  = 1 << 20;  // Bytes per sync, well under a client's queue limit.
+
+    struct Query
+    {
+        uint32_t    user_id;
+        std::string text;
+    };
+
+    struct Sync
+    {
+        uint32_t    user_id;
+        uint32_t    first;
+        BloomFilter held;
+    };
+
+    HistoryStore& history;
+    SearchIndex   index;
+    std::function<void(uint32_t user_id, const char* text, size_t size)> reply;
+    std::function<void(uint32_t user_id, std::vector<std::string>& events)> send;
+
+    // Fills the index from a snapshot, for the messages the history got from it (see 'HistoryStore::Open'),
+    // and writes one every 'snapshot_interval' seconds when there are new messages (see snapshot.h).
+    std::function<void(SearchIndex& index)>                                    restore;
+    std::function<bool(const HistoryStore& history, const SearchIndex& index)> snapshot;
+    unsigned                                                                   snapshot_interval = 0;
+
+    std::mutex              lock;
+    std::condition_variable wake;
+    std::vector<Query>      queries;
+    std::vector<Sync>       syncs;
+    std::thread             thread;
+
+    // Counters for the stats.
+    std::atomic<uint64_t> searches{ 0 };
+    std::atomic<uint64_t> search_nanoseconds{ 0 };
+    std::atomic<uint64_t> sync_count{ 0 };
+    std::atomic<uint64_t> synced{ 0 };   // Messages sent.
+    std::atomic<uint64_t> skipped{ 0 };  // Messages the clients already had, not read nor sent.
+    std::atomic<uint64_t> replayed{ 0 };          // Messages indexed on startup, after the snapshot's.
+    std::atomic<uint64_t> startup_nanoseconds{ 0 };  // Until the whole history was searchable.
+    std::atomic<uint64_t> snapshots{ 0 };
+    std::atomic<uint64_t> snapshot_nanoseconds{ 0 };  // Of the last one.
+
+    explicit SearchService(HistoryStore& history) : history(history) {}
+
+    void Start()
+    {
+        thread = std::thread([this]() { Run(); });
+    }
+
+    void Submit(uint32_t user_id, const char* text, size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queries.push_back(Query{ user_id, std::string(text, size) });
+        }
+        wake.notify_one();
+    }
+
+    void SubmitSync(uint32_t user_id, const SyncEvent& sync)
+    {
+        Sync submitted{ user_id, sync.first, BloomFilter{} };
+        submitted.held.bits.assign(sync.filter.data, sync.filter.data + sync.filter.size);
+        // No hashes would match anything, and the client would get nothing.
+        submitted.held.hashes = std::min(std::max<uint32_t>(sync.hashes, 1), BloomFilter::MAXIMUM_HASHES);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            syncs.push_back(std::move(submitted));
+        }
+        wake.notify_one();
+    }
+
+    bool Running() const { return thread.joinable(); }
+
+private:
+    // How much of the text fits in 'maximum' bytes, without cutting a UTF-8 character in two.
+    static int Shorten(const char* text, int size, int maximum)
+    {
+        if (size <= maximum)
+            return size;
+        while (maximum > 0 && ((uint8_t) text[maximum] & 0xC0) == 0x80)
+            --maximum;
+        return maximum;
+    }
+
+    void Run()
+    {
+        // Index what's already in the history file first. Until that's done, searches only see part of it.
+        // What the snapshot has is indexed already, only what was written after it is replayed.
+        uint64_t start = MonotonicNanoseconds();
+        uint32_t first = 0;
+        if (restore && history.Restored() > 0)
+        {
+            restore(index);
+            first = history.Restored();
+        }
+        restore = nullptr;
+        history.ForEach([this](uint32_t id, const HistoryRecord& record, const char* text) {
+            index.Add(id, record.time, text, record.size);
+        }, first);
+        replayed.store(history.Count() - first, std::memory_order_relaxed);
+        startup_nanoseconds.store(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+
+        uint64_t last_snapshot  = MonotonicNanoseconds();
+        uint32_t snapshot_count = first;
+
+        while (true)
+        {
+            std::vector<Query> batch;
+            std::vector<Sync>  sync_batch;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait_for(guard, std::chrono::milliseconds(20), [this]() { return !queries.empty() || !syncs.empty(); });
+                batch.swap(queries);
+                sync_batch.swap(syncs);
+            }
+
+            history.Flush([this](uint32_t id, const HistoryRecord& record, const char* text) {
+                index.Add(id, record.time, text, record.size);
+            });
+
+            for (const Query& query : batch)
+                Answer(query);
+            for (const Sync& sync : sync_batch)
+                AnswerSync(sync);
+
+            uint64_t now = MonotonicNanoseconds();
+            if (snapshot && snapshot_interval != 0 && history.Count() != snapshot_count &&
+                now - last_snapshot >= snapshot_interval * 1000000000ull)
+            {
+                if (snapshot(history, index))
+                {
+                    snapshot_count = history.Count();
+                    snapshots.fetch_add(1, std::memory_order_relaxed);
+                }
+                last_snapshot = MonotonicNanoseconds();  // Failed or not, try again in an interval.
+                snapshot_nanoseconds.store(last_snapshot - now, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Walks the history from the newest message back to 'first', and sends the ones that aren't in the
+    // client's filter, oldest first. Only those are read from the file, so a client that's nearly up to
+    // date costs a few filter checks per message it has, and nothing else. A false positive of the filter
+    // means a message the client doesn't get; at 10 bits per message that's 1 in 100.
+    void AnswerSync(const Sync& sync)
+    {
+        std::vector<std::string> events;
+        size_t        size  = 0;
+        uint32_t      held  = 0;
+        bool          more  = false;
+        HistoryRecord record;
+        char          text[HistoryStore::MAXIMUM_TEXT_SIZE];
+        for (uint32_t id = history.Count(); id-- > sync.first; )
+        {
+            if (sync.held.MayContain(id))
+            {
+                ++held;
+                continue;
+            }
+            if (events.size() == MAXIMUM_SYNC_COUNT || size >= MAXIMUM_SYNC_SIZE)
+            {
+                more = true;
+                break;
+            }
+            if (!history.Read(id, record, text))
+                continue;
+
+            HistoryEvent event;
+            event.id     = id;
+            event.sender = record.sender;
+            event.time   = record.time;
+            event.text   = Bytes{ text, record.size };
+            std::string encoded(Codec<HistoryEvent>::Size(event), '\0');
+            Codec<HistoryEvent>::Encode(event, &encoded[0]);
+            size += encoded.size();
+            events.push_back(std::move(encoded));
+        }
+        std::reverse(events.begin(), events.end());
+
+        char line[160];
+        int  length = snprintf(line, sizeof(line), ">>> Synced %zu message(s) of the history, %u were already here%s <<<\n",
+                               events.size(), held, more ? ", sync again for older ones" : "");
+        NoticeEvent notice;
+        notice.text = Bytes{ line, (uint32_t) length };
+        std::string encoded(Codec<NoticeEvent>::Size(notice), '\0');
+        Codec<NoticeEvent>::Encode(notice, &encoded[0]);
+        events.push_back(std::move(encoded));
+
+        sync_count.fetch_add(1, std::memory_order_relaxed);
+        synced.fetch_add(events.size() - 1, std::memory_order_relaxed);
+        skipped.fetch_add(held, std::memory_order_relaxed);
+        send(sync.user_id, events);
+    }
+
+    // A query is a list of words. 'since:<seconds>' and 'until:<seconds>' limit it to messages sent
+    // between that many seconds ago and now.
+    void Answer(const Query& query)
+    {
+        uint64_t start = MonotonicNanoseconds();
+
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t now_ms = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        uint64_t from = 0;
+        uint64_t to   = UINT64_MAX;
+
+        std::string words;
+        const char* cursor = query.text.c_str();
+        while (*cursor)
+        {
+            while (*cursor == ' ' || *cursor == '\n')
+                ++cursor;
+            const char* end = cursor;
+            while (*end && *end != ' ' && *end != '\n')
+                ++end;
+
+            if (strncmp(cursor, "since:", 6) == 0)
+            {
+                uint64_t seconds = strtoull(cursor + 6, NULL, 10) * 1000;
+                from = now_ms > seconds ? now_ms - seconds : 0;
+            }
+            else if (strncmp(cursor, "until:", 6) == 0)
+            {
+                uint64_t seconds = strtoull(cursor + 6, NULL, 10) * 1000;
+                to = now_ms > seconds ? now_ms - seconds : 0;
+            }
+            else
+                words.append(cursor, end).push_back(' ');
+            cursor = end;
+        }
+
+        std::vector<uint32_t> ids = index.Search(words.data(), words.size(), from, to, MAXIMUM_RESULTS);
+
+        std::string   output;
+        char          line[HistoryStore::MAXIMUM_TEXT_SIZE + 64];
+        HistoryRecord record;
+        char          text[HistoryStore::MAXIMUM_TEXT_SIZE];
+        int echo = Shorten(query.text.data(), (int) query.text.size(), MAXIMUM_ECHO_SIZE);
+        snprintf(line, sizeof(line), ">>> %zu result(s) for '%.*s%s' <<<\n", ids.size(), echo, query.text.data(),
+                 echo < (int) query.text.size() ? "..." : "");
+        output += line;
+        for (uint32_t id : ids)
+        {
+            if (!history.Read(id, record, text))
+                continue;
+            time_t    seconds = (time_t) (record.time / 1000);
+            struct tm local;
+            localtime_r(&seconds, &local);
+            int size  = record.size > 0 && text[record.size - 1] == '\n' ? record.size - 1 : record.size;
+            int shown = Shorten(text, size, MAXIMUM_HIT_SIZE);
+            snprintf(line, sizeof(line), "    [%04d-%02d-%02d %02d:%02d] Client %u: %.*s%s\n",
+                     local.tm_year + 1900, local.tm_mon + 1, local.tm_mday, local.tm_hour, local.tm_min,
+                     record.sender, shown, text, shown < size ? "..." : "");
+            output += line;
+        }
+
+        searches.fetch_add(1, std::memory_order_relaxed);
+        search_nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+        reply(query.user_id, output.data(), output.size());
+    }
+};
@@ -1,15 +1,21 @@
-#include <thread>
+#include <vector>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
+#include <signal.h>
 
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include <pthread.h>
 
+#include "chat_core.h"
+
 
 sa_family_t IPv4 = AF_INET;
 sa_family_t IPv6 = AF_INET6;
@@ -18,129 +24,257 @@ sa_family_t TCP = SOCK_STREAM;
 sa_family_t UDP = SOCK_DGRAM;
 
 
-constexpr unsigned MAXIMUM_NUMBER_OF_CLIENTS = 255;
-static int client_sockets[MAXIMUM_NUMBER_OF_CLIENTS];
-
-void DispatchMessage(int id, const char* message, int size);
-
-
-void TerminateClient(int socket_fd, int code, const char* message)
-{
-    // Not thread safe!
-    char temp[255] = { 0 };
-
-    for (unsigned i = 0; i < MAXIMUM_NUMBER_OF_CLIENTS; ++i)
-    {
-        int client_socket = client_sockets[i];
-        if (client_socket == socket_fd)
-        {
-            close(client_socket);
-            client_sockets[i] = 0;
-            break;
-        }
-    }
-
-    sprintf(temp, ">>> Client %d left <<<\n", socket_fd);
-    DispatchMessage(socket_fd, temp, strlen(temp));
-
-    printf("[Exit %d]: %s\n", errno, message);fflush(stdout);
-    pthread_exit((void *) code);
-}
-
-
 void Terminate(int code, const char* message)
 {
+    logger.Stop();
+    tracer.Close();
+    capture.Close();
     printf("[Exit %d]: %s\n", errno, message);fflush(stdout);
     exit(code);
 }
 
 
-void DispatchMessage(int socket_fd, const char* message, int size)
+// Has the loop print the stats each time the server receives SIGUSR1 (e.g. 'kill -USR1 <pid>'), and reads
+// the filter file again on SIGHUP. The signals are blocked in all other threads, so they're always
+// delivered here. The new patterns are compiled here too, the loop only swaps them in.
+void* StatsThread(void*)
 {
-    for (int i = 0; i < MAXIMUM_NUMBER_OF_CLIENTS; ++i)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+
+    while (true)
     {
-        int client_socket = client_sockets[i];
-        if (client_socket == 0 || client_socket == socket_fd)
+        int signal = 0;
+        if (sigwait(&signals, &signal) != 0)
             continue;
-
-        ssize_t bytes_written = write(client_socket, message, size);
-        if (bytes_written == -1)
-            printf("Couldn't write to socket %d.\n", client_socket);
+        if (signal == SIGUSR1)
+            RequestStats();
+        else if (content_filter.Enabled() && !content_filter.Reload())
+        {
+            printf("[Filter]: Couldn't read %s, keeping the current patterns.\n", content_filter.path.c_str());fflush(stdout);
+        }
     }
+    return 0;
 }
 
 
-void* HandleClient(void* data)
+int main(int argc, char* argv[])
 {
-    int socket_fd = *(int *) data;
-
-    constexpr   size_t BUFFER_SIZE  = 1023;
-    static char buffer[BUFFER_SIZE] = { 0 };
+    const char* usage = "Usage: <port> [--quiet] [--log-level=debug|info|warning|error] [--log-sample=<n>] "
+                        "[--trace=<file>] [--trace-sample=<n>] "
+                        "[--mailbox-dir=<dir>] [--mailbox-memory=<bytes>] [--history=<file>] [--capture=<file>] "
+                        "[--queue-limit=<bytes>] [--memory-budget=<bytes>] [--session-timeout=<seconds>] "
+                        "[--zerocopy-threshold=<bytes>] [--cpus=<list>] [--read-quantum=<bytes>] "
+                        "[--weight=<user id>:<weight>] [--filter=<file>] [--coalesce=<microseconds>] [--coalesce-bytes=<bytes>] "
+                        "[--analytics-window=<seconds>] [--accept-rate=<per second>] [--snapshot-interval=<seconds>]";
+    if (argc < 2)
+        Terminate(1, usage);
 
-    sprintf(buffer, ">>> Client %d joined <<<\n", socket_fd);
-    printf("%s", buffer);fflush(stdout);
-
-    DispatchMessage(socket_fd, buffer, strlen(buffer));
-
-    sprintf(buffer, "%d", socket_fd);
-    // We start off by sending the ID-number to the client. Not at all necessary as it's not needed by the
-    // client, but here we probably would send the client some initial setup data.
-    ssize_t bytes_written = write(socket_fd, buffer, strlen(buffer));
-    if (bytes_written == -1)
-        TerminateClient(socket_fd, 0, "Couldn't write to socket.");
-    printf("[Info]: Sent ID to the client.\n");fflush(stdout);
-
-
-    // Some handy variables to have.
-    int max_transmission_size = 1000;
-    int max_size_to_receive   = 1000;
-
-    snprintf(buffer, BUFFER_SIZE, "Client %d: ", socket_fd);  // This is just what we'll print before the client's message.
-    int buffer_start_index = strlen(buffer);
+    const char* address = "127.0.0.1";
+    const int   port = atoi(argv[1]);
+    const char* history_path = "history.bin";
+    unsigned    snapshot_interval = 60;
+    std::vector<int> cpus;  // The loop's CPU first, then the ones for the other threads.
 
-    // This will run until the client disconnects. It's from here we'll receive all messages from the client.
-    while (true)
+    for (int i = 2; i < argc; ++i)
     {
-        // Wait for message
-        // http://man7.org/linux/man-pages/man2/recvmsg.2.html
-        //     recv(socket, buffer, size, flags)
-        //          socket: any socket.
-        //          buffer: array to fill with the message.
-        //          size: the size of the buffer.
-        //          flags: options.
-        ssize_t bytes_received = recv(socket_fd, &buffer[buffer_start_index], max_size_to_receive, 0);
-        if (bytes_received == -1)
+        const char* argument = argv[i];
+        if (strcmp(argument, "--quiet") == 0)
         {
-            printf("Issue with connection.\n");fflush(stdout);
-            break;
+            // Stops the server from logging every message it relays.
+            pipeline.Get<Optional<LogStage>>().enabled = false;
         }
-        else if (bytes_received == 0)
+        else if (strncmp(argument, "--log-level=", 12) == 0)
         {
-            printf("Client %d disconnected.\n", socket_fd);fflush(stdout);
-            break;
+            static const char* LEVELS[] = { "debug", "info", "warning", "error" };
+            unsigned level = 0;
+            while (level < 4 && strcmp(argument + 12, LEVELS[level]) != 0)
+                ++level;
+            if (level == 4)
+                Terminate(1, usage);
+            logger.minimum_level = (uint8_t) level;
+        }
+        else if (strncmp(argument, "--log-sample=", 13) == 0)
+        {
+            message_log_sample_rate = (unsigned) atoi(argument + 13);
+        }
+        else if (strncmp(argument, "--trace=", 8) == 0)
+        {
+            // Traces messages that clients have sampled, and writes them to the file.
+            if (!tracer.Open(argument + 8))
+                Terminate(1, "Couldn't open trace file.");
+        }
+        else if (strncmp(argument, "--trace-sample=", 15) == 0)
+        {
+            // Also trace one in every n messages that the clients didn't sample.
+            tracer.sample_rate = (unsigned) atoi(argument + 15);
+        }
+        else if (strncmp(argument, "--mailbox-dir=", 14) == 0)
+        {
+            // Where offline messages are spilled when they don't fit in memory.
+            offline_mailboxes.directory = argument + 14;
+        }
+        else if (strncmp(argument, "--mailbox-memory=", 17) == 0)
+        {
+            offline_mailboxes.memory_budget = strtoull(argument + 17, NULL, 10);
+        }
+        else if (strncmp(argument, "--history=", 10) == 0)
+        {
+            history_path = argument + 10;
+        }
+        else if (strncmp(argument, "--snapshot-interval=", 20) == 0)
+        {
+            // How often the history's index is saved next to it (in '<history>.snapshot'), so a restart
+            // only reads what came after (0 never saves, nor loads, one).
+            snapshot_interval = (unsigned) atoi(argument + 20);
+        }
+        else if (strncmp(argument, "--queue-limit=", 14) == 0)
+        {
+            // How far behind a single client may fall before it's disconnected.
+            maximum_queued_bytes = strtoull(argument + 14, NULL, 10);
+        }
+        else if (strncmp(argument, "--memory-budget=", 16) == 0)
+        {
+            // How much all clients together may hold on to.
+            memory_budget = strtoull(argument + 16, NULL, 10);
+        }
+        else if (strncmp(argument, "--session-timeout=", 18) == 0)
+        {
+            // How long a client that lost its connection has to come back and pick up where it left off.
+            session_timeout = (unsigned) atoi(argument + 18);
+        }
+        else if (strncmp(argument, "--analytics-window=", 19) == 0)
+        {
+            // How long the windows of '[Stats]: Traffic' are.
+            analytics_window = (unsigned) atoi(argument + 19);
+            if (analytics_window == 0)
+                Terminate(1, usage);
+        }
+        else if (strncmp(argument, "--zerocopy-threshold=", 21) == 0)
+        {
+            // Messages at least this big are sent without copying them for every recipient (0 never does).
+            zerocopy_threshold = (uint32_t) strtoul(argument + 21, NULL, 10);
+        }
+        else if (strncmp(argument, "--read-quantum=", 15) == 0)
+        {
+            // How much a client may send per loop iteration before the others get their turn (0 is no limit).
+            read_quantum = (uint32_t) strtoul(argument + 15, NULL, 10);
+        }
+        else if (strncmp(argument, "--weight=", 9) == 0)
+        {
+            // Gives a user (e.g. a bridge relaying a whole channel) that many times the share of the others.
+            unsigned user_id = 0;
+            unsigned weight  = 0;
+            if (sscanf(argument + 9, "%u:%u", &user_id, &weight) != 2 || user_id == 0 || weight == 0)
+                Terminate(1, usage);
+            client_weights[user_id] = weight;
+        }
+        else if (strncmp(argument, "--coalesce=", 11) == 0)
+        {
+            // Lets broadcasts in a busy room wait up to this long to go out together, one write per client
+            // for all of them instead of one per message (0 is off).
+            coalesce_window = (uint32_t) strtoul(argument + 11, NULL, 10);
+        }
+        else if (strncmp(argument, "--coalesce-bytes=", 17) == 0)
+        {
+            coalesce_bytes = (uint32_t) strtoul(argument + 17, NULL, 10);
+        }
+        else if (strncmp(argument, "--accept-rate=", 14) == 0)
+        {
+            // How many new clients are let in per second (0 is no limit), the others wait their turn.
+            accept_rate = (uint32_t) strtoul(argument + 14, NULL, 10);
+        }
+        else if (strncmp(argument, "--cpus=", 7) == 0)
+        {
+            // Pins the loop to the first CPU (e.g. "2" or "2,3" or "2-5"), and the logger and search threads
+            // to the others, so they don't take turns with the loop. Pick CPUs of the node the network card is
+            // on ('[Stats]: Placement' says which one most traffic comes in on).
+            if (!ParseCpuList(argument + 7, cpus))
+                Terminate(1, usage);
+        }
+        else if (strncmp(argument, "--filter=", 9) == 0)
+        {
+            // Drops messages with any of the patterns in the file (one per line, case is ignored).
+            if (!content_filter.Load(argument + 9))
+                Terminate(1, "Couldn't read filter file.");
+            pipeline.Get<RuntimeStages>().Add("filter", FilterMessage);
+        }
+        else if (strncmp(argument, "--capture=", 10) == 0)
+        {
+            // Records every frame the clients send, to play back with 'Replay'.
+            if (!capture.Open(argument + 10))
+                Terminate(1, "Couldn't open capture file.");
+        }
+        else
+        {
+            Terminate(1, usage);
         }
-
-        buffer[buffer_start_index + bytes_received] = '\0';
-        printf("%s", buffer);fflush(stdout);
-        DispatchMessage(socket_fd, buffer, strlen(buffer));
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
+    // Block SIGUSR1 and SIGHUP before any thread is created so that only 'StatsThread' will receive them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Every client holds a descriptor, so raise the limit as far as we're allowed. Past it, clients are
+    // turned away (see 'ShedClients'), the server keeps going.
+    // http://man7.org/linux/man-pages/man2/getrlimit.2.html
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
-    TerminateClient(socket_fd, 0, "Tearing down client.");
-    return 0;
-}
-
-
-
-int main(int argc, char* argv[])
-{
-    if (argc != 2)
-        Terminate(1, "Usage: <port>");
-
-    const char* address = "127.0.0.1";
-    const int   port = atoi(argv[1]);
+    logger.Start();
+
+    // Where the messages are and the search index come from the last snapshot, if it's of this history.
+    static Snapshot snapshot;
+    static std::string snapshot_path = std::string(history_path) + ".snapshot";
+    uint64_t open_start = MonotonicNanoseconds();
+    bool     mapped     = snapshot_interval != 0 && snapshot.Map(snapshot_path.c_str());
+    if (!history.Open(history_path, mapped ? snapshot.Offsets() : nullptr, mapped ? snapshot.header->messages : 0,
+                      mapped ? &snapshot.header->last : nullptr))
+        Terminate(1, "Couldn't open history file.");
+    if (history.Restored() == 0)
+        snapshot.Unmap();
+    Log(LOG_INFO, "History has %u messages, %u of them from the snapshot (opened in %.1fms).", history.Count(),
+        history.Restored(), (MonotonicNanoseconds() - open_start) / 1e6);
+
+    search.restore = [](SearchIndex& index) {
+        snapshot.Restore(index);
+        snapshot.Unmap();
+    };
+    search.snapshot = [](const HistoryStore& history, const SearchIndex& index) {
+        return Snapshot::Write(snapshot_path.c_str(), history, index);
+    };
+    search.snapshot_interval = snapshot_interval;
+    search.reply = [](uint32_t user_id, const char* text, size_t size) { PostDirectMessage(user_id, text, size); };
+    search.send  = [](uint32_t user_id, std::vector<std::string>& events) { PostEvents(user_id, events); };
+    search.Start();
+
+    pthread_t stats_thread;
+    if (pthread_create(&stats_thread, NULL, StatsThread, NULL) != 0)
+        Terminate(1, "Couldn't create stats thread.");
+
+    ChatServer server;
+    if (!server.Start())
+        Terminate(1, "Couldn't start the event loop.");
+
+    // The stats thread only ever wakes up on SIGUSR1, it can run anywhere.
+    if (cpus.size() > 1)
+    {
+        pthread_t others[] = { logger.thread.native_handle(), search.thread.native_handle() };
+        for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); ++i)
+            if (!PinThread(others[i], cpus[1 + i % (cpus.size() - 1)]))
+                Terminate(1, "Couldn't pin thread.");
+    }
+    if (!cpus.empty() && !PinLoop(cpus[0]))
+        Terminate(1, "Couldn't pin the loop.");
 
     // The steps involved in establishing a socket on the server side are as follows:
     //
@@ -160,7 +294,7 @@ int main(int argc, char* argv[])
     //         domain: most commonly AF_INET (IPv4) or AF_INET6 (IPv6)
     //         type: most commonly SOCK_STREAM or SOCK_DGRAM
     //         protocol: 0 unless more protocols in the protocol family exist.
-    int listen_socket = socket(IPv4, TCP, 0);
+    listen_socket = socket(IPv4, TCP, 0);
     if (listen_socket == -1)
         Terminate(success, "Couldn't create socket.");
 
@@ -184,41 +318,17 @@ int main(int argc, char* argv[])
     //     listen(socket, backlog) marks the socket as a passive socket that will be used to accept incoming connection.
     //        socket: socket of type SOCK_STREAM or SOCK_SEQPACKET.
     //        backlog: the maximum length to which the queue of pending connections for socket may grow.
-    success = listen(listen_socket, MAXIMUM_NUMBER_OF_CLIENTS);
+    success = listen(listen_socket, SOMAXCONN);
     if (success == -1)
         Terminate(success, "Can't listen to socket.");
 
-    printf("[Info]: Waiting for clients...\n");fflush(stdout);
+    if (!server.Listen(listen_socket))
+        Terminate(1, "Couldn't start the event loop.");
+
+    Log(LOG_INFO, "Waiting for clients...");
 
+    // From here on, accepting clients and talking to them all happens in the loop.
+    // When capturing, wake up every second to flush it.
     while (true)
-    {
-        // http://man7.org/linux/man-pages/man2/accept.2.html
-        //     accept(socket, address, size, flags)
-        //         socket: socket of type SOCK_STREAM or SOCK_SEQPACKET.
-        sockaddr_in client_address{};
-        socklen_t   client_address_size = sizeof(client_address);
-        int client_socket = accept(listen_socket, (sockaddr*)&client_address, &client_address_size);
-        if (client_socket == -1)
-            Terminate(success, "Couldn't accept request from client.");
-        printf("[Info]: A client connected!\n");fflush(stdout);
-
-        // Now we have two sockets. One for listening for new clients (the 'listening_socket') and one for
-        // communicating with our connected client (the 'client_socket').
-
-        for (unsigned i = 0; i < MAXIMUM_NUMBER_OF_CLIENTS; ++i)
-        {
-            if (client_sockets[i] == 0)
-            {
-                client_sockets[i] = client_socket;
-                break;
-            }
-        }
-
-        int* client_data = new int{ client_socket };  // @Leak!
-
-        pthread_t thread;
-        int status = pthread_create(&thread, NULL, HandleClient, (void *) client_data);
-        if (status != 0)
-            Terminate(status, "Couldn't create thread.");
-    }
+        server.RunOnce(capture.Enabled() ? 1000 : -1);
 }
@@ -0,0 +1,2898 @@
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include <linux/errqueue.h>
+
+#include "byte_queue.h"
+#include "capture.h"
+#include "events.h"
+#include "filter.h"
+#include "sketch.h"
+#include "logger.h"
+#include "mailbox.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "search.h"
+#include "snapshot.h"
+#include "protocol.h"
+#include "trace.h"
+#include "user_index.h"
+#include "utf8.h"
+
+
+// The chat server without the listening socket, so it can be driven by 'Server' (over TCP), by 'Simulator'
+// (over socketpairs, in-process) and by 'Benchmark' (over loopback connections, see loopback.h). Programs
+// that embed it use it through 'ChatServer' (chat_core.h).
+//
+// All connections are served by a single thread running an epoll loop. Sockets are non-blocking, and
+// nothing is written to a socket directly: messages are appended to a per-connection outbound queue, and
+// the queues of all connections that got something are flushed once at the end of each loop iteration.
+// A broadcast is copied into a single reference counted buffer that all the queues point to, so fanning
+// out to N clients costs N queue entries, not N copies.
+//
+// Every logged in client has a session, which numbers the chat messages sent to it and keeps them until
+// the client acknowledges them. When the connection drops, the session stays behind for a while and keeps
+// collecting, so a client that comes back with its token only gets what it missed.
+//
+//     while (true)
+//         RunOnce(-1);
+
+
+constexpr unsigned MAXIMUM_NUMBER_OF_CLIENTS = 1 << 18;
+
+// Clients are addressed by a user id that stays the same between connections (unlike the socket, which the
+// OS reuses). The index lets us find the socket of a user without scanning the connections.
+static UserIndex             user_index(MAXIMUM_NUMBER_OF_CLIENTS);
+static std::atomic<uint32_t> next_user_id{ 1 };
+
+// Only one in this many relayed messages is logged (0 logs none). Set with '--log-sample=<n>'.
+static unsigned message_log_sample_rate = 1;
+
+// Announce to everyone when a client joins or leaves. That's a broadcast per join, so a burst of N joins
+// costs N * N deliveries (the simulator turns it off unless asked for).
+static bool announce_presence = true;
+
+// A client that doesn't read fast enough to keep its outbound queue below this is disconnected, rather
+// than letting it make the server buffer without bound. It's well above a full mailbox, which is queued
+// all at once on login.
+static uint64_t maximum_queued_bytes = 4 << 20;
+
+// What all connections together may hold on to (see 'Connection::Memory'). Over it, the connections
+// holding the most are disconnected until we're back under 3/4 of it, so many clients that are each
+// under 'maximum_queued_bytes' still can't push the server into swap. Set with '--memory-budget=<bytes>'.
+static uint64_t memory_budget = 512 << 20;
+
+// A session that hasn't acknowledged this much is behind anyway, so the oldest messages are forgotten
+// rather than kept. A client resuming from before them is told how many it lost.
+static uint64_t maximum_unacknowledged_bytes = 1 << 20;
+
+// How long a session waits for its client to come back. Set with '--session-timeout=<seconds>'.
+static unsigned session_timeout = 120;
+
+// The traffic analytics count per window of this many seconds, and show the current and the previous one.
+// Set with '--analytics-window=<seconds>'.
+static unsigned analytics_window = 60;
+
+// Payloads at least this big are sent with MSG_ZEROCOPY, so the kernel sends straight from the shared buffer
+// instead of copying it once per recipient. Below it, pinning pages and handling the completion costs more
+// than the copy. 0 turns it off. Set with '--zerocopy-threshold=<bytes>'.
+static uint32_t zerocopy_threshold = 16 << 10;
+
+// How much each connection may read per loop iteration, so a client that always has data ready can't
+// starve the others (deficit round robin). Every iteration a connection is given 'read_quantum' bytes
+// times its weight, and takes in frames until that's used up. A frame that takes it below zero is still
+// handled, and the debt is paid off in the following iterations. Frames that were received but are over
+// the share wait for the next iteration, and the rest stays in the socket. 0 reads everything there is.
+// Set with '--read-quantum=<bytes>' and '--weight=<user id>:<weight>' (1 for everyone else).
+static uint32_t                               read_quantum = 16 << 10;
+static std::unordered_map<uint32_t, uint32_t> client_weights;
+
+// New clients are let in at up to this many per second (0 is no limit), in bursts of up to a tenth of that.
+// The others wait in the listen backlog (the kernel completes their handshakes meanwhile), so when
+// everyone reconnects at once after an outage the loop still gets to serve the clients it has, and logins
+// are spread out instead of all arriving in the same iteration. Set with '--accept-rate=<per second>'.
+static uint32_t accept_rate = 10000;
+
+// Set with '--coalesce=<microseconds>', the longest a broadcast waits to go out together with the ones after
+// it (0 sends each one right away), and '--coalesce-bytes=<bytes>', how much may wait (see 'HoldBroadcast').
+static uint32_t coalesce_window = 0;
+static uint32_t coalesce_bytes  = 64 << 10;
+
+// Private messages for users that aren't connected, delivered when they log in.
+static MailboxStore offline_mailboxes;
+
+// All broadcast messages, and the full-text index over them. The file is set with '--history=<file>'.
+static HistoryStore  history;
+static SearchService search(history);
+
+// Hop timestamps of sampled messages. Enabled with '--trace=<file>'.
+static Tracer tracer;
+
+// Every frame received, for replaying later. Enabled with '--capture=<file>'.
+static CaptureWriter capture;
+
+// Banned words and links. Enabled with '--filter=<file>', and read again on SIGHUP.
+static ContentFilter content_filter;
+
+// The CPU the loop is pinned to with '--cpus=<list>' (-1 if it isn't), and the NUMA node it runs on. The
+// loop allocates (and first touches) all connection state and message buffers, so that's where they live.
+static Topology topology;
+static int      loop_cpu  = -1;
+static int      loop_node = 0;
+
+
+// ---- OUTBOUND QUEUES ----
+
+// An immutable message shared by the outbound queues of all its recipients. Only the loop thread touches
+// it, so the count doesn't need to be atomic.
+struct SharedBuffer
+{
+    uint32_t references;
+    uint32_t size;
+
+    char* Data() { return (char*) (this + 1); }
+};
+
+inline SharedBuffer* NewSharedBuffer(const char* data, size_t size)
+{
+    SharedBuffer* buffer = (SharedBuffer*) malloc(sizeof(SharedBuffer) + size);
+    buffer->references = 1;
+    buffer->size       = (uint32_t) size;
+    memcpy(buffer->Data(), data, size);
+    return buffer;
+}
+
+// Encodes the event straight into a new buffer. Returns nullptr if it wouldn't fit in a frame.
+template<typename Event>
+inline SharedBuffer* NewEventBuffer(const Event& event)
+{
+    size_t size = Codec<Event>::Size(event);
+    if (size > MAXIMUM_SERVER_PAYLOAD_SIZE)
+        return nullptr;
+    SharedBuffer* buffer = (SharedBuffer*) malloc(sizeof(SharedBuffer) + size);
+    buffer->references = 1;
+    buffer->size       = (uint32_t) size;
+    Codec<Event>::Encode(event, buffer->Data());
+    return buffer;
+}
+
+inline void ReleaseSharedBuffer(SharedBuffer* buffer)
+{
+    if (--buffer->references == 0)
+        free(buffer);
+}
+
+// Control frames (the welcome, presence, replies from the server) jump ahead of the chat messages queued
+// for a connection, so a client with a big backlog still learns right away who's there and what its
+// commands did. They aren't numbered (numbers have to arrive in order), so they're not replayed on resume.
+// Held frames are bulk frames that wait for the next tick to be written (see 'HoldBroadcast').
+enum Lane : uint8_t
+{
+    LANE_BULK,
+    LANE_CONTROL,
+    LANE_HELD,
+};
+
+// A frame on its way out. The header (and sequence number) is kept inline, since the buffer is shared by
+// recipients that number it differently.
+struct OutboundItem
+{
+    SharedBuffer* buffer;
+    uint32_t      offset;       // Bytes of the frame (header and buffer) already written.
+    uint8_t       header_size;
+    char          header[sizeof(FrameHeader) + SEQUENCE_SIZE];
+    uint64_t      trace_id;
+    uint64_t      routed;       // When it was queued, for the trace.
+    uint64_t      write_start;  // When writing it started, for the trace.
+
+    uint32_t Size() const { return header_size + buffer->size; }
+};
+
+// A buffer the kernel may still be reading from, after a MSG_ZEROCOPY send that returned. 'id' is the
+// number of the send on its socket; the kernel reports finished sends by these numbers on the error queue.
+struct ZerocopySend
+{
+    uint32_t      id;
+    SharedBuffer* buffer;
+};
+
+struct Connection;
+struct Gateway;
+
+// How a connection's bytes get in and out. Sockets are registered with epoll, which says when to read and
+// write. Transports that aren't ('polled' is false) move the bytes themselves, and tell the loop instead
+// with 'MarkReadable' and 'MarkWritable' (see loopback.h). Both calls follow the socket calls: they return
+// -1 and set errno (EAGAIN when there's nothing to read or no room to write), and 'receive' returns 0 at
+// the end.
+struct Transport
+{
+    const char* name;
+    bool        polled;
+    ssize_t     (*receive)(Connection* connection, char* data, size_t size);
+    ssize_t     (*send)(Connection* connection, iovec* chunks, size_t count, int flags);  // MSG_ZEROCOPY or 0.
+    void        (*close)(Connection* connection);
+};
+
+// What the server sent to a user that the user hasn't acknowledged yet, numbered from 1. The messages are
+// kept in a ring, oldest first, so message 'first_sequence + i' is at position i.
+struct Session
+{
+    uint32_t    user_id       = 0;
+    uint64_t    token         = 0;        // Proves a resuming client is who it says it is.
+    Connection* connection    = nullptr;  // nullptr while detached.
+    uint64_t    detached      = 0;        // When the connection went away.
+    uint32_t    detached_slot = 0;        // Position in 'detached_sessions' while detached.
+
+    SharedBuffer** unacknowledged = nullptr;
+    uint32_t       head           = 0;
+    uint32_t       count          = 0;
+    uint32_t       capacity       = 0;
+    uint64_t       bytes          = 0;  // Size of the buffers kept alive.
+    uint64_t       first_sequence = 1;  // Of the oldest message kept.
+
+    uint64_t       NextSequence() const  { return first_sequence + count; }
+    SharedBuffer*& At(uint32_t i)        { return unacknowledged[(head + i) & (capacity - 1)]; }
+    uint64_t       Memory() const        { return sizeof(Session) + (uint64_t) capacity * sizeof(SharedBuffer*) + bytes; }
+};
+
+struct Connection
+{
+    int         socket      = -1;     // Identifies it, even if the transport isn't a socket.
+    uint32_t    id          = 0;      // Never reused, unlike the socket.
+    uint32_t    user_id     = 0;      // 0 until the client has logged in.
+    uint32_t    active_slot = 0;      // Position in 'active_connections' once logged in.
+    bool        closing     = false;  // Waiting in 'closed_connections' to be torn down.
+    bool        dirty       = false;  // Waiting in 'dirty_connections' to be flushed.
+    bool        want_write  = false;  // Registered for EPOLLOUT, because the socket was full.
+    bool        keep_session = true;   // Left detached on close, for the client to resume.
+    bool        zerocopy    = false;  // SO_ZEROCOPY is on, and the kernel didn't say it copies anyway.
+    bool        backlogged  = false;  // Waiting in 'backlogged_connections' with frames left to handle.
+    bool        held        = false;  // Waiting in 'held_connections' for the next tick.
+    bool        readable    = false;  // Waiting in 'readable_connections' (transports that aren't polled).
+    uint32_t    weight      = 1;      // Its share of the reads (see 'read_quantum').
+    int64_t     deficit     = 0;      // Bytes it may still read this iteration, or its debt if negative.
+    int16_t     node        = -1;     // Where the kernel handles its packets (see 'AddConnection'), -1 if unknown.
+    const char* close_reason = nullptr;
+    Session*    session     = nullptr;  // Once logged in.
+    const Transport* transport = nullptr;
+    void*       endpoint    = nullptr;  // The transport's own state, if it has any.
+    Gateway*    gateway     = nullptr;  // Set if it's a gateway's link (see 'StartGateway').
+    FrameReader reader;
+
+    // A ring of outbound items, allocated on the first message.
+    OutboundItem* queue          = nullptr;
+    uint32_t      queue_head     = 0;
+    uint32_t      queue_count    = 0;
+    uint32_t      queue_capacity = 0;
+    uint32_t      queue_front    = 0;  // Items at the front that control frames go behind (see 'Enqueue').
+    uint64_t      queued_bytes   = 0;  // Not written yet.
+    uint64_t      shared_bytes   = 0;  // Size of the shared buffers the queue (and the kernel) keeps alive.
+
+    // Zero-copy sends the kernel hasn't reported finished, oldest first.
+    std::vector<ZerocopySend> zerocopy_sends;
+    uint32_t                  zerocopy_next = 0;  // Id of the next zero-copy send.
+
+    OutboundItem& QueueAt(uint32_t i) { return queue[(queue_head + i) & (queue_capacity - 1)]; }
+
+    // Everything this connection holds on to. A shared buffer is counted in full by every connection that
+    // has it queued, since any one of them that doesn't read keeps all of it alive. The session is counted
+    // separately from the rest, since it outlives the connection.
+    uint64_t ReceiveMemory() const { return reader.partial_size; }
+    uint64_t QueueMemory()   const { return (uint64_t) queue_capacity * sizeof(OutboundItem); }
+    uint64_t SharedMemory()  const { return shared_bytes; }
+    uint64_t SessionMemory() const { return session ? session->Memory() : 0; }
+    uint64_t OwnMemory()     const { return sizeof(Connection) + ReceiveMemory() + QueueMemory() + SharedMemory(); }
+    uint64_t Memory()        const { return OwnMemory() + SessionMemory(); }
+};
+
+
+inline ssize_t ReceiveFromSocket(Connection* connection, char* data, size_t size)
+{
+    return recv(connection->socket, data, size, 0);
+}
+
+// 'sendmsg' rather than 'writev' for MSG_NOSIGNAL: a client that went away shouldn't kill us.
+inline ssize_t SendOnSocket(Connection* connection, iovec* chunks, size_t count, int flags)
+{
+    msghdr header{};
+    header.msg_iov    = chunks;
+    header.msg_iovlen = count;
+    return sendmsg(connection->socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT | flags);
+}
+
+inline void CloseSocket(Connection* connection)
+{
+    close(connection->socket);
+}
+
+static const Transport socket_transport = { "socket", true, ReceiveFromSocket, SendOnSocket, CloseSocket };
+
+
+// ---- EVENT LOOP STATE ----
+
+static int epoll_fd        = -1;
+static int listen_socket   = -1;  // Optional. Set by 'ListenOn'.
+static int wakeup_fd       = -1;  // An eventfd other threads use to wake the loop up.
+static int tick_fd         = -1;  // A timerfd that goes off when the held broadcasts are due.
+static int accept_fd       = -1;  // A timerfd that goes off when accepting may resume (see 'PauseAccepting').
+static int drain_fd        = -1;  // A timerfd that goes off every second while sockets drain (see 'DrainSockets').
+static int reserve_fd      = -1;  // Kept open to be given up when out of descriptors (see 'ShedClients').
+
+static uint32_t next_connection_id = 1;
+
+static std::vector<Connection*> connections;         // Indexed by socket.
+static std::vector<Connection*> virtual_connections; // Connections without a descriptor, see 'AddVirtualConnection'.
+static std::vector<int>         free_virtual_numbers;
+static std::vector<Connection*> active_connections;  // Logged in, in no particular order.
+static std::vector<Connection*> dirty_connections;   // Have something queued since the last flush.
+static std::vector<Connection*> closed_connections;  // To be torn down at the end of the iteration.
+
+// A socket that was closed while the kernel still had zero-copy sends from our buffers. It's reset but kept
+// open until the kernel says it's done with them (see 'DrainSocket').
+struct DrainingSocket
+{
+    int                       fd;
+    uint64_t                  since;
+    std::vector<ZerocopySend> sends;
+};
+static std::vector<DrainingSocket> draining_sockets;
+static std::vector<Connection*> backlogged_connections;  // Received more than their share, to continue next iteration.
+static std::vector<Connection*> held_connections;    // Have broadcasts queued that wait for the next tick.
+static std::vector<Connection*> readable_connections;  // Their transport says there's something to read.
+
+static std::unordered_map<uint32_t, Session*> sessions;           // By user id, attached or not.
+static std::vector<Session*>                  detached_sessions;  // Waiting for their client, roughly oldest first.
+
+// Replies from other threads (the search worker), delivered by the loop when it wakes up. Either text, sent
+// as a notice, or encoded events, sent as they are.
+struct PostedMessage
+{
+    uint32_t                 user_id;
+    std::string              text;
+    std::vector<std::string> events;
+};
+static std::mutex                 posted_lock;
+static std::vector<PostedMessage> posted_messages;
+
+// Counters for the stats. Only written by the loop thread.
+struct LoopCounters
+{
+    std::atomic<uint64_t> accepted{ 0 };
+    std::atomic<uint64_t> shed{ 0 };               // Accepted and closed right away: out of descriptors, full, or over budget.
+    std::atomic<uint64_t> accept_pauses{ 0 };      // Times the admission rate (or an error) stopped accepting for a while.
+    std::atomic<uint64_t> closed{ 0 };
+    std::atomic<uint64_t> broadcasts{ 0 };
+    std::atomic<uint64_t> deliveries{ 0 };         // Queue entries made by broadcasts.
+    std::atomic<uint64_t> fanout_nanoseconds{ 0 }; // Time spent queueing broadcasts.
+    std::atomic<uint64_t> flushes{ 0 };
+    std::atomic<uint64_t> flush_nanoseconds{ 0 };
+    std::atomic<uint64_t> bytes_sent{ 0 };
+    std::atomic<uint64_t> queued_bytes{ 0 };       // In all outbound queues right now.
+    std::atomic<uint64_t> slow_disconnects{ 0 };
+    std::atomic<uint64_t> memory{ 0 };             // Sum of 'Connection::Memory' over all connections and sessions.
+    std::atomic<uint64_t> evictions{ 0 };          // Disconnected to stay within 'memory_budget'.
+    std::atomic<uint64_t> resumes{ 0 };
+    std::atomic<uint64_t> replayed{ 0 };           // Messages sent again to resumed sessions.
+    std::atomic<uint64_t> lost{ 0 };               // Messages forgotten before a resumed session got them.
+    std::atomic<uint64_t> expired{ 0 };            // Sessions whose client never came back.
+    std::atomic<uint64_t> zerocopy_sends{ 0 };
+    std::atomic<uint64_t> zerocopy_bytes{ 0 };
+    std::atomic<uint64_t> zerocopy_completions{ 0 };
+    std::atomic<uint64_t> zerocopy_copied{ 0 };    // Connections where the kernel copied anyway (e.g. loopback).
+    std::atomic<uint64_t> zerocopy_fallbacks{ 0 }; // Sends copied after all, because pinning was refused.
+    std::atomic<uint64_t> control_frames{ 0 };     // Queued on the control lane.
+    std::atomic<uint64_t> overtaken{ 0 };          // Chat messages a control frame was queued in front of.
+    std::atomic<uint64_t> reads_deferred{ 0 };     // Iterations a connection was cut off with frames left.
+    std::atomic<uint64_t> ticks{ 0 };              // Batches of held broadcasts sent.
+    std::atomic<uint64_t> held{ 0 };               // Broadcasts that waited for a tick.
+    std::atomic<uint64_t> immediate{ 0 };          // Broadcasts sent right away while coalescing.
+    std::atomic<uint64_t> capped{ 0 };             // Ticks brought forward by 'coalesce_bytes'.
+    std::atomic<uint64_t> gateways{ 0 };           // Links open right now.
+    std::atomic<uint64_t> channels{ 0 };           // Channels open on them right now.
+    std::atomic<uint64_t> channels_opened{ 0 };
+    std::atomic<uint64_t> channel_bytes{ 0 };      // Sent to clients behind gateways.
+    std::atomic<uint64_t> credits{ 0 };            // FRAME_CREDITs sent to gateways.
+    std::atomic<uint64_t> link_waits{ 0 };         // Channels that had to wait for room on their link.
+};
+static LoopCounters loop_counters;
+
+// Traffic by the NUMA node the kernel handled the connection's packets on. Bytes on another node than the
+// loop's crossed the interconnect at least once: the kernel's socket buffers are on the node that handled
+// the packet, our buffers are on the loop's. Only touched by the loop thread.
+struct NodeCounters
+{
+    uint64_t connections = 0;  // Open right now.
+    uint64_t received    = 0;
+    uint64_t sent        = 0;
+    uint64_t remote      = 0;  // Of 'received + sent', while the loop was on another node.
+};
+static NodeCounters node_counters[Topology::MAXIMUM_NODES + 1];  // The last one is for unknown nodes.
+
+inline NodeCounters& CountersOfNode(int node)
+{
+    return node_counters[node >= 0 && node < Topology::MAXIMUM_NODES ? node : Topology::MAXIMUM_NODES];
+}
+
+inline void CountTraffic(const Connection* connection, uint64_t received, uint64_t sent)
+{
+    NodeCounters& counters = CountersOfNode(connection->node);
+    counters.received += received;
+    counters.sent     += sent;
+    if (connection->node >= 0 && connection->node != loop_node)
+        counters.remote += received + sent;
+}
+
+// Set by other threads to have the loop print the stats, since only the loop can look at the connections.
+static std::atomic<bool> stats_requested{ false };
+
+inline void AccountMemory(int64_t delta)
+{
+    loop_counters.memory.fetch_add((uint64_t) delta, std::memory_order_relaxed);
+}
+
+
+// Marks the connection for teardown. It stays valid until the end of the loop iteration, so it's safe to
+// call from anywhere (even in the middle of a broadcast).
+inline void CloseConnection(Connection* connection, const char* reason)
+{
+    if (connection->closing)
+        return;
+    connection->closing      = true;
+    connection->close_reason = reason;
+    closed_connections.push_back(connection);
+}
+
+// For transports that aren't polled: the connection has something to read, or the other end closed. The
+// loop reads it in its next iteration.
+inline void MarkReadable(Connection* connection)
+{
+    if (connection->readable || connection->closing)
+        return;
+    connection->readable = true;
+    readable_connections.push_back(connection);
+}
+
+// For transports that aren't polled: there's room to write again, after a write that didn't fit.
+inline void MarkWritable(Connection* connection)
+{
+    if (!connection->want_write || connection->dirty || connection->closing)
+        return;
+    connection->dirty = true;
+    dirty_connections.push_back(connection);
+}
+
+
+// ---- SESSIONS ----
+
+inline void ForgetOldest(Session* session)
+{
+    SharedBuffer* buffer = session->At(0);
+    session->bytes -= sizeof(SharedBuffer) + buffer->size;
+    AccountMemory(-(int64_t) (sizeof(SharedBuffer) + buffer->size));
+    ReleaseSharedBuffer(buffer);
+    session->head = (session->head + 1) & (session->capacity - 1);
+    --session->count;
+    ++session->first_sequence;
+}
+
+// Keeps the message until it's acknowledged. Returns its sequence number.
+inline uint64_t Retain(Session* session, SharedBuffer* buffer)
+{
+    if (session->count == session->capacity)
+    {
+        uint32_t       capacity = session->capacity ? session->capacity * 2 : 8;
+        SharedBuffer** ring     = (SharedBuffer**) malloc(capacity * sizeof(SharedBuffer*));
+        for (uint32_t i = 0; i < session->count; ++i)
+            ring[i] = session->At(i);
+        free(session->unacknowledged);
+        AccountMemory((int64_t) (capacity - session->capacity) * sizeof(SharedBuffer*));
+        session->unacknowledged = ring;
+        session->head           = 0;
+        session->capacity       = capacity;
+    }
+
+    uint64_t sequence = session->NextSequence();
+    session->At(session->count++) = buffer;
+    ++buffer->references;
+    session->bytes += sizeof(SharedBuffer) + buffer->size;
+    AccountMemory(sizeof(SharedBuffer) + buffer->size);
+
+    while (session->bytes > maximum_unacknowledged_bytes && session->count > 1)
+        ForgetOldest(session);
+    return sequence;
+}
+
+// Forgets everything up to and including 'sequence'.
+inline void Acknowledge(Session* session, uint64_t sequence)
+{
+    while (session->count > 0 && session->first_sequence <= sequence)
+        ForgetOldest(session);
+}
+
+inline uint64_t NewToken()
+{
+    static std::mt19937_64 generator(std::random_device{}());
+    uint64_t token;
+    while ((token = generator()) == 0)
+        ;
+    return token;
+}
+
+inline Session* NewSession(uint32_t user_id)
+{
+    Session* session = new Session;
+    session->user_id = user_id;
+    session->token   = NewToken();
+    sessions[user_id] = session;
+    AccountMemory(sizeof(Session));
+    return session;
+}
+
+inline void RemoveDetached(Session* session)
+{
+    Session* last = detached_sessions.back();
+    detached_sessions[session->detached_slot] = last;
+    last->detached_slot = session->detached_slot;
+    detached_sessions.pop_back();
+}
+
+// Only for sessions without a connection.
+inline void DestroySession(Session* session)
+{
+    if (session->detached_slot < detached_sessions.size() && detached_sessions[session->detached_slot] == session)
+        RemoveDetached(session);
+    AccountMemory(-(int64_t) session->Memory());
+    for (uint32_t i = 0; i < session->count; ++i)
+        ReleaseSharedBuffer(session->At(i));
+    free(session->unacknowledged);
+
+    // Only a client that resumes the session gets the user's mailbox (see 'Welcome'), so once the session is
+    // gone nobody ever will, and the mailbox goes with it.
+    offline_mailboxes.Discard(session->user_id);
+    sessions.erase(session->user_id);
+    delete session;
+}
+
+// Drops the sessions whose client didn't come back within 'session_timeout'. Checked about once a second.
+void ExpireSessions(uint64_t now)
+{
+    static uint64_t last_check = 0;
+    if (now - last_check < 1000000000ull)
+        return;
+    last_check = now;
+
+    uint64_t timeout = (uint64_t) session_timeout * 1000000000ull;
+    for (size_t i = 0; i < detached_sessions.size();)
+    {
+        Session* session = detached_sessions[i];
+        if (now - session->detached < timeout)
+        {
+            ++i;
+            continue;
+        }
+        loop_counters.expired.fetch_add(1, std::memory_order_relaxed);
+        DestroySession(session);  // Swaps the last one into slot i.
+    }
+}
+
+
+// ---- OUTBOUND ----
+
+// Queues a frame of the given type with the buffer as payload. A 'sequence' of 0 means it isn't numbered.
+//
+// A bulk frame goes at the back. A control frame goes in front of all bulk frames, but behind the control
+// frames already queued and behind a frame that's partly written (the client would get half a frame
+// otherwise). Those are the 'queue_front' items, so only they move to make room, and there are never many.
+inline void Enqueue(Connection* connection, SharedBuffer* buffer, FrameType type, uint64_t sequence, Lane lane,
+                    uint64_t trace_id = 0, uint64_t routed = 0)
+{
+    if (connection->closing)
+        return;
+    if (buffer->size > MAXIMUM_SERVER_PAYLOAD_SIZE)
+    {
+        // The size in the header would wrap, and the client would lose track of where frames start.
+        Log(LOG_ERROR, "Dropped a frame of %u bytes for client %u, that's more than a frame can hold.",
+            buffer->size, connection->user_id);
+        return;
+    }
+    if (connection->queued_bytes + buffer->size > maximum_queued_bytes)
+    {
+        loop_counters.slow_disconnects.fetch_add(1, std::memory_order_relaxed);
+        CloseConnection(connection, "Client is too slow to keep up.");
+        return;
+    }
+
+    if (connection->queue_count == connection->queue_capacity)
+    {
+        uint32_t      capacity = connection->queue_capacity ? connection->queue_capacity * 2 : 4;
+        OutboundItem* queue    = (OutboundItem*) malloc(capacity * sizeof(OutboundItem));
+        for (uint32_t i = 0; i < connection->queue_count; ++i)
+            queue[i] = connection->QueueAt(i);
+        free(connection->queue);
+        AccountMemory((int64_t) (capacity - connection->queue_capacity) * sizeof(OutboundItem));
+        connection->queue          = queue;
+        connection->queue_head     = 0;
+        connection->queue_capacity = capacity;
+    }
+
+    uint32_t position = connection->queue_count;
+    if (lane == LANE_CONTROL)
+    {
+        position = connection->queue_front;
+        if (position == 0 && connection->queue_count > 0 && connection->QueueAt(0).offset > 0)
+            position = 1;
+        connection->queue_head = (connection->queue_head - 1) & (connection->queue_capacity - 1);
+        for (uint32_t i = 0; i < position; ++i)
+            connection->QueueAt(i) = connection->QueueAt(i + 1);
+        connection->queue_front = position + 1;
+        loop_counters.control_frames.fetch_add(1, std::memory_order_relaxed);
+        loop_counters.overtaken.fetch_add(connection->queue_count - position, std::memory_order_relaxed);
+    }
+    ++connection->queue_count;
+
+    OutboundItem& item = connection->QueueAt(position);
+    item.buffer      = buffer;
+    item.offset      = 0;
+    item.trace_id    = trace_id;
+    item.routed      = routed;
+    item.write_start = 0;
+    ++buffer->references;
+
+    FrameHeader header;
+    header.type        = type;
+    header.flags       = sequence != 0 ? FRAME_SEQUENCED : 0;
+    item.header_size   = (uint8_t) (sizeof(FrameHeader) + (sequence != 0 ? SEQUENCE_SIZE : 0));
+    header.size        = htons((uint16_t) (item.header_size - sizeof(FrameHeader) + buffer->size));
+    memcpy(item.header, &header, sizeof(header));
+    if (sequence != 0)
+        WriteSequence(&item.header[sizeof(FrameHeader)], sequence);
+
+    connection->queued_bytes += item.Size();
+    connection->shared_bytes += sizeof(SharedBuffer) + buffer->size;
+    loop_counters.queued_bytes.fetch_add(item.Size(), std::memory_order_relaxed);
+    AccountMemory(sizeof(SharedBuffer) + buffer->size);
+    if (lane == LANE_HELD)
+    {
+        // Unless it's flushed anyway, then the held frames go along.
+        if (!connection->held && !connection->dirty)
+        {
+            connection->held = true;
+            held_connections.push_back(connection);
+        }
+    }
+    else if (!connection->dirty)
+    {
+        connection->dirty = true;
+        dirty_connections.push_back(connection);
+    }
+}
+
+inline Connection* FindConnection(int socket_fd)
+{
+    if (socket_fd >= 0)
+        return (size_t) socket_fd < connections.size() ? connections[socket_fd] : nullptr;
+    size_t index = (size_t) (-2 - (int64_t) socket_fd);  // -1 wraps around, and isn't found.
+    return index < virtual_connections.size() ? virtual_connections[index] : nullptr;
+}
+
+// Queues an (encoded) event for the connection, numbered in its session (if it's logged in). The session
+// keeps it even if the connection is cut off for being slow, so the client still gets it when it resumes.
+inline void Deliver(Connection* connection, SharedBuffer* buffer, uint64_t trace_id = 0, uint64_t routed = 0,
+                    Lane lane = LANE_BULK)
+{
+    if (connection->closing)
+        return;
+    uint64_t sequence = connection->session ? Retain(connection->session, buffer) : 0;
+    Enqueue(connection, buffer, FRAME_EVENT, sequence, lane, trace_id, routed);
+}
+
+// Queues an encoded event for the connection on the socket, if there is one.
+inline void SendToSocket(int socket_fd, const char* message, size_t size, uint64_t trace_id = 0, uint64_t routed = 0)
+{
+    Connection* connection = FindConnection(socket_fd);
+    if (connection == nullptr)
+        return;
+    SharedBuffer* buffer = NewSharedBuffer(message, size);
+    Deliver(connection, buffer, trace_id, routed);
+    ReleaseSharedBuffer(buffer);
+}
+
+// Queues an event for the connection on the socket on the control lane, unnumbered.
+template<typename Event>
+inline void SendEvent(int socket_fd, const Event& event)
+{
+    Connection* connection = FindConnection(socket_fd);
+    if (connection == nullptr || connection->closing)
+        return;
+    SharedBuffer* buffer = NewEventBuffer(event);
+    if (buffer == nullptr)
+    {
+        Log(LOG_ERROR, "Dropped an event for client %u, it's more than a frame can hold.", connection->user_id);
+        return;
+    }
+    Enqueue(connection, buffer, FRAME_EVENT, 0, LANE_CONTROL);
+    ReleaseSharedBuffer(buffer);
+}
+
+// Text from the server itself, like the usage of a command or search results.
+inline void SendNotice(int socket_fd, const char* text, size_t size)
+{
+    NoticeEvent notice;
+    notice.text = Bytes{ text, (uint32_t) size };
+    SendEvent(socket_fd, notice);
+}
+
+
+// When the held broadcasts go out. There's one room, so there's one tick.
+struct Tick
+{
+    static constexpr uint64_t BATCH = 16;  // Broadcasts per tick the window aims for.
+
+    uint64_t deadline = 0;  // When the held broadcasts are due, 0 if none are held.
+    uint64_t armed    = 0;  // What the timer is set to.
+    uint64_t last     = 0;  // When the last broadcasts went out, held or not.
+    uint64_t previous = 0;  // When the last broadcast came in.
+    uint64_t interval = 0;  // Average time between broadcasts.
+    uint64_t window   = 0;  // How long broadcasts are held at the moment.
+    uint64_t bytes    = 0;  // Held since the last tick (counted once, not per recipient).
+};
+static Tick tick;
+
+inline void ArmTick(uint64_t deadline)
+{
+    // http://man7.org/linux/man-pages/man2/timerfd_create.2.html
+    //     timerfd_settime(fd, TFD_TIMER_ABSTIME, value, old) makes the timer expire at 'value' on its clock
+    //     (CLOCK_MONOTONIC, the one 'MonotonicNanoseconds' reads). A zero 'value' disarms it.
+    itimerspec value{};
+    value.it_value.tv_sec  = (time_t) (deadline / 1000000000);
+    value.it_value.tv_nsec = (long) (deadline % 1000000000);
+    timerfd_settime(tick_fd, TFD_TIMER_ABSTIME, &value, nullptr);
+}
+
+// Whether a broadcast coming in at 'now' should wait for the tick, instead of every client getting a
+// write of its own for every message. Like Nagle's algorithm: a broadcast after a quiet spell (nothing sent
+// for a window) goes out right away, and the ones after it wait until the window is over and go out
+// together, one write per client for all of them. So a quiet room doesn't wait at all.
+//
+// The window follows the load: it's what 'BATCH' broadcasts take at the average rate, up to
+// 'coalesce_window'. The busier the room, the shorter the wait for a full batch. And held broadcasts go out
+// early once there are 'coalesce_bytes' of them, which bounds what every queue takes on per tick.
+inline bool HoldBroadcast(uint64_t now, uint32_t size)
+{
+    uint64_t maximum = (uint64_t) coalesce_window * 1000;
+    uint64_t gap     = tick.previous != 0 && now - tick.previous < maximum ? now - tick.previous : maximum;
+    tick.interval = (tick.interval * 7 + gap) / 8;
+    tick.previous = now;
+    tick.window   = tick.interval * Tick::BATCH < maximum ? tick.interval * Tick::BATCH : maximum;
+
+    if (tick.deadline == 0)
+    {
+        if (now - tick.last >= tick.window)
+        {
+            tick.last = now;
+            loop_counters.immediate.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        tick.deadline = tick.last + tick.window;
+        tick.armed    = tick.deadline;
+        ArmTick(tick.armed);
+    }
+    tick.bytes += size;
+    if (tick.bytes >= coalesce_bytes && tick.deadline > now)
+    {
+        tick.deadline = now;  // Goes out at the end of this iteration.
+        loop_counters.capped.fetch_add(1, std::memory_order_relaxed);
+    }
+    loop_counters.held.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Has the connections with held broadcasts flushed with the others.
+inline void ReleaseHeldBroadcasts(uint64_t now)
+{
+    for (Connection* connection : held_connections)
+    {
+        connection->held = false;
+        if (!connection->closing && !connection->dirty)
+        {
+            connection->dirty = true;
+            dirty_connections.push_back(connection);
+        }
+    }
+    held_connections.clear();
+    if (tick.armed > now)
+        ArmTick(0);  // Brought forward, the timer would go off for nothing.
+    tick.armed    = 0;
+    tick.last     = now;
+    tick.deadline = 0;
+    tick.bytes    = 0;
+    loop_counters.ticks.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Whether broadcasts are waiting for a tick.
+inline bool HoldingBroadcasts()
+{
+    return tick.deadline != 0;
+}
+
+
+// Sends the (encoded) event in the buffer to every logged in client except the one on 'socket_fd', and
+// keeps it for the clients that are away but may come back.
+void Broadcast(int socket_fd, SharedBuffer* buffer, uint64_t trace_id = 0, uint64_t routed = 0)
+{
+    uint64_t start = MonotonicNanoseconds();
+    Lane     lane  = coalesce_window != 0 && HoldBroadcast(start, buffer->size) ? LANE_HELD : LANE_BULK;
+
+    uint64_t deliveries = 0;
+    // Indexed, since a connection that's too slow is closed (but not removed) while we go.
+    for (size_t i = 0; i < active_connections.size(); ++i)
+    {
+        Connection* connection = active_connections[i];
+        if (connection->socket == socket_fd)
+            continue;
+        Deliver(connection, buffer, trace_id, routed, lane);
+        ++deliveries;
+    }
+    for (Session* session : detached_sessions)
+        Retain(session, buffer);
+
+    loop_counters.broadcasts.fetch_add(1, std::memory_order_relaxed);
+    loop_counters.deliveries.fetch_add(deliveries, std::memory_order_relaxed);
+    loop_counters.fanout_nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+}
+
+void DispatchMessage(int socket_fd, const char* message, int size, uint64_t trace_id = 0, uint64_t routed = 0)
+{
+    SharedBuffer* buffer = NewSharedBuffer(message, size);
+    Broadcast(socket_fd, buffer, trace_id, routed);
+    ReleaseSharedBuffer(buffer);
+}
+
+// Sends an event to every logged in client except the one on 'socket_fd', on the control lane. Clients
+// that are away don't get it: it's about what's happening now (like who's here).
+template<typename Event>
+void DispatchEvent(int socket_fd, const Event& event)
+{
+    uint64_t      start      = MonotonicNanoseconds();
+    SharedBuffer* buffer     = NewEventBuffer(event);
+    uint64_t      deliveries = 0;
+    if (buffer == nullptr)
+    {
+        Log(LOG_ERROR, "Dropped an event for everyone, it's more than a frame can hold.");
+        return;
+    }
+    for (size_t i = 0; i < active_connections.size(); ++i)
+    {
+        Connection* connection = active_connections[i];
+        if (connection->socket == socket_fd || connection->closing)
+            continue;
+        Enqueue(connection, buffer, FRAME_EVENT, 0, LANE_CONTROL);
+        ++deliveries;
+    }
+    ReleaseSharedBuffer(buffer);
+
+    loop_counters.broadcasts.fetch_add(1, std::memory_order_relaxed);
+    loop_counters.deliveries.fetch_add(deliveries, std::memory_order_relaxed);
+    loop_counters.fanout_nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+}
+
+
+// Sends an encoded event to a single user. Costs one lookup in the index, no matter how many users are
+// connected. Returns false if the user isn't connected.
+bool SendDirectMessage(uint32_t user_id, const char* message, int size, uint64_t trace_id = 0, uint64_t routed = 0)
+{
+    Connection* connection = FindConnection(user_index.Find(user_id));
+    if (connection == nullptr || connection->closing)
+        return false;
+
+    SendToSocket(connection->socket, message, size, trace_id, routed);
+    return true;
+}
+
+
+inline void WakeLoop()
+{
+    uint64_t one = 1;
+    ssize_t  bytes_written = write(wakeup_fd, &one, sizeof(one));
+    (void) bytes_written;
+}
+
+// Can be called from any thread. The message is delivered by the loop the next time it wakes up.
+inline void PostDirectMessage(uint32_t user_id, const char* message, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        posted_messages.push_back(PostedMessage{ user_id, std::string(message, size), {} });
+    }
+    WakeLoop();
+}
+
+// Can be called from any thread. The events go out in order, unnumbered, like the replies to commands
+// (they aren't replayed on resume), but behind the chat messages already queued.
+inline void PostEvents(uint32_t user_id, std::vector<std::string>& events)
+{
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        posted_messages.push_back(PostedMessage{ user_id, std::string(), {} });
+        posted_messages.back().events.swap(events);
+    }
+    WakeLoop();
+}
+
+// Can be called from any thread (or a signal handler). The loop prints the stats when it wakes up.
+inline void RequestStats()
+{
+    stats_requested.store(true, std::memory_order_relaxed);
+    WakeLoop();
+}
+
+
+// ---- MESSAGE PIPELINE ----
+// Everything that happens to a message between 'recv' and 'DispatchMessage'. The stages run in the order
+// they're listed in 'MessagePipeline' and any of them can drop the message by returning false.
+
+// Makes sure the text is something the clients can print as it is: drops messages that aren't UTF-8 and
+// removes control characters and escape sequences (see utf8.h). It runs first, so every other stage (and
+// the content filter) sees the text the way the other users will.
+struct SanitizeStage
+{
+    static constexpr const char* name = "sanitize";
+
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> stripped{ 0 };
+    std::atomic<uint64_t> invalid{ 0 };
+    std::atomic<uint64_t> nanoseconds{ 0 };
+
+    bool operator()(Message& message)
+    {
+        uint64_t  start = MonotonicNanoseconds();
+        TextCheck check = CheckText(message.data, (size_t) message.size);
+        nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+        bytes.fetch_add((uint64_t) message.size, std::memory_order_relaxed);
+
+        if (check == TEXT_INVALID)
+        {
+            invalid.fetch_add(1, std::memory_order_relaxed);
+            static const char INVALID[] = "Your message wasn't sent, it isn't valid UTF-8.\n";
+            SendNotice(message.socket, INVALID, sizeof(INVALID) - 1);
+            return false;
+        }
+        if (check == TEXT_CONTROLS)
+        {
+            stripped.fetch_add(1, std::memory_order_relaxed);
+            message.size = (int) StripControls(message.data, (size_t) message.size);
+        }
+        return true;
+    }
+
+    void PrintStats(FILE* file) const
+    {
+        uint64_t size = bytes.load(std::memory_order_relaxed);
+        fprintf(file, "    path=%s bytes=%llu stripped=%llu invalid=%llu check=%.3fns/byte\n", TextCheckPath(),
+                (unsigned long long) size, (unsigned long long) stripped.load(std::memory_order_relaxed),
+                (unsigned long long) invalid.load(std::memory_order_relaxed),
+                size ? (double) nanoseconds.load(std::memory_order_relaxed) / size : 0.0);
+    }
+};
+
+struct ValidateStage
+{
+    static constexpr const char* name = "validate";
+
+    bool operator()(Message& message)
+    {
+        // Drop messages that are nothing but whitespace (e.g. the user just pressed enter).
+        for (int i = 0; i < message.size; ++i)
+            if (!isspace((unsigned char) message.data[i]))
+                return true;
+        return false;
+    }
+};
+
+// Handles the commands:
+//     '/msg <user id> <text>' by stripping the command and marking the message as private.
+//     '/search <words>' by handing it to the search worker, which replies when it's done.
+struct CommandStage
+{
+    static constexpr const char* name = "command";
+
+    bool operator()(Message& message)
+    {
+        static const char   SEARCH[]      = "/search ";
+        static const size_t SEARCH_LENGTH = sizeof(SEARCH) - 1;
+        if (message.size >= (int) SEARCH_LENGTH && memcmp(message.data, SEARCH, SEARCH_LENGTH) == 0)
+        {
+            int size = message.size - (int) SEARCH_LENGTH;
+            while (size > 0 && (message.data[SEARCH_LENGTH + size - 1] == '\n' || message.data[SEARCH_LENGTH + size - 1] == '\r'))
+                --size;
+            search.Submit(message.sender, message.data + SEARCH_LENGTH, size);
+            return false;
+        }
+
+        static const char   COMMAND[] = "/msg ";
+        static const size_t LENGTH    = sizeof(COMMAND) - 1;
+
+        if (message.size < (int) LENGTH || memcmp(message.data, COMMAND, LENGTH) != 0)
+            return true;
+
+        // The buffer always has room for a terminator after the message, so strtoul can't run off the end.
+        message.data[message.size] = '\0';
+        char*         end       = NULL;
+        unsigned long recipient = strtoul(message.data + LENGTH, &end, 10);
+        if (recipient == 0 || recipient >= UserIndex::TOMBSTONE || *end != ' ')
+        {
+            static const char USAGE[] = "Usage: /msg <user id> <text>\n";
+            SendNotice(message.socket, USAGE, sizeof(USAGE) - 1);
+            return false;
+        }
+
+        int skipped = (int) (end + 1 - message.data);
+        message.data     += skipped;
+        message.size     -= skipped;
+        message.headroom += skipped;
+        message.capacity -= skipped;
+        message.recipient = (uint32_t) recipient;
+        return true;
+    }
+};
+
+// Saves broadcasts to the history (and through it, the search index). Private messages aren't kept, and
+// nothing is kept if there's no history file (e.g. in the simulator).
+struct PersistStage
+{
+    static constexpr const char* name = "persist";
+
+    bool operator()(Message& message)
+    {
+        if (message.recipient == 0 && history.fd != -1)
+            history.Append(message.sender, message.data, message.size);
+        return true;
+    }
+};
+
+struct LogStage
+{
+    static constexpr const char* name = "log";
+
+    bool operator()(Message& message)
+    {
+        // The message already ends with a newline and the logger adds its own.
+        int size = message.size;
+        if (size > 0 && message.data[size - 1] == '\n')
+            --size;
+        if (message.recipient != 0)
+            LOG_SAMPLED(message_log_sample_rate, LOG_INFO, "Client %u (private): %s", message.sender, LogText(message.data, size));
+        else
+            LOG_SAMPLED(message_log_sample_rate, LOG_INFO, "Client %u: %s", message.sender, LogText(message.data, size));
+        return true;
+    }
+};
+
+// Turns the text into a chat event. The event's header is written into the headroom in front of the text,
+// so the text itself isn't copied.
+struct EncodeStage
+{
+    static constexpr const char* name = "encode";
+
+    bool operator()(Message& message)
+    {
+        ChatEvent chat;
+        chat.sender    = message.sender;
+        chat.recipient = message.recipient;
+        chat.text      = Bytes{ message.data, (uint32_t) message.size };
+        int length = (int) (Codec<ChatEvent>::Size(chat) - message.size);
+        if (length > message.headroom)
+            return false;
+
+        message.data     -= length;
+        message.size     += length;
+        message.headroom -= length;
+        message.capacity += length;
+        Codec<ChatEvent>::Encode(chat, message.data);
+        return true;
+    }
+};
+
+struct RouteStage
+{
+    static constexpr const char* name = "route";
+
+    bool operator()(Message& message)
+    {
+        uint64_t routed = 0;
+        if (message.trace_id)
+        {
+            routed = MonotonicNanoseconds();
+            tracer.Span(message.trace_id, "pipeline", message.received, routed, "user", message.sender);
+        }
+
+        if (message.recipient == 0)
+        {
+            DispatchMessage(message.socket, message.data, message.size, message.trace_id, routed);
+            return true;
+        }
+
+        if (!SendDirectMessage(message.recipient, message.data, message.size, message.trace_id, routed))
+        {
+            // Only users with a session get a mailbox, the ones that may still come back for it. Anyone else
+            // is a user that's gone for good or never was, and every id would otherwise be fair game.
+            char reply[96];
+            int  length;
+            if (sessions.count(message.recipient) == 0)
+            {
+                length = snprintf(reply, sizeof(reply), "There is no user %u.\n", message.recipient);
+                SendNotice(message.socket, reply, length);
+                return true;
+            }
+
+            // Mailboxes hold a stream of bytes, so each event goes in with its size in front (in the headroom).
+            uint8_t size[10];
+            length = (int) PutVarint(size, message.size);
+            bool stored = length <= message.headroom;
+            if (stored)
+            {
+                memcpy(message.data - length, size, length);
+                stored = offline_mailboxes.Store(message.recipient, message.data - length, message.size + length);
+            }
+            const char* format = stored ? "User %u is offline, the message will be delivered when they come back.\n"
+                                        : "User %u is offline and their mailbox is full.\n";
+            length = snprintf(reply, sizeof(reply), format, message.recipient);
+            SendNotice(message.socket, reply, length);
+        }
+        return true;
+    }
+};
+
+// Keeps track of who sends the most and who is sent the most, and of how many users sent anything, per
+// window of 'analytics_window' seconds (see sketch.h). Everything is sized up front, so it's the same
+// ~140KB with ten users or a million, and a message costs a few hashes and a scan of ten entries. There are
+// no rooms, so the recipients are the users private messages go to, and "everyone" (0) for broadcasts.
+struct AnalyticsStage
+{
+    static constexpr const char* name = "analytics";
+    static constexpr uint32_t    TOP  = 10;
+
+    struct Window
+    {
+        uint64_t                number   = 0;  // Since the clock started, in windows.
+        uint64_t                messages = 0;
+        uint64_t                bytes    = 0;
+        CountMinSketch<4, 2048> sender_bytes;
+        CountMinSketch<4, 2048> recipient_bytes;
+        TopK<TOP>               top_senders;
+        TopK<TOP>               top_recipients;
+        HyperLogLog<12>         active_users;
+
+        void Clear(uint64_t window_number)
+        {
+            number   = window_number;
+            messages = 0;
+            bytes    = 0;
+            sender_bytes.Clear();
+            recipient_bytes.Clear();
+            top_senders.Clear();
+            top_recipients.Clear();
+            active_users.Clear();
+        }
+    };
+
+    Window   windows[2];
+    uint32_t current = 0;
+
+    bool operator()(Message& message)
+    {
+        Window& window = Rotate(message.received);
+        uint32_t size  = (uint32_t) message.size;
+        window.messages += 1;
+        window.bytes    += size;
+        window.top_senders.Update(message.sender, window.sender_bytes.Add(message.sender, size));
+        window.top_recipients.Update(message.recipient, window.recipient_bytes.Add(message.recipient, size));
+        window.active_users.Add(message.sender);
+        return true;
+    }
+
+    // Starts a new window when the time has come, and returns the current one. The previous one is only kept
+    // if it was right before it, a quiet hour doesn't leave the last busy minute looking like the previous one.
+    Window& Rotate(uint64_t now)
+    {
+        uint64_t number = now / ((uint64_t) (analytics_window ? analytics_window : 1) * 1000000000ull);
+        if (number != windows[current].number)
+        {
+            bool adjacent = number == windows[current].number + 1;
+            current ^= 1;
+            windows[current].Clear(number);
+            if (!adjacent)
+                windows[current ^ 1].Clear(number - 1);
+        }
+        return windows[current];
+    }
+
+    // Only call on the loop thread, like the stage itself.
+    void PrintStats(FILE* file)
+    {
+        Rotate(MonotonicNanoseconds());
+        PrintWindow(file, "current", windows[current]);
+        PrintWindow(file, "previous", windows[current ^ 1]);
+    }
+
+private:
+    static void PrintWindow(FILE* file, const char* label, const Window& window)
+    {
+        fprintf(file, "    %s: window=%us messages=%llu bytes=%llu active=~%llu error=%llu\n", label, analytics_window,
+                (unsigned long long) window.messages, (unsigned long long) window.bytes,
+                (unsigned long long) window.active_users.Estimate(), (unsigned long long) window.sender_bytes.Error());
+
+        TopK<TOP>::Entry senders[TOP];
+        TopK<TOP>::Entry recipients[TOP];
+        uint32_t         sender_count    = window.top_senders.Sorted(senders);
+        uint32_t         recipient_count = window.top_recipients.Sorted(recipients);
+        for (uint32_t i = 0; i < std::max(sender_count, recipient_count); ++i)
+        {
+            fprintf(file, "        ");
+            if (i < sender_count)
+                fprintf(file, "sender=%-8llu bytes=%-12llu ", (unsigned long long) senders[i].key,
+                        (unsigned long long) senders[i].count);
+            else
+                fprintf(file, "%36s", "");
+            if (i < recipient_count && recipients[i].key == 0)
+                fprintf(file, "recipient=everyone bytes=%llu", (unsigned long long) recipients[i].count);
+            else if (i < recipient_count)
+                fprintf(file, "recipient=%-8llu bytes=%llu", (unsigned long long) recipients[i].key,
+                        (unsigned long long) recipients[i].count);
+            fprintf(file, "\n");
+        }
+    }
+};
+
+// Drops messages containing a pattern of the content filter. It's registered as a runtime stage so it runs
+// before the commands are handled, which means the text of private messages and searches is checked too.
+// The sender is told, but not which pattern it was (that would only help getting around it).
+inline bool FilterMessage(void*, Message& message)
+{
+    if (content_filter.Find(message.data, (size_t) message.size) < 0)
+        return true;
+    static const char BLOCKED[] = "Your message wasn't sent, it contains a blocked word or link.\n";
+    SendNotice(message.socket, BLOCKED, sizeof(BLOCKED) - 1);
+    return false;
+}
+
+using MessagePipeline = Pipeline<SanitizeStage, ValidateStage, RuntimeStages, CommandStage, PersistStage, Optional<LogStage>, AnalyticsStage, EncodeStage, RouteStage>;
+static MessagePipeline pipeline;
+
+
+// ---- CONNECTIONS ----
+
+inline Connection*& ConnectionSlot(int socket_fd)
+{
+    std::vector<Connection*>& table = socket_fd >= 0 ? connections : virtual_connections;
+    size_t index = socket_fd >= 0 ? (size_t) socket_fd : (size_t) (-2 - socket_fd);
+    if (index >= table.size())
+        table.resize(index + 1, nullptr);
+    return table[index];
+}
+
+inline Connection* Register(Connection* connection)
+{
+    ConnectionSlot(connection->socket) = connection;
+    loop_counters.accepted.fetch_add(1, std::memory_order_relaxed);
+    ++CountersOfNode(connection->node).connections;
+    AccountMemory(sizeof(Connection));
+    return connection;
+}
+
+// Starts serving a connected, non-blocking socket. The client is expected to log in first.
+inline Connection* AddConnection(int socket_fd)
+{
+    if (active_connections.size() + closed_connections.size() >= MAXIMUM_NUMBER_OF_CLIENTS)
+    {
+        close(socket_fd);
+        loop_counters.shed.fetch_add(1, std::memory_order_relaxed);
+        Log(LOG_WARNING, "Too many clients, refused socket %d.", socket_fd);
+        return nullptr;
+    }
+
+    Connection* connection = new Connection;
+    connection->socket    = socket_fd;
+    connection->id        = next_connection_id++;
+    connection->transport = &socket_transport;
+
+    // http://man7.org/linux/man-pages/man7/socket.7.html (SO_ZEROCOPY)
+    //     Only TCP (and UDP) sockets support it, so it fails on the simulator's socketpairs, which then just
+    //     copy as usual.
+    int one = 1;
+    connection->zerocopy = zerocopy_threshold != 0 && setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+
+    // http://man7.org/linux/man-pages/man7/socket.7.html (SO_INCOMING_CPU)
+    //     The CPU that handled the last packet received on the socket, i.e. the one serving the network card
+    //     queue the connection hashed to (the handshake, for a fresh connection). It fails on socketpairs.
+    int incoming_cpu = -1;
+    socklen_t length = sizeof(incoming_cpu);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &length) == 0)
+        connection->node = (int16_t) topology.NodeOf(incoming_cpu);
+
+    // http://man7.org/linux/man-pages/man2/epoll_ctl.2.html
+    //     Level triggered, so a connection that still has data after one 'recv' comes back in the next
+    //     'epoll_wait' instead of starving the others.
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = socket_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1)
+    {
+        close(socket_fd);
+        delete connection;
+        return nullptr;
+    }
+    return Register(connection);
+}
+
+// Starts serving a connection with a transport that isn't a socket (and isn't polled). It has no descriptor,
+// so it's given a number below -1 instead, which is used wherever a socket would be (e.g. in 'user_index').
+// Returns nullptr if there are too many clients.
+inline Connection* AddVirtualConnection(const Transport* transport, void* endpoint)
+{
+    if (active_connections.size() + closed_connections.size() >= MAXIMUM_NUMBER_OF_CLIENTS)
+    {
+        Log(LOG_WARNING, "Too many clients, refused a %s connection.", transport->name);
+        return nullptr;
+    }
+
+    Connection* connection = new Connection;
+    if (!free_virtual_numbers.empty())
+    {
+        connection->socket = free_virtual_numbers.back();
+        free_virtual_numbers.pop_back();
+    }
+    else
+    {
+        connection->socket = -2 - (int) virtual_connections.size();
+    }
+    connection->id        = next_connection_id++;
+    connection->transport = transport;
+    connection->endpoint  = endpoint;
+    return Register(connection);
+}
+
+
+// Logs the client in. The client starts by sending a login frame with the user id it wants (0 if it doesn't
+// have one yet). If nobody has it, not even a session waiting for its client, it gets it, otherwise it's
+// given a fresh one. A client that adds the token and the last sequence number it got from an earlier
+// session gets that session back, even if the server hasn't noticed yet that its old connection is gone.
+// Returns false on failure.
+bool Login(Connection* connection, const char* payload, size_t payload_size, bool& resumed, uint64_t& last_seen)
+{
+    char buffer[64] = { 0 };
+    memcpy(buffer, payload, payload_size < sizeof(buffer) - 1 ? payload_size : sizeof(buffer) - 1);
+
+    char*    end       = NULL;
+    uint32_t requested = (uint32_t) strtoul(buffer, &end, 10);
+    uint64_t token     = 0;
+    resumed   = false;
+    last_seen = 0;
+    if (*end == ' ')
+    {
+        token     = strtoull(end + 1, &end, 16);
+        last_seen = strtoull(end, NULL, 10);
+    }
+
+    auto found = sessions.find(requested);
+    if (found != sessions.end() && token != 0 && found->second->token == token)
+    {
+        Session* session = found->second;
+        if (session->connection != nullptr)
+        {
+            // Take it over from the old connection, which goes away without announcing a leave.
+            Connection* old = session->connection;
+            old->session = nullptr;
+            old->user_id = 0;
+            CloseConnection(old, "Session resumed on another connection.");
+        }
+        else
+        {
+            RemoveDetached(session);
+        }
+        user_index.Remove(requested);
+        if (!user_index.Insert(requested, connection->socket))
+        {
+            session->connection = nullptr;
+            DestroySession(session);
+            return false;
+        }
+
+        session->connection = connection;
+        connection->session = session;
+        connection->user_id = requested;
+        resumed = true;
+        loop_counters.resumes.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // An id whose session is waiting for its client to come back still belongs to that client, a login
+    // without the token doesn't get it (and doesn't get to throw the session away either). Nor does it get an
+    // id with messages waiting in a mailbox, as those only exist while the id has a session (see 'RouteStage').
+    uint32_t user_id = 0;
+    if (requested != 0 && sessions.count(requested) == 0 && user_index.Insert(requested, connection->socket))
+        user_id = requested;
+    for (unsigned attempt = 0; attempt < 64 && user_id == 0; ++attempt)
+    {
+        uint32_t candidate = next_user_id.fetch_add(1, std::memory_order_relaxed);
+        if (candidate == UserIndex::EMPTY || candidate == UserIndex::TOMBSTONE || sessions.count(candidate) != 0)
+            continue;
+        if (user_index.Insert(candidate, connection->socket))
+            user_id = candidate;
+    }
+    if (user_id == 0)
+        return false;
+
+    connection->session = NewSession(user_id);
+    connection->session->connection = connection;
+    connection->user_id = user_id;
+    return true;
+}
+
+
+// Queues a frame that isn't part of the session (i.e. isn't numbered), ahead of the chat messages.
+inline void SendControl(Connection* connection, FrameType type, const char* payload, size_t size)
+{
+    SharedBuffer* buffer = NewSharedBuffer(payload, size);
+    Enqueue(connection, buffer, type, 0, LANE_CONTROL);
+    ReleaseSharedBuffer(buffer);
+}
+
+
+void Welcome(Connection* connection, bool resumed, uint64_t last_seen)
+{
+    uint32_t user_id = connection->user_id;
+    Session* session = connection->session;
+    char     buffer[96];
+
+    connection->active_slot = (uint32_t) active_connections.size();
+    active_connections.push_back(connection);
+
+    auto weight = client_weights.find(user_id);
+    if (weight != client_weights.end())
+        connection->weight = weight->second;
+    Log(LOG_INFO, "Client %u %s on socket %d.", user_id, resumed ? "resumed" : "joined", connection->socket);
+
+    if (announce_presence)
+    {
+        JoinEvent join;
+        join.user = user_id;
+        DispatchEvent(connection->socket, join);
+    }
+
+    // We start off by sending the user id to the client, so it can tell others which id to send private
+    // messages to, and the token it needs to resume the session.
+    int length = snprintf(buffer, sizeof(buffer), "%u %016llx %s", user_id, (unsigned long long) session->token,
+                          resumed ? "resumed" : "new");
+    SendControl(connection, FRAME_WELCOME, buffer, length);
+
+    if (resumed)
+    {
+        // Send again whatever the client didn't get, under the same numbers.
+        Acknowledge(session, last_seen);
+        uint64_t lost = session->first_sequence > last_seen + 1 ? session->first_sequence - last_seen - 1 : 0;
+        for (uint32_t i = 0; i < session->count && !connection->closing; ++i)
+            Enqueue(connection, session->At(i), FRAME_EVENT, session->first_sequence + i, LANE_BULK);
+        loop_counters.replayed.fetch_add(session->count, std::memory_order_relaxed);
+        if (lost > 0)
+        {
+            loop_counters.lost.fetch_add(lost, std::memory_order_relaxed);
+            length = snprintf(buffer, sizeof(buffer), ">>> %llu messages were lost while you were away <<<\n",
+                              (unsigned long long) lost);
+            SendNotice(connection->socket, buffer, length);
+        }
+    }
+
+    // Deliver whatever was sent to the user while it was away, if it resumed its session (a new login never
+    // gets an id with a mailbox, see 'Login'). The mailbox hands it over in big chunks, which are split back
+    // into the events (each with its size in front) so each is numbered on its own.
+    if (!resumed)
+        return;
+    std::string pending;
+    int64_t delivered = offline_mailboxes.Drain(user_id, [connection, &pending](const char* data, size_t size) {
+        pending.append(data, size);
+        const uint8_t* cursor = (const uint8_t*) pending.data();
+        const uint8_t* end    = cursor + pending.size();
+        uint64_t       length;
+        size_t         prefix;
+        while ((prefix = GetVarint(cursor, end, length)) != 0 && length <= (uint64_t) (end - cursor - prefix))
+        {
+            SendToSocket(connection->socket, (const char*) cursor + prefix, length);
+            cursor += prefix + length;
+        }
+        pending.erase(0, (const char*) cursor - pending.data());
+        return !connection->closing;
+    });
+    if (delivered > 0)
+        Log(LOG_INFO, "Delivered %lld bytes of offline messages to client %u.", (long long) delivered, user_id);
+}
+
+
+// ---- GATEWAYS ----
+// A gateway (see gateway.cpp) serves many clients, and talks to us for all of them over a single connection,
+// its link. Each of its clients is a channel on the link, and each channel is a connection of its own here:
+// it logs in, has a session, a queue and a share of the reads like any other. It just isn't a socket. What
+// it sends goes into FRAME_DATA frames queued on the link, so a broadcast to the thousand clients behind a
+// gateway is written with a handful of 'sendmsg' calls on one socket instead of a thousand calls on a
+// thousand sockets.
+//
+// Each direction of a channel has a window (see CHANNEL_WINDOW), so a slow client only fills its own queue
+// here, and the link stays free for the others.
+
+struct Channel
+{
+    uint32_t    id         = 0;
+    Connection* link       = nullptr;  // nullptr once the link is gone.
+    Connection* connection = nullptr;
+    ByteQueue   inbound;                   // From the gateway, not read yet.
+    uint32_t    credit     = CHANNEL_WINDOW;  // What we may still send.
+    uint32_t    consumed   = 0;            // Read since we last gave the gateway credit for it.
+    bool        closed     = false;        // By the gateway, so there's no need to tell it.
+    bool        waiting    = false;        // In 'Gateway::waiting'.
+};
+
+struct Gateway
+{
+    std::unordered_map<uint32_t, Channel*> channels;
+    std::vector<Channel*>                  waiting;  // Had something to send while the link was full.
+};
+
+// The link's queue is kept to half of what gets a connection cut off as slow, so channels never push the
+// link over it. A link that really is slow holds up all its channels, and they wait here.
+inline size_t LinkRoom(const Connection* link)
+{
+    uint64_t limit = maximum_queued_bytes / 2;
+    return link->queued_bytes < limit ? (size_t) (limit - link->queued_bytes) : 0;
+}
+
+// Queues a frame about the channel on the link. The data is gathered from 'chunks'.
+inline void SendOnLink(Connection* link, FrameType type, uint32_t channel, const iovec* chunks, size_t count,
+                       size_t size, Lane lane)
+{
+    SharedBuffer* buffer = (SharedBuffer*) malloc(sizeof(SharedBuffer) + CHANNEL_HEADER_SIZE + size);
+    buffer->references = 1;
+    buffer->size       = (uint32_t) (CHANNEL_HEADER_SIZE + size);
+    WriteChannel(buffer->Data(), channel);
+    char* cursor = buffer->Data() + CHANNEL_HEADER_SIZE;
+    for (size_t i = 0; i < count && size > 0; ++i)
+    {
+        size_t length = std::min(chunks[i].iov_len, size);
+        memcpy(cursor, chunks[i].iov_base, length);
+        cursor += length;
+        size   -= length;
+    }
+    Enqueue(link, buffer, type, 0, lane);
+    ReleaseSharedBuffer(buffer);
+}
+
+inline ssize_t ReceiveFromChannel(Connection* connection, char* data, size_t size)
+{
+    Channel* channel = (Channel*) connection->endpoint;
+    if (channel->inbound.Size() == 0)
+    {
+        if (channel->closed || channel->link == nullptr)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t received = channel->inbound.Pop(data, size);
+    channel->consumed += (uint32_t) received;
+    if (channel->consumed >= CHANNEL_WINDOW / 2 && channel->link != nullptr && !channel->closed)
+    {
+        // Out of the way, the gateway may send that much more.
+        uint32_t credit = htonl(channel->consumed);
+        iovec    chunk  = { &credit, sizeof(credit) };
+        SendOnLink(channel->link, FRAME_CREDIT, channel->id, &chunk, 1, sizeof(credit), LANE_CONTROL);
+        channel->consumed = 0;
+        loop_counters.credits.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (channel->inbound.Size() > 0 || channel->closed)
+        MarkReadable(connection);  // Come back for the rest, or for the end.
+    return (ssize_t) received;
+}
+
+inline ssize_t SendOnChannel(Connection* connection, iovec* chunks, size_t count, int)
+{
+    Channel*    channel = (Channel*) connection->endpoint;
+    Connection* link    = channel->link;
+    if (link == nullptr || link->closing || channel->closed)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += chunks[i].iov_len;
+    size_t allowed = std::min({ total, (size_t) channel->credit, LinkRoom(link) });
+    if (allowed == 0)
+    {
+        // The gateway gives credit with FRAME_CREDIT, and the link makes room when it's flushed. Either way
+        // the channel is flushed again then (see 'MarkWritable').
+        if (channel->credit > 0 && !channel->waiting)
+        {
+            channel->waiting = true;
+            link->gateway->waiting.push_back(channel);
+            loop_counters.link_waits.fetch_add(1, std::memory_order_relaxed);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (size_t sent = 0; sent < allowed; )
+    {
+        size_t size = std::min(allowed - sent, MAXIMUM_CHANNEL_DATA);
+        SendOnLink(link, FRAME_DATA, channel->id, chunks, count, size, LANE_BULK);
+        sent += size;
+
+        // Skip what went out.
+        while (size > 0 && size >= chunks->iov_len)
+        {
+            size -= chunks->iov_len;
+            ++chunks;
+            --count;
+        }
+        if (size > 0)
+        {
+            chunks->iov_base = (char*) chunks->iov_base + size;
+            chunks->iov_len -= size;
+        }
+    }
+    channel->credit -= (uint32_t) allowed;
+    loop_counters.channel_bytes.fetch_add(allowed, std::memory_order_relaxed);
+    return (ssize_t) allowed;
+}
+
+inline void CloseChannel(Connection* connection)
+{
+    Channel* channel = (Channel*) connection->endpoint;
+    if (Connection* link = channel->link)
+    {
+        if (!channel->closed)
+            SendOnLink(link, FRAME_CLOSE, channel->id, nullptr, 0, 0, LANE_BULK);  // After its data.
+        Gateway* gateway = link->gateway;
+        gateway->channels.erase(channel->id);
+        if (channel->waiting)
+            gateway->waiting.erase(std::find(gateway->waiting.begin(), gateway->waiting.end(), channel));
+        link->weight = 1 + (uint32_t) gateway->channels.size();
+    }
+    loop_counters.channels.fetch_sub(1, std::memory_order_relaxed);
+    delete channel;
+}
+
+static const Transport channel_transport = { "channel", false, ReceiveFromChannel, SendOnChannel, CloseChannel };
+
+
+// Turns a connection that sent FRAME_GATEWAY (instead of logging in) into a link.
+inline void StartGateway(Connection* link)
+{
+    link->gateway = new Gateway;
+    loop_counters.gateways.fetch_add(1, std::memory_order_relaxed);
+    Log(LOG_INFO, "Gateway connected on socket %d.", link->socket);
+}
+
+// Handles a frame from a gateway. Returns false if it's malformed.
+inline bool HandleGatewayFrame(Connection* link, const FrameHeader& header, const char* payload, size_t size)
+{
+    if (size < CHANNEL_HEADER_SIZE)
+        return false;
+    Gateway* gateway = link->gateway;
+    uint32_t id      = ReadChannel(payload);
+    payload += CHANNEL_HEADER_SIZE;
+    size    -= CHANNEL_HEADER_SIZE;
+
+    auto     found   = gateway->channels.find(id);
+    Channel* channel = found != gateway->channels.end() ? found->second : nullptr;
+    switch (header.type)
+    {
+        case FRAME_OPEN:
+        {
+            if (channel != nullptr)
+                return false;
+            channel = new Channel;
+            channel->id         = id;
+            channel->link       = link;
+            channel->connection = AddVirtualConnection(&channel_transport, channel);
+            if (channel->connection == nullptr)
+            {
+                SendOnLink(link, FRAME_CLOSE, id, nullptr, 0, 0, LANE_CONTROL);
+                delete channel;
+                return true;
+            }
+            gateway->channels[id] = channel;
+            // A link reads for all its clients, so it gets all their shares (see 'read_quantum').
+            link->weight = 1 + (uint32_t) gateway->channels.size();
+            loop_counters.channels.fetch_add(1, std::memory_order_relaxed);
+            loop_counters.channels_opened.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        case FRAME_DATA:
+        {
+            // Data for a channel that's gone crossed our FRAME_CLOSE.
+            if (channel == nullptr || channel->closed || channel->connection->closing)
+                return true;
+            if (channel->inbound.Size() + channel->consumed + size > CHANNEL_WINDOW)
+            {
+                CloseConnection(channel->connection, "Gateway sent more than the window.");
+                return true;
+            }
+            channel->inbound.Push(payload, size);
+            MarkReadable(channel->connection);
+            return true;
+        }
+        case FRAME_CREDIT:
+        {
+            if (size < sizeof(uint32_t))
+                return false;
+            if (channel == nullptr)
+                return true;
+            uint64_t credit = (uint64_t) channel->credit + ReadChannel(payload);
+            channel->credit = (uint32_t) std::min(credit, (uint64_t) CHANNEL_WINDOW);
+            MarkWritable(channel->connection);
+            return true;
+        }
+        case FRAME_CLOSE:
+        {
+            if (channel == nullptr)
+                return true;
+            channel->closed = true;
+            MarkReadable(channel->connection);  // It reads what's left, and then the end.
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// After the link was flushed: lets the channels that were waiting for room try again, once there's enough
+// of it for more than one of them.
+inline void WakeWaitingChannels(Connection* link)
+{
+    Gateway* gateway = link->gateway;
+    if (gateway->waiting.empty() || LinkRoom(link) < maximum_queued_bytes / 4)
+        return;
+    for (Channel* channel : gateway->waiting)
+    {
+        channel->waiting = false;
+        MarkWritable(channel->connection);
+    }
+    gateway->waiting.clear();
+}
+
+// The link is going away, and all its channels with it. Their sessions stay, for the clients to resume
+// (e.g. through another gateway).
+inline void CloseGateway(Connection* link)
+{
+    Gateway* gateway = link->gateway;
+    for (auto& entry : gateway->channels)
+    {
+        Channel* channel = entry.second;
+        channel->link    = nullptr;
+        channel->waiting = false;
+        CloseConnection(channel->connection, "Gateway disconnected.");
+    }
+    loop_counters.gateways.fetch_sub(1, std::memory_order_relaxed);
+    delete gateway;
+    link->gateway = nullptr;
+}
+
+
+// Hands a sync (see 'SyncEvent') to the search worker, which owns the history.
+inline void RequestSync(Connection* connection, const char* payload, size_t size)
+{
+    SyncEvent sync;
+    if (!Codec<SyncEvent>::Decode(payload, size, sync) || sync.hashes == 0 || sync.hashes > BloomFilter::MAXIMUM_HASHES)
+    {
+        static const char USAGE[] = ">>> Couldn't sync: malformed filter <<<\n";
+        SendNotice(connection->socket, USAGE, sizeof(USAGE) - 1);
+        return;
+    }
+    if (!search.Running())
+    {
+        static const char NO_HISTORY[] = ">>> Couldn't sync: no history is kept <<<\n";
+        SendNotice(connection->socket, NO_HISTORY, sizeof(NO_HISTORY) - 1);
+        return;
+    }
+    search.SubmitSync(connection->user_id, sync);
+}
+
+
+// Reads the connection's share of what's available (see 'read_quantum') and runs the frames through the
+// pipeline. Control frames (the login, acks) are handled first, and the chat messages after all of them,
+// so acks don't wait for the broadcasts of messages that came in with them.
+void HandleReadable(Connection* connection)
+{
+    // Room in front of the message for the pipeline to prepend things without copying.
+    constexpr size_t HEADROOM    = 32;
+    constexpr size_t BUFFER_SIZE = MAXIMUM_PAYLOAD_SIZE + HEADROOM + 1;  // +1 to leave room for a terminator.
+    static char buffer[BUFFER_SIZE];
+    static char scratch[1 << 16];
+
+    // http://man7.org/linux/man-pages/man2/recvmsg.2.html
+    //     recv(socket, buffer, size, flags)
+    //          socket: any socket.
+    //          buffer: array to fill with the message.
+    //          size: the size of the buffer.
+    //          flags: options.
+    FrameReader& reader   = connection->reader;
+    bool         fair     = read_quantum != 0;
+    bool         carried  = connection->backlogged;  // Has frames from last time, don't read more yet.
+    connection->backlogged = false;
+    if (fair)
+        connection->deficit += (int64_t) read_quantum * connection->weight;
+    if (fair && connection->deficit <= 0)
+    {
+        // Still paying off a big frame. What's in the socket keeps (epoll reports it again, other
+        // transports have to be asked again).
+        if (carried)
+        {
+            connection->backlogged = true;
+            backlogged_connections.push_back(connection);
+        }
+        else if (!connection->transport->polled)
+        {
+            MarkReadable(connection);
+        }
+        return;
+    }
+
+    AccountMemory(-(int64_t) reader.partial_size);
+    ssize_t bytes_received = 1;
+    if (carried)
+    {
+        reader.Load(scratch);
+    }
+    else
+    {
+        size_t limit = sizeof(scratch);
+        if (fair && (uint64_t) reader.partial_size + connection->deficit < limit)
+            limit = reader.partial_size + (size_t) connection->deficit;
+        bytes_received = reader.Receive(scratch, limit, [connection](char* data, size_t size) {
+            return connection->transport->receive(connection, data, size);
+        });
+    }
+    if (bytes_received == 0)
+    {
+        CloseConnection(connection, "Client disconnected.");
+    }
+    else if (bytes_received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        CloseConnection(connection, "Issue with connection to client.");
+    }
+    if (bytes_received > 0 && !carried)
+        CountTraffic(connection, bytes_received, 0);
+    uint64_t received = MonotonicNanoseconds();
+
+    // Points into the scratch buffer, which stays put until 'Finish'.
+    struct BulkFrame
+    {
+        FrameHeader header;
+        FrameTrace  trace;
+        const char* payload;
+        size_t      size;
+    };
+    static std::vector<BulkFrame> bulk;
+    bulk.clear();
+
+    FrameHeader header;
+    FrameTrace  trace{};
+    const char* payload      = NULL;
+    size_t      payload_size = 0;
+    bool        malformed    = false;
+    while (!connection->closing && (!fair || connection->deficit > 0) && reader.Next(header, trace, payload, payload_size, malformed))
+    {
+        connection->deficit -= sizeof(FrameHeader) + ntohs(header.size);
+        capture.Record(received, connection->id, header.type, payload, payload_size);
+
+        if (connection->gateway != nullptr)
+        {
+            if (!HandleGatewayFrame(connection, header, payload, payload_size))
+            {
+                CloseConnection(connection, "Gateway sent a malformed frame.");
+                break;
+            }
+            continue;
+        }
+        if (connection->user_id == 0 && header.type == FRAME_GATEWAY)
+        {
+            StartGateway(connection);
+            continue;
+        }
+        if (connection->user_id == 0)
+        {
+            bool     resumed   = false;
+            uint64_t last_seen = 0;
+            if (header.type != FRAME_LOGIN || !Login(connection, payload, payload_size, resumed, last_seen))
+            {
+                CloseConnection(connection, "Couldn't log in client.");
+                break;
+            }
+            Welcome(connection, resumed, last_seen);
+            continue;
+        }
+        AckEvent ack;
+        if (header.type == FRAME_ACK && connection->session != nullptr && Codec<AckEvent>::Decode(payload, payload_size, ack))
+        {
+            Acknowledge(connection->session, ack.sequence);
+            continue;
+        }
+        if (header.type == FRAME_SYNC)
+        {
+            RequestSync(connection, payload, payload_size);
+            continue;
+        }
+        if (header.type == FRAME_TEXT)
+            bulk.push_back(BulkFrame{ header, trace, payload, payload_size });
+    }
+
+    for (const BulkFrame& frame : bulk)
+    {
+        if (connection->closing)
+            break;
+
+        Message message{};
+        message.sender   = connection->user_id;
+        message.socket   = connection->socket;
+        message.data     = &buffer[HEADROOM];
+        message.size     = (int) frame.size;
+        message.headroom = HEADROOM;
+        message.capacity = BUFFER_SIZE - HEADROOM;
+        message.received = received;
+        memcpy(message.data, frame.payload, frame.size);
+
+        if (frame.header.flags & FRAME_TRACED)
+        {
+            message.trace_id = frame.trace.id;
+            tracer.Span(frame.trace.id, "client to server", frame.trace.client_send, received, "user", connection->user_id);
+        }
+        else
+        {
+            message.trace_id = tracer.Sample();
+        }
+
+        pipeline.Process(message);
+    }
+    if (malformed)
+        CloseConnection(connection, "Client sent a malformed frame.");
+
+    if (!connection->closing && reader.Pending())
+    {
+        connection->backlogged = true;
+        backlogged_connections.push_back(connection);
+        loop_counters.reads_deferred.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (connection->deficit > 0)
+    {
+        connection->deficit = 0;  // Nothing left to read it on. Unused shares aren't saved up.
+    }
+    reader.Finish();
+    AccountMemory(reader.partial_size);
+}
+
+
+inline void WatchWritable(Connection* connection, bool watch)
+{
+    if (connection->want_write == watch)
+        return;
+    connection->want_write = watch;
+    if (!connection->transport->polled)
+        return;  // The transport calls 'MarkWritable' when there's room.
+
+    epoll_event event{};
+    event.events  = watch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.fd = connection->socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->socket, &event);
+}
+
+
+// Reads the zero-copy completions off the socket's error queue. Returns how many of 'sends' (from the
+// front) the kernel is done with, and sets 'copied' if it says it had to copy after all. The kernel reports
+// completions on the error queue, which makes epoll report EPOLLERR.
+// https://www.kernel.org/doc/html/latest/networking/msg_zerocopy.html
+size_t ReadZerocopyCompletions(int socket_fd, const std::vector<ZerocopySend>& sends, bool& copied)
+{
+    size_t done = 0;
+    while (done < sends.size())
+    {
+        char   control[128];
+        msghdr message{};
+        message.msg_control    = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(socket_fd, &message, MSG_ERRQUEUE) == -1)
+            break;  // EAGAIN: nothing more to report yet.
+
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            bool error_queue = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                               (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+            if (!error_queue)
+                continue;
+            sock_extended_err error;
+            memcpy(&error, CMSG_DATA(header), sizeof(error));
+            if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied = true;
+
+            // Sends [ee_info, ee_data] are done. They complete in order, so they're at the front.
+            uint32_t last = error.ee_data;
+            while (done < sends.size() && (int32_t) (last - sends[done].id) >= 0)
+                ++done;
+        }
+    }
+    return done;
+}
+
+// Lets go of the buffers the kernel is done with.
+void CompleteZerocopySends(Connection* connection)
+{
+    bool   copied = false;
+    size_t done   = ReadZerocopyCompletions(connection->socket, connection->zerocopy_sends, copied);
+
+    // The kernel had to copy after all (it always does over loopback). Then zero-copy only costs us the
+    // bookkeeping, so stop using it on this connection.
+    if (copied && connection->zerocopy)
+    {
+        connection->zerocopy = false;
+        loop_counters.zerocopy_copied.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < done; ++i)
+    {
+        SharedBuffer* buffer = connection->zerocopy_sends[i].buffer;
+        connection->shared_bytes -= sizeof(SharedBuffer) + buffer->size;
+        AccountMemory(-(int64_t) (sizeof(SharedBuffer) + buffer->size));
+        ReleaseSharedBuffer(buffer);
+    }
+    connection->zerocopy_sends.erase(connection->zerocopy_sends.begin(), connection->zerocopy_sends.begin() + done);
+    loop_counters.zerocopy_completions.fetch_add(done, std::memory_order_relaxed);
+}
+
+// Lets go of what the kernel is done with on a socket that's closing, and closes it once that's everything.
+// If the kernel still hasn't let go after 'ZEROCOPY_DRAIN_TIMEOUT' seconds the socket is closed anyway
+// and the buffers are leaked, they may still be sent from.
+constexpr uint64_t ZEROCOPY_DRAIN_TIMEOUT = 10;
+
+void DrainSocket(size_t slot, uint64_t now)
+{
+    DrainingSocket& draining = draining_sockets[slot];
+    bool            copied   = false;
+    size_t          done     = ReadZerocopyCompletions(draining.fd, draining.sends, copied);
+    for (size_t i = 0; i < done; ++i)
+    {
+        AccountMemory(-(int64_t) (sizeof(SharedBuffer) + draining.sends[i].buffer->size));
+        ReleaseSharedBuffer(draining.sends[i].buffer);
+    }
+    draining.sends.erase(draining.sends.begin(), draining.sends.begin() + done);
+    loop_counters.zerocopy_completions.fetch_add(done, std::memory_order_relaxed);
+
+    bool expired = now - draining.since >= ZEROCOPY_DRAIN_TIMEOUT * 1000000000ull;
+    if (!draining.sends.empty() && !expired)
+        return;
+    if (!draining.sends.empty())
+        Log(LOG_WARNING, "Gave up waiting for %zu zero-copy sends on socket %d.", draining.sends.size(), draining.fd);
+    close(draining.fd);  // Also removes it from the epoll set.
+    draining_sockets[slot] = std::move(draining_sockets.back());
+    draining_sockets.pop_back();
+    if (draining_sockets.empty())
+    {
+        itimerspec off{};
+        timerfd_settime(drain_fd, 0, &off, nullptr);
+    }
+}
+
+// Returns false if the socket isn't one of 'draining_sockets'.
+bool HandleDrainingSocket(int socket_fd)
+{
+    for (size_t i = 0; i < draining_sockets.size(); ++i)
+        if (draining_sockets[i].fd == socket_fd)
+        {
+            DrainSocket(i, MonotonicNanoseconds());
+            return true;
+        }
+    return false;
+}
+
+// Catches up on the draining sockets when 'drain_fd' goes off, in case the kernel stays quiet. The timer
+// runs while there are any, so the loop wakes up for them even when nothing else happens.
+void DrainSockets()
+{
+    uint64_t expirations = 0;
+    ssize_t  bytes_read  = read(drain_fd, &expirations, sizeof(expirations));
+    (void) bytes_read;
+    uint64_t now = MonotonicNanoseconds();
+    for (size_t i = draining_sockets.size(); i-- > 0;)
+        DrainSocket(i, now);
+}
+
+
+// Writes as much of the outbound queue as the socket takes, many messages per call. What doesn't fit is
+// left for when epoll says the socket is writable again. For traced messages it records how long the
+// message waited in the queue and how long the write took.
+//
+// A payload of at least 'zerocopy_threshold' is written on its own with MSG_ZEROCOPY, and its buffer is kept
+// until the kernel says it's done with it. Its header is still copied, since it lives in the queue, which
+// is reused as soon as the item is written.
+void FlushConnection(Connection* connection)
+{
+    constexpr uint32_t BATCH = 64;
+
+    uint64_t start = MonotonicNanoseconds();
+    while (connection->queue_count > 0 && !connection->closing)
+    {
+        // Two chunks per item: the header and the shared payload.
+        iovec    chunks[2 * BATCH];
+        uint32_t count = connection->queue_count < BATCH ? connection->queue_count : BATCH;
+        uint32_t used  = 0;
+        bool     zerocopy = false;
+        uint64_t write_start = MonotonicNanoseconds();
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            OutboundItem& item  = connection->QueueAt(i);
+            bool          large = connection->zerocopy && item.buffer->size >= zerocopy_threshold;
+            if (large && i > 0)
+                break;  // What's in front of it goes the usual way first.
+
+            if (item.trace_id && item.write_start == 0)
+            {
+                item.write_start = write_start;
+                tracer.Span(item.trace_id, "queue wait", item.routed, write_start, "socket", connection->socket);
+            }
+            if (item.offset < item.header_size)
+            {
+                chunks[used].iov_base = item.header + item.offset;
+                chunks[used].iov_len  = item.header_size - item.offset;
+                ++used;
+                if (large)
+                    break;  // Copy the header now, send the payload without copying in the next call.
+                chunks[used].iov_base = item.buffer->Data();
+                chunks[used].iov_len  = item.buffer->size;
+            }
+            else
+            {
+                chunks[used].iov_base = item.buffer->Data() + (item.offset - item.header_size);
+                chunks[used].iov_len  = item.Size() - item.offset;
+                zerocopy = large;
+            }
+            ++used;
+            if (large)
+                break;
+        }
+
+        const Transport* transport     = connection->transport;
+        ssize_t          bytes_written = transport->send(connection, chunks, used, zerocopy ? MSG_ZEROCOPY : 0);
+        if (bytes_written == -1 && zerocopy && errno == ENOBUFS)
+        {
+            // Over the limit of pinned memory for the socket (optmem_max). Copy this one.
+            zerocopy = false;
+            loop_counters.zerocopy_fallbacks.fetch_add(1, std::memory_order_relaxed);
+            bytes_written = transport->send(connection, chunks, used, 0);
+        }
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                CloseConnection(connection, "Couldn't write to socket.");
+            break;
+        }
+        loop_counters.bytes_sent.fetch_add(bytes_written, std::memory_order_relaxed);
+        CountTraffic(connection, 0, bytes_written);
+        loop_counters.queued_bytes.fetch_sub(bytes_written, std::memory_order_relaxed);
+        connection->queued_bytes -= bytes_written;
+
+        if (zerocopy)
+        {
+            // The kernel may read the buffer until it reports this send done, long after the item is gone.
+            SharedBuffer* buffer = connection->QueueAt(0).buffer;
+            ++buffer->references;
+            connection->zerocopy_sends.push_back(ZerocopySend{ connection->zerocopy_next++, buffer });
+            connection->shared_bytes += sizeof(SharedBuffer) + buffer->size;
+            AccountMemory(sizeof(SharedBuffer) + buffer->size);
+            loop_counters.zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+            loop_counters.zerocopy_bytes.fetch_add(bytes_written, std::memory_order_relaxed);
+        }
+
+        uint64_t write_end = 0;
+        size_t   left      = (size_t) bytes_written;
+        while (left > 0)
+        {
+            OutboundItem& item = connection->QueueAt(0);
+            size_t remaining = item.Size() - item.offset;
+            if (left < remaining)
+            {
+                item.offset += (uint32_t) left;
+                break;
+            }
+            left -= remaining;
+            if (item.trace_id)
+            {
+                write_end = write_end ? write_end : MonotonicNanoseconds();
+                tracer.Span(item.trace_id, "socket write", item.write_start, write_end, "socket", connection->socket);
+            }
+            connection->shared_bytes -= sizeof(SharedBuffer) + item.buffer->size;
+            AccountMemory(-(int64_t) (sizeof(SharedBuffer) + item.buffer->size));
+            ReleaseSharedBuffer(item.buffer);
+            connection->queue_head = (connection->queue_head + 1) & (connection->queue_capacity - 1);
+            --connection->queue_count;
+            if (connection->queue_front > 0)
+                --connection->queue_front;
+        }
+    }
+
+    if (!connection->closing)
+        WatchWritable(connection, connection->queue_count > 0);
+    if (connection->gateway != nullptr && !connection->closing)
+        WakeWaitingChannels(connection);
+    loop_counters.flushes.fetch_add(1, std::memory_order_relaxed);
+    loop_counters.flush_nanoseconds.fetch_add(MonotonicNanoseconds() - start, std::memory_order_relaxed);
+}
+
+
+void DestroyConnection(Connection* connection)
+{
+    if (connection->active_slot < active_connections.size() && active_connections[connection->active_slot] == connection)
+    {
+        Connection* last = active_connections.back();
+        active_connections[connection->active_slot] = last;
+        last->active_slot = connection->active_slot;
+        active_connections.pop_back();
+    }
+    if (connection->user_id != 0)
+        user_index.Remove(connection->user_id);
+    if (connection->backlogged)
+    {
+        auto found = std::find(backlogged_connections.begin(), backlogged_connections.end(), connection);
+        if (found != backlogged_connections.end())
+            backlogged_connections.erase(found);
+    }
+    if (connection->held)
+        held_connections.erase(std::find(held_connections.begin(), held_connections.end(), connection));
+    if (connection->readable)
+        readable_connections.erase(std::find(readable_connections.begin(), readable_connections.end(), connection));
+    if (connection->gateway != nullptr)
+        CloseGateway(connection);
+
+    // The session waits for the client to come back, unless it's the reason the connection was closed.
+    if (Session* session = connection->session)
+    {
+        session->connection    = nullptr;
+        session->detached      = MonotonicNanoseconds();
+        session->detached_slot = (uint32_t) detached_sessions.size();
+        detached_sessions.push_back(session);
+        if (!connection->keep_session)
+            DestroySession(session);
+    }
+
+    // The zero-copy buffers stay accounted for until the kernel lets go of them.
+    uint64_t zerocopy_bytes = 0;
+    for (const ZerocopySend& send : connection->zerocopy_sends)
+        zerocopy_bytes += sizeof(SharedBuffer) + send.buffer->size;
+    AccountMemory(-(int64_t) (connection->OwnMemory() - zerocopy_bytes));
+    for (uint32_t i = 0; i < connection->queue_count; ++i)
+        ReleaseSharedBuffer(connection->QueueAt(i).buffer);
+    loop_counters.queued_bytes.fetch_sub(connection->queued_bytes, std::memory_order_relaxed);
+    free(connection->queue);
+
+    capture.Record(MonotonicNanoseconds(), connection->id, CAPTURE_CLOSED, "", 0);
+    ConnectionSlot(connection->socket) = nullptr;
+
+    if (connection->zerocopy_sends.empty())
+    {
+        // Closing the socket also removes it from the epoll set.
+        connection->transport->close(connection);
+        if (connection->socket < -1)
+            free_virtual_numbers.push_back(connection->socket);
+    }
+    else
+    {
+        // The kernel may still be sending from buffers given to it without copying, and only says when it's
+        // done on the socket's error queue, so the socket has to stay open until it has. Disconnecting it
+        // (a 'connect' to AF_UNSPEC) resets the connection and drops what wasn't sent, and the kernel
+        // reports those sends as done right away. Edge triggered, the reset socket's EPOLLHUP doesn't spin
+        // the loop, and each completion still wakes it with EPOLLERR.
+        // http://man7.org/linux/man-pages/man2/connect.2.html
+        sockaddr unspecified{};
+        unspecified.sa_family = AF_UNSPEC;
+        connect(connection->socket, &unspecified, sizeof(unspecified));
+        epoll_event event{};
+        event.events  = EPOLLET;
+        event.data.fd = connection->socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->socket, &event);
+        if (draining_sockets.empty())
+        {
+            itimerspec second{};
+            second.it_value.tv_sec    = 1;
+            second.it_interval.tv_sec = 1;
+            timerfd_settime(drain_fd, 0, &second, nullptr);
+        }
+        draining_sockets.push_back(DrainingSocket{ connection->socket, MonotonicNanoseconds(), {} });
+        draining_sockets.back().sends.swap(connection->zerocopy_sends);
+        DrainSocket(draining_sockets.size() - 1, MonotonicNanoseconds());
+    }
+    loop_counters.closed.fetch_add(1, std::memory_order_relaxed);
+    --CountersOfNode(connection->node).connections;
+
+    Log(LOG_INFO, "Client %u on socket %d: %s", connection->user_id, connection->socket, connection->close_reason);
+    delete connection;
+}
+
+
+// Tears down the closed connections. Telling the others that a client left can close more (slow) ones, so
+// this goes on until there are none left. Connections still in 'dirty_connections' are left for the next
+// round, after the flush has let go of them.
+void ReapConnections()
+{
+    size_t deferred = 0;
+    for (size_t i = 0; i < closed_connections.size(); ++i)
+    {
+        Connection* connection = closed_connections[i];
+        if (connection->dirty)
+        {
+            closed_connections[deferred++] = connection;
+            continue;
+        }
+        // Before the teardown, so the session it leaves behind doesn't get the notice too.
+        if (connection->user_id != 0 && announce_presence)
+        {
+            LeaveEvent leave;
+            leave.user      = connection->user_id;
+            leave.resumable = connection->session != nullptr && connection->keep_session;
+            DispatchEvent(connection->socket, leave);
+        }
+        DestroyConnection(connection);
+    }
+    closed_connections.resize(deferred);
+}
+
+
+// ---- EVENT LOOP ----
+
+inline bool StartEventLoop()
+{
+    topology.Load();
+    loop_node = topology.NodeOf(CurrentCpu());
+
+    // http://man7.org/linux/man-pages/man2/epoll_create.2.html
+    epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    tick_fd   = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd == -1 || wakeup_fd == -1 || tick_fd == -1)
+        return false;
+
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) == -1)
+        return false;
+    event.data.fd = tick_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tick_fd, &event) == -1)
+        return false;
+
+    accept_fd  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    drain_fd   = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (accept_fd == -1 || drain_fd == -1 || reserve_fd == -1)
+        return false;
+    event.data.fd = drain_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, drain_fd, &event) == -1)
+        return false;
+    event.data.fd = accept_fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_fd, &event) == 0;
+}
+
+// Keeps the loop (the calling thread) on 'cpu', and its memory on that CPU's node. Call before the loop
+// allocates anything, and after starting the threads that should run elsewhere.
+inline bool PinLoop(int cpu)
+{
+    if (!PinThread(pthread_self(), cpu))
+        return false;
+    loop_cpu  = cpu;
+    loop_node = topology.NodeOf(cpu);
+    if (!PreferNode(loop_node))
+        Log(LOG_WARNING, "Couldn't keep the loop's memory on node %d.", loop_node);
+    return true;
+}
+
+// How many clients are accepted per readiness of the listening socket. epoll reports it again while the
+// backlog isn't empty, so a storm of connections is taken in over several iterations, with the clients
+// already connected served in between.
+constexpr int ACCEPT_BATCH = 64;
+
+// A token bucket for 'accept_rate'.
+struct Admission
+{
+    double   tokens   = 0;
+    uint64_t refilled = 0;
+    bool     paused   = false;  // The listening socket isn't watched until 'accept_fd' goes off.
+};
+static Admission admission;
+
+// Accepts clients on the (listening) socket from now on.
+inline bool ListenOn(int socket_fd)
+{
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = socket_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1)
+        return false;
+    listen_socket      = socket_fd;
+    admission.tokens   = accept_rate / 10.0;  // The first burst is let in right away.
+    admission.refilled = MonotonicNanoseconds();
+    return true;
+}
+
+// Stops watching the listening socket until 'resume' (on CLOCK_MONOTONIC). The clients wait in the backlog.
+inline void PauseAccepting(uint64_t resume)
+{
+    // http://man7.org/linux/man-pages/man2/epoll_ctl.2.html
+    //     No events, so it stays in the set but isn't reported.
+    epoll_event event{};
+    event.events  = 0;
+    event.data.fd = listen_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_socket, &event);
+
+    itimerspec value{};
+    value.it_value.tv_sec  = (time_t) (resume / 1000000000);
+    value.it_value.tv_nsec = (long) (resume % 1000000000);
+    timerfd_settime(accept_fd, TFD_TIMER_ABSTIME, &value, nullptr);
+    admission.paused = true;
+    loop_counters.accept_pauses.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void ResumeAccepting()
+{
+    uint64_t expirations = 0;
+    ssize_t  bytes_read  = read(accept_fd, &expirations, sizeof(expirations));
+    (void) bytes_read;
+
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = listen_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_socket, &event);
+    admission.paused = false;
+}
+
+// Turns the clients in the backlog away when out of descriptors. 'accept' fails with EMFILE then, and
+// leaves them in the backlog, where the listening socket reports them again right away, forever. So the
+// descriptor kept in reserve is given up to accept them (one at a time), they're closed (and see a reset,
+// rather than hanging until they time out), and the reserve is taken back. Up to a batch of them, so a
+// storm of clients is told quickly, and those that come after a pause may find room again.
+inline void ShedClients()
+{
+    close(reserve_fd);
+    for (int i = 0; i < ACCEPT_BATCH; ++i)
+    {
+        int client_socket = accept4(listen_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (client_socket == -1)
+            break;
+        close(client_socket);
+        loop_counters.shed.fetch_add(1, std::memory_order_relaxed);
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void AcceptClients()
+{
+    uint64_t now   = MonotonicNanoseconds();
+    double   burst = accept_rate / 10.0 > 1 ? accept_rate / 10.0 : 1;
+    if (accept_rate != 0)
+    {
+        admission.tokens   = std::min(burst, admission.tokens + (now - admission.refilled) * 1e-9 * accept_rate);
+        admission.refilled = now;
+    }
+
+    for (int i = 0; i < ACCEPT_BATCH; ++i)
+    {
+        if (accept_rate != 0 && admission.tokens < 1)
+        {
+            // Back when there's a burst's worth again, not for every single token.
+            PauseAccepting(now + (uint64_t) ((burst - admission.tokens) * 1e9 / accept_rate));
+            return;
+        }
+
+        // http://man7.org/linux/man-pages/man2/accept.2.html
+        //     accept4(socket, address, size, flags) is 'accept' that also sets the flags of the new socket,
+        //     so it's ready to serve without two more 'fcntl' calls each.
+        //         flags: SOCK_NONBLOCK and SOCK_CLOEXEC.
+        int client_socket = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            if (errno == ECONNABORTED)
+                continue;  // Gone before we got to it.
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                // Until clients leave there won't be more descriptors, so take a break after turning the
+                // waiting ones away.
+                Log(LOG_WARNING, "Out of descriptors, turning clients away.");
+                ShedClients();
+            }
+            else
+            {
+                Log(LOG_WARNING, "Couldn't accept request from client.");  // E.g. ENOBUFS, ENOMEM.
+            }
+            PauseAccepting(now + 100000000);
+            return;
+        }
+        admission.tokens -= 1;
+
+        // A client let in now would only push out one that's already here (see 'EnforceMemoryBudget').
+        if (loop_counters.memory.load(std::memory_order_relaxed) > memory_budget - memory_budget / 8)
+        {
+            close(client_socket);
+            loop_counters.shed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        Log(LOG_DEBUG, "A client connected!");
+        AddConnection(client_socket);
+    }
+}
+
+// Everyone's memory use, biggest first. Only the first 'count' are sorted.
+std::vector<Connection*> TopConsumers(size_t count)
+{
+    std::vector<Connection*> consumers;
+    for (const std::vector<Connection*>* table : { &connections, &virtual_connections })
+        for (Connection* connection : *table)
+            if (connection != nullptr && !connection->closing)
+                consumers.push_back(connection);
+    if (count > consumers.size())
+        count = consumers.size();
+    std::partial_sort(consumers.begin(), consumers.begin() + count, consumers.end(),
+                      [](const Connection* a, const Connection* b) { return a->Memory() > b->Memory(); });
+    consumers.resize(count);
+    return consumers;
+}
+
+// Gets back under the low watermark: first by dropping the sessions of clients that are away, oldest first,
+// and then by disconnecting the connections holding the most memory (along with their sessions). That's
+// only ever a few clients that stopped reading; everyone else holds a few hundred bytes.
+void EnforceMemoryBudget()
+{
+    uint64_t used = loop_counters.memory.load(std::memory_order_relaxed);
+    if (used <= memory_budget)
+        return;
+
+    uint64_t before        = used;
+    uint64_t low_watermark = memory_budget - memory_budget / 4;
+    unsigned dropped       = 0;
+    unsigned evicted       = 0;
+    size_t   count         = 16;
+    while (used > low_watermark && !detached_sessions.empty())
+    {
+        Session* session = detached_sessions.front();
+        used -= session->Memory();
+        ++dropped;
+        DestroySession(session);
+    }
+    while (used > low_watermark)
+    {
+        std::vector<Connection*> consumers = TopConsumers(count);
+        if (consumers.empty())
+            break;
+        for (Connection* connection : consumers)
+        {
+            if (used <= low_watermark)
+                break;
+            used -= connection->Memory();
+            ++evicted;
+            connection->keep_session = false;
+            CloseConnection(connection, "Client used too much memory.");
+        }
+        count *= 2;
+    }
+    loop_counters.evictions.fetch_add(evicted, std::memory_order_relaxed);
+    Log(LOG_WARNING, "Over the memory budget with %llu bytes, dropped %u sessions and disconnected %u clients.",
+        (unsigned long long) before, dropped, evicted);
+}
+
+void DeliverPostedMessages()
+{
+    uint64_t count = 0;
+    ssize_t  bytes_read = read(wakeup_fd, &count, sizeof(count));
+    (void) bytes_read;
+
+    std::vector<PostedMessage> batch;
+    {
+        std::lock_guard<std::mutex> guard(posted_lock);
+        batch.swap(posted_messages);
+    }
+    for (const PostedMessage& posted : batch)
+    {
+        Connection* connection = FindConnection(user_index.Find(posted.user_id));
+        if (connection == nullptr)
+            continue;
+        for (const std::string& event : posted.events)
+        {
+            SharedBuffer* buffer = NewSharedBuffer(event.data(), event.size());
+            Enqueue(connection, buffer, FRAME_EVENT, 0, LANE_BULK);
+            ReleaseSharedBuffer(buffer);
+        }
+        if (!posted.text.empty())
+            SendNotice(connection->socket, posted.text.data(), posted.text.size());
+    }
+}
+
+void PrintStats();
+
+// Handles what epoll reported and what other transports marked readable, and flushes everything that was
+// queued. Returns the number of events handled (including connections that continued reading what they
+// had left).
+int Serve(const epoll_event* events, int count)
+{
+    // Connections that got more than their share last time continue this time.
+    static std::vector<Connection*> carried;
+    static std::vector<Connection*> readable;
+    carried.clear();
+    carried.swap(backlogged_connections);
+
+    for (int i = 0; i < count; ++i)
+    {
+        int socket_fd = events[i].data.fd;
+        if (socket_fd == listen_socket)
+        {
+            AcceptClients();
+            continue;
+        }
+        if (socket_fd == wakeup_fd)
+        {
+            DeliverPostedMessages();
+            continue;
+        }
+        if (socket_fd == accept_fd)
+        {
+            ResumeAccepting();
+            continue;
+        }
+        if (socket_fd == drain_fd)
+        {
+            DrainSockets();
+            continue;
+        }
+        if (socket_fd == tick_fd)
+        {
+            uint64_t expirations = 0;
+            ssize_t  bytes_read  = read(tick_fd, &expirations, sizeof(expirations));
+            (void) bytes_read;  // The deadline is checked below either way.
+            continue;
+        }
+
+        Connection* connection = FindConnection(socket_fd);
+        if (connection == nullptr && !draining_sockets.empty())
+            HandleDrainingSocket(socket_fd);
+        if (connection == nullptr || connection->closing)
+            continue;
+        if ((events[i].events & EPOLLERR) && !connection->zerocopy_sends.empty())
+            CompleteZerocopySends(connection);
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !connection->backlogged)
+            HandleReadable(connection);
+        if ((events[i].events & EPOLLOUT) && !connection->closing && !connection->dirty)
+        {
+            connection->dirty = true;
+            dirty_connections.push_back(connection);
+        }
+    }
+    // After the sockets, so what a gateway's link brought in for its channels is read right away.
+    readable.clear();
+    readable.swap(readable_connections);
+    for (Connection* connection : readable)
+    {
+        connection->readable = false;
+        if (!connection->closing && !connection->backlogged)
+            HandleReadable(connection);
+    }
+    for (Connection* connection : carried)
+    {
+        if (connection->closing)
+            connection->backlogged = false;
+        else
+            HandleReadable(connection);
+    }
+    if (tick.deadline != 0)
+    {
+        uint64_t now = MonotonicNanoseconds();
+        if (now >= tick.deadline)
+            ReleaseHeldBroadcasts(now);
+    }
+
+    // Leaving notices can queue more, so go until everything settled.
+    do
+    {
+        for (size_t i = 0; i < dirty_connections.size(); ++i)
+        {
+            Connection* connection = dirty_connections[i];
+            connection->dirty = false;
+            if (!connection->closing)
+                FlushConnection(connection);
+        }
+        dirty_connections.clear();
+        EnforceMemoryBudget();
+        ReapConnections();
+    }
+    while (!dirty_connections.empty() || !closed_connections.empty());
+
+    if (stats_requested.exchange(false, std::memory_order_relaxed))
+        PrintStats();
+
+    uint64_t now = MonotonicNanoseconds();
+    ExpireSessions(now);
+    capture.Tick(now);
+    return count + (int) readable.size() + (int) carried.size();
+}
+
+// Waits up to 'timeout' milliseconds (-1 is forever) for something to happen, handles it, and flushes
+// everything that was queued. Returns the number of events handled.
+int RunOnce(int timeout)
+{
+    constexpr int MAXIMUM_EVENTS = 256;
+    epoll_event   events[MAXIMUM_EVENTS];
+
+    // Don't wait when there's work that epoll doesn't know about.
+    if (!backlogged_connections.empty() || !readable_connections.empty() || !dirty_connections.empty())
+        timeout = 0;
+
+    // http://man7.org/linux/man-pages/man2/epoll_wait.2.html
+    int count = epoll_wait(epoll_fd, events, MAXIMUM_EVENTS, timeout);
+    if (loop_cpu == -1)
+        loop_node = topology.NodeOf(CurrentCpu());  // The scheduler may have moved us while we waited.
+    return Serve(events, count < 0 ? 0 : count);
+}
+
+// Like 'RunOnce(0)', without asking epoll. With only connections that aren't sockets (see loopback.h) that
+// makes no system calls at all. Sockets, new clients and the replies of other threads wait for the next
+// 'RunOnce'.
+int Poll()
+{
+    return Serve(nullptr, 0);
+}
+
+
+// Only call on the loop thread (other threads use 'RequestStats').
+void PrintStats()
+{
+    printf("[Stats]: Pipeline\n");
+    pipeline.PrintStats(stdout);
+    pipeline.Get<RuntimeStages>().PrintStats(stdout);
+    printf("[Stats]: Connections\n");
+    uint64_t broadcasts = loop_counters.broadcasts.load();
+    uint64_t deliveries = loop_counters.deliveries.load();
+    uint64_t flushes    = loop_counters.flushes.load();
+    printf("    admission: rate=%u/s shed=%llu pauses=%llu%s\n", accept_rate,
+           (unsigned long long) loop_counters.shed.load(), (unsigned long long) loop_counters.accept_pauses.load(),
+           admission.paused ? " (paused)" : "");
+    printf("    open=%zu accepted=%llu closed=%llu slow=%llu queued=%lluB sent=%lluB\n",
+           active_connections.size(), (unsigned long long) loop_counters.accepted.load(),
+           (unsigned long long) loop_counters.closed.load(), (unsigned long long) loop_counters.slow_disconnects.load(),
+           (unsigned long long) loop_counters.queued_bytes.load(), (unsigned long long) loop_counters.bytes_sent.load());
+    printf("    memory=%llu/%llu evictions=%llu\n", (unsigned long long) loop_counters.memory.load(),
+           (unsigned long long) memory_budget, (unsigned long long) loop_counters.evictions.load());
+    for (Connection* connection : TopConsumers(5))
+        printf("        user=%-8u socket=%-6d total=%-10llu receive=%-6llu queue=%-8llu shared=%-10llu session=%llu\n",
+               connection->user_id, connection->socket, (unsigned long long) connection->Memory(),
+               (unsigned long long) connection->ReceiveMemory(), (unsigned long long) connection->QueueMemory(),
+               (unsigned long long) connection->SharedMemory(), (unsigned long long) connection->SessionMemory());
+    printf("    zerocopy: sends=%llu bytes=%llu completed=%llu copied=%llu fallbacks=%llu threshold=%u\n",
+           (unsigned long long) loop_counters.zerocopy_sends.load(), (unsigned long long) loop_counters.zerocopy_bytes.load(),
+           (unsigned long long) loop_counters.zerocopy_completions.load(), (unsigned long long) loop_counters.zerocopy_copied.load(),
+           (unsigned long long) loop_counters.zerocopy_fallbacks.load(), zerocopy_threshold);
+    printf("    control: frames=%llu overtaken=%llu\n", (unsigned long long) loop_counters.control_frames.load(),
+           (unsigned long long) loop_counters.overtaken.load());
+    printf("    gateways: links=%llu channels=%llu opened=%llu sent=%lluB credits=%llu waits=%llu\n",
+           (unsigned long long) loop_counters.gateways.load(), (unsigned long long) loop_counters.channels.load(),
+           (unsigned long long) loop_counters.channels_opened.load(), (unsigned long long) loop_counters.channel_bytes.load(),
+           (unsigned long long) loop_counters.credits.load(), (unsigned long long) loop_counters.link_waits.load());
+    printf("    reads: quantum=%u weighted=%zu deferred=%llu backlogged=%zu\n", read_quantum, client_weights.size(),
+           (unsigned long long) loop_counters.reads_deferred.load(), backlogged_connections.size());
+    uint64_t ticks = loop_counters.ticks.load();
+    printf("    coalesce: window=%lluus maximum=%uus interval=%lluns ticks=%llu held=%llu immediate=%llu capped=%llu batch=%.1f\n",
+           (unsigned long long) (tick.window / 1000), coalesce_window, (unsigned long long) tick.interval,
+           (unsigned long long) ticks, (unsigned long long) loop_counters.held.load(),
+           (unsigned long long) loop_counters.immediate.load(), (unsigned long long) loop_counters.capped.load(),
+           ticks ? (double) loop_counters.held.load() / ticks : 0.0);
+    printf("    broadcasts=%llu deliveries=%llu fanout=%lluns/delivery flushes=%llu flush=%lluns/flush\n",
+           (unsigned long long) broadcasts, (unsigned long long) deliveries,
+           (unsigned long long) (deliveries ? loop_counters.fanout_nanoseconds.load() / deliveries : 0),
+           (unsigned long long) flushes,
+           (unsigned long long) (flushes ? loop_counters.flush_nanoseconds.load() / flushes : 0));
+    printf("[Stats]: Placement\n");
+    printf("    loop: cpu=%d node=%d pinned=%s nodes=%d\n", loop_cpu == -1 ? CurrentCpu() : loop_cpu, loop_node,
+           loop_cpu == -1 ? "no" : "yes", topology.nodes);
+    uint64_t total_bytes  = 0;
+    uint64_t remote_bytes = 0;
+    int      busiest_node = -1;
+    uint64_t busiest      = 0;
+    for (int node = 0; node <= Topology::MAXIMUM_NODES; ++node)
+    {
+        const NodeCounters& counters = node_counters[node];
+        uint64_t bytes = counters.received + counters.sent;
+        if (bytes == 0 && counters.connections == 0)
+            continue;
+        total_bytes  += bytes;
+        remote_bytes += counters.remote;
+        if (node < Topology::MAXIMUM_NODES && bytes > busiest)
+        {
+            busiest      = bytes;
+            busiest_node = node;
+        }
+        if (node == Topology::MAXIMUM_NODES)
+            printf("    node=?  ");
+        else
+            printf("    node=%-2d ", node);
+        printf("connections=%-8llu received=%-12llu sent=%-12llu remote=%.1f%%\n",
+               (unsigned long long) counters.connections, (unsigned long long) counters.received,
+               (unsigned long long) counters.sent, bytes ? 100.0 * counters.remote / bytes : 0.0);
+    }
+    printf("    remote=%.1f%% of %llu bytes\n", total_bytes ? 100.0 * remote_bytes / total_bytes : 0.0,
+           (unsigned long long) total_bytes);
+    // There's only one loop, so connections can't be handed to a loop on their node. The loop can be moved
+    // to where most of the traffic comes in though.
+    if (busiest_node >= 0 && busiest_node != loop_node && !topology.cpus_of_node[busiest_node].empty())
+        printf("    most traffic comes in on node %d, consider --cpus=%d\n", busiest_node,
+               topology.cpus_of_node[busiest_node].back());
+    printf("[Stats]: Text\n");
+    pipeline.Get<SanitizeStage>().PrintStats(stdout);
+    if (content_filter.Enabled())
+    {
+        printf("[Stats]: Filter\n");
+        content_filter.PrintStats(stdout);
+    }
+    printf("[Stats]: Traffic\n");
+    pipeline.Get<AnalyticsStage>().PrintStats(stdout);
+    printf("[Stats]: Sessions\n");
+    printf("    sessions=%zu detached=%zu resumed=%llu replayed=%llu lost=%llu expired=%llu\n",
+           sessions.size(), detached_sessions.size(), (unsigned long long) loop_counters.resumes.load(),
+           (unsigned long long) loop_counters.replayed.load(), (unsigned long long) loop_counters.lost.load(),
+           (unsigned long long) loop_counters.expired.load());
+    printf("[Stats]: Logger\n");
+    printf("    written=%llu dropped=%llu\n",
+           (unsigned long long) logger.written.load(), (unsigned long long) logger.dropped.load());
+    uint64_t searches = search.searches.load();
+    printf("[Stats]: Search\n");
+    printf("    messages=%u searches=%llu avg=%lluns\n", history.Count(), (unsigned long long) searches,
+           (unsigned long long) (searches ? search.search_nanoseconds.load() / searches : 0));
+    printf("    syncs=%llu synced=%llu skipped=%llu\n", (unsigned long long) search.sync_count.load(),
+           (unsigned long long) search.synced.load(), (unsigned long long) search.skipped.load());
+    printf("    startup: restored=%u replayed=%llu took=%lluus snapshots=%llu last=%lluus\n", history.Restored(),
+           (unsigned long long) search.replayed.load(), (unsigned long long) search.startup_nanoseconds.load() / 1000,
+           (unsigned long long) search.snapshots.load(), (unsigned long long) search.snapshot_nanoseconds.load() / 1000);
+    printf("[Stats]: Mailboxes\n");
+    offline_mailboxes.PrintStats(stdout);
+    if (capture.Enabled())
+    {
+        printf("[Stats]: Capture\n");
+        printf("    records=%llu bytes=%llu\n", (unsigned long long) capture.records, (unsigned long long) capture.bytes);
+    }
+    if (tracer.Enabled())
+    {
+        printf("[Stats]: Tracer\n");
+        printf("    spans=%llu\n", (unsigned long long) tracer.spans.load());
+        tracer.Flush();
+    }
+    fflush(stdout);
+}
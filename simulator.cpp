@@ -0,0 +1,519 @@
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "chat_core.h"
+
+
+// Runs the server core in this process against a crowd of virtual clients, each on its own 'socketpair',
+// so the server can be tested at scale without launching (and forking) thousands of 'Client's.
+//
+// The run is deterministic for a given seed: everything happens on this thread, in rounds.
+//
+//     1. All clients join (log in) and wait for their welcome.
+//     2. Each round, random clients send messages, and faults are injected:
+//            slow readers  never read, so their outbound queue on the server grows until they're cut off.
+//            partial       frames are written in two pieces, the second one in the next round.
+//            resets        close a client in the middle of a frame.
+//            churn         closes a client and immediately reconnects it, resuming its session.
+//        Then the server runs until there's nothing left to do, and the clients read (and acknowledge)
+//        what they got.
+//     3. Every client that was never faulted must have received every broadcast, exactly once. Churned
+//        clients count as not faulted, since resuming must make up for whatever they missed.
+//
+// At the end it reports the memory used per connection and what it costs to fan a message out.
+
+
+struct Random
+{
+    uint64_t state;
+
+    // xorshift64*
+    uint64_t Next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    uint32_t Below(uint32_t n) { return (uint32_t) (Next() % n); }
+};
+
+
+struct VirtualClient
+{
+    int      socket      = -1;       // Our end of the socketpair.
+    uint32_t user_id     = 0;        // Valid once 'identified'.
+    uint64_t token       = 0;        // Of the session, valid once 'identified'.
+    bool     identified  = false;    // The welcome arrived.
+    bool     connected   = false;
+    bool     slow        = false;    // Never reads.
+    bool     faulted     = false;    // Reset or cut off, so its messages aren't checked.
+    uint64_t chats       = 0;        // Chat events received, each only once.
+    uint64_t sequence    = 0;        // Of the last numbered frame received.
+    uint64_t sent        = 0;        // Broadcasts it completely wrote.
+    char*    unsent      = nullptr;  // The rest of a frame that was only partially written.
+    uint32_t unsent_size = 0;
+    bool     unsent_broadcast = false;  // Whether the frame in 'unsent' is a broadcast.
+    FrameReader reader;
+};
+
+
+static std::vector<VirtualClient> clients;
+static int      client_epoll = -1;  // The ends of the clients that read.
+static uint64_t completed    = 0;   // Broadcasts completely written by all clients.
+
+
+uint64_t ResidentBytes()
+{
+    // http://man7.org/linux/man-pages/man5/proc.5.html
+    //     /proc/self/statm: size resident shared text lib data dt (in pages)
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == nullptr)
+        return 0;
+    unsigned long long size = 0, resident = 0;
+    if (fscanf(file, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+
+// Writes as much as the socket takes. Returns false if the server end is gone.
+bool Write(VirtualClient& client, const char* data, uint32_t size, bool count)
+{
+    ssize_t bytes_written = send(client.socket, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (bytes_written == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+    if (bytes_written < 0)
+        bytes_written = 0;
+
+    if ((uint32_t) bytes_written < size)
+    {
+        client.unsent_size = size - (uint32_t) bytes_written;
+        client.unsent      = (char*) malloc(client.unsent_size);
+        client.unsent_broadcast = count;
+        memcpy(client.unsent, data + bytes_written, client.unsent_size);
+    }
+    else if (count)
+    {
+        ++client.sent;
+        ++completed;
+    }
+    return true;
+}
+
+// Writes the rest of a partially written frame.
+void FinishWrite(VirtualClient& client)
+{
+    if (client.unsent == nullptr)
+        return;
+    char*    data = client.unsent;
+    uint32_t size = client.unsent_size;
+    client.unsent      = nullptr;
+    client.unsent_size = 0;
+    Write(client, data, size, client.unsent_broadcast);
+    free(data);
+}
+
+uint32_t MakeFrame(char* frame, FrameType type, const char* payload, size_t size)
+{
+    FrameHeader header;
+    header.size  = htons((uint16_t) size);
+    header.type  = type;
+    header.flags = 0;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), payload, size);
+    return (uint32_t) (sizeof(header) + size);
+}
+
+
+void Disconnect(VirtualClient& client)
+{
+    if (!client.connected)
+        return;
+    free(client.unsent);
+    client.unsent      = nullptr;
+    client.unsent_size = 0;
+    free(client.reader.partial);  // Half a frame from the old connection is no use on the next.
+    client.reader.partial      = nullptr;
+    client.reader.partial_size = 0;
+    close(client.socket);  // Also removes it from 'client_epoll'.
+    client.socket    = -1;
+    client.connected = false;
+}
+
+// Connects the client to the server core and sends the login frame, resuming the session if the client
+// has one. Returns false if out of descriptors.
+bool Connect(uint32_t index)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) == -1)
+        return false;
+    if (AddConnection(pair[1]) == nullptr)
+    {
+        close(pair[0]);
+        return false;
+    }
+
+    VirtualClient& client = clients[index];
+    client.socket     = pair[0];
+    client.connected  = true;
+    client.identified = false;
+    if (!client.slow)
+    {
+        epoll_event event{};
+        event.events   = EPOLLIN;
+        event.data.u32 = index;
+        epoll_ctl(client_epoll, EPOLL_CTL_ADD, client.socket, &event);
+    }
+
+    char payload[64];
+    char frame[96];
+    int  length = client.token == 0
+                ? snprintf(payload, sizeof(payload), "0")
+                : snprintf(payload, sizeof(payload), "%u %016llx %llu", client.user_id, (unsigned long long) client.token,
+                           (unsigned long long) client.sequence);
+    Write(client, frame, MakeFrame(frame, FRAME_LOGIN, payload, length), false);
+    return true;
+}
+
+
+// Reads everything that's waiting for the clients, and acknowledges it. Returns the number of bytes read.
+uint64_t ReadClients()
+{
+    static char scratch[1 << 17];
+    epoll_event events[1024];
+    uint64_t    total = 0;
+
+    while (true)
+    {
+        int count = epoll_wait(client_epoll, events, 1024, 0);
+        if (count <= 0)
+            return total;
+
+        for (int i = 0; i < count; ++i)
+        {
+            VirtualClient& client   = clients[events[i].data.u32];
+            uint64_t       sequence = client.sequence;
+            ssize_t        bytes_received;
+            bool           malformed = false;
+            while (!malformed && (bytes_received = client.reader.Receive(client.socket, scratch, sizeof(scratch))) > 0)
+            {
+                total += bytes_received;
+
+                FrameHeader header;
+                FrameTrace  trace;
+                const char* payload      = NULL;
+                size_t      payload_size = 0;
+                while (client.reader.Next(header, trace, payload, payload_size, malformed))
+                {
+                    if (header.type == FRAME_WELCOME)
+                    {
+                        // "<user id> <token> new|resumed"
+                        char  welcome[64] = { 0 };
+                        char* end         = NULL;
+                        memcpy(welcome, payload, payload_size < sizeof(welcome) - 1 ? payload_size : sizeof(welcome) - 1);
+                        client.user_id    = (uint32_t) strtoul(welcome, &end, 10);
+                        client.token      = strtoull(end, NULL, 16);
+                        client.identified = true;
+                    }
+                    else if (header.type == FRAME_EVENT && (header.flags & FRAME_SEQUENCED) && client.reader.sequence > client.sequence)
+                    {
+                        client.sequence = client.reader.sequence;
+                        ChatEvent chat;
+                        if (Codec<ChatEvent>::Decode(payload, payload_size, chat))
+                            ++client.chats;
+                    }
+                }
+                client.reader.Finish();
+            }
+            if (malformed || bytes_received == 0 || (bytes_received == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                // The server cut us off (we were too slow).
+                client.faulted = true;
+                Disconnect(client);
+                continue;
+            }
+
+            // Not in the middle of a frame, and only for frames that weren't acknowledged yet.
+            if (client.sequence != sequence && client.unsent == nullptr)
+            {
+                AckEvent ack;
+                char     encoded[MAXIMUM_FIXED_EVENT_SIZE];
+                char     frame[64];
+                ack.sequence = client.sequence;
+                Write(client, frame, MakeFrame(frame, FRAME_ACK, encoded, Codec<AckEvent>::Encode(ack, encoded)), false);
+            }
+        }
+    }
+}
+
+
+// Runs the server and the clients until neither has anything left to do. Returns the time spent in the
+// server.
+uint64_t Settle()
+{
+    uint64_t server_time = 0;
+    while (true)
+    {
+        uint64_t start  = MonotonicNanoseconds();
+        int      events = RunOnce(0);
+        server_time += MonotonicNanoseconds() - start;
+        if (ReadClients() == 0 && events == 0 && !HoldingBroadcasts())
+            return server_time;
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* usage = "Usage: <clients> [--rounds=<n>] [--rate=<messages per round>] [--size=<bytes>] "
+                        "[--slow=<percent>] [--partial=<percent>] [--resets=<per round>] [--churn=<per round>] "
+                        "[--queue-limit=<bytes>] [--memory-budget=<bytes>] [--read-quantum=<bytes>] "
+                        "[--coalesce=<microseconds>] [--presence] [--seed=<n>]";
+    if (argc < 2)
+    {
+        printf("%s\n", usage);fflush(stdout);
+        return 1;
+    }
+
+    uint32_t count    = (uint32_t) strtoul(argv[1], NULL, 10);
+    uint32_t rounds   = 100;
+    uint32_t rate     = 10;
+    uint32_t size     = 32;
+    uint32_t slow     = 0;
+    uint32_t partial  = 0;
+    uint32_t resets   = 0;
+    uint32_t churn    = 0;
+    Random   random{ 1 };
+
+    announce_presence            = false;
+    maximum_queued_bytes         = 64 << 10;
+    maximum_unacknowledged_bytes = 64 << 10;
+
+    for (int i = 2; i < argc; ++i)
+    {
+        const char* argument = argv[i];
+        if      (strncmp(argument, "--rounds=", 9) == 0)       rounds  = (uint32_t) atoi(argument + 9);
+        else if (strncmp(argument, "--rate=", 7) == 0)         rate    = (uint32_t) atoi(argument + 7);
+        else if (strncmp(argument, "--size=", 7) == 0)         size    = (uint32_t) atoi(argument + 7);
+        else if (strncmp(argument, "--slow=", 7) == 0)         slow    = (uint32_t) atoi(argument + 7);
+        else if (strncmp(argument, "--partial=", 10) == 0)     partial = (uint32_t) atoi(argument + 10);
+        else if (strncmp(argument, "--resets=", 9) == 0)       resets  = (uint32_t) atoi(argument + 9);
+        else if (strncmp(argument, "--churn=", 8) == 0)        churn   = (uint32_t) atoi(argument + 8);
+        else if (strncmp(argument, "--queue-limit=", 14) == 0) maximum_queued_bytes = strtoull(argument + 14, NULL, 10);
+        else if (strncmp(argument, "--memory-budget=", 16) == 0) memory_budget = strtoull(argument + 16, NULL, 10);
+        else if (strncmp(argument, "--read-quantum=", 15) == 0) read_quantum = (uint32_t) strtoul(argument + 15, NULL, 10);
+        else if (strncmp(argument, "--coalesce=", 11) == 0)     coalesce_window = (uint32_t) strtoul(argument + 11, NULL, 10);
+        else if (strcmp(argument, "--presence") == 0)          announce_presence = true;
+        else if (strncmp(argument, "--seed=", 7) == 0)         random.state = strtoull(argument + 7, NULL, 10) | 1;
+        else
+        {
+            printf("%s\n", usage);fflush(stdout);
+            return 1;
+        }
+    }
+    if (size < 2 || size > MAXIMUM_PAYLOAD_SIZE)
+        size = size < 2 ? 2 : MAXIMUM_PAYLOAD_SIZE;
+
+    // Every client needs two descriptors (both ends of its socketpair), so raise the limit as far as we're
+    // allowed to, and run with fewer clients if that's not enough.
+    // http://man7.org/linux/man-pages/man2/getrlimit.2.html
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    uint64_t possible = limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / 2 : 0;
+    if (possible > MAXIMUM_NUMBER_OF_CLIENTS)
+        possible = MAXIMUM_NUMBER_OF_CLIENTS;
+    if (count > possible)
+    {
+        printf("[Warning]: Only %llu descriptors allowed, running with %llu clients instead of %u.\n",
+               (unsigned long long) limit.rlim_cur, (unsigned long long) possible, count);
+        count = (uint32_t) possible;
+    }
+    if (count < 2)
+    {
+        printf("%s\n", usage);fflush(stdout);
+        return 1;
+    }
+
+    logger.minimum_level = LOG_WARNING;
+    logger.Start();
+    pipeline.Get<Optional<LogStage>>().enabled = false;
+    if (!StartEventLoop() || (client_epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        printf("Couldn't create epoll instance.\n");fflush(stdout);
+        return 1;
+    }
+
+    clients = std::vector<VirtualClient>(count);  // Not copyable, so can't be resized.
+    for (VirtualClient& client : clients)
+        client.reader.maximum_payload = 0xFFFF;
+    for (uint32_t i = 0; i < count; ++i)
+        clients[i].slow = random.Below(100) < slow;
+
+    // ---- JOIN ----
+    uint64_t memory_before = ResidentBytes();
+    uint64_t join_start    = MonotonicNanoseconds();
+    uint64_t server_time   = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!Connect(i))
+        {
+            printf("[Warning]: Couldn't connect client %u: %s\n", i, strerror(errno));
+            break;
+        }
+        if (i % 1024 == 1023)
+            server_time += Settle();
+    }
+    server_time += Settle();
+    uint64_t join_time    = MonotonicNanoseconds() - join_start;
+    uint64_t memory_after = ResidentBytes();
+    size_t   joined       = active_connections.size();
+
+    printf("[Simulator]: %zu clients joined in %.1fms (%.0fns per join in the server)\n",
+           joined, join_time / 1e6, joined ? (double) server_time / joined : 0.0);
+    printf("[Simulator]: Memory per connection: %.0f bytes resident, %.0f bytes accounted (sizeof(Connection) = %zu)\n",
+           joined ? (double) (memory_after - memory_before) / joined : 0.0,
+           joined ? (double) loop_counters.memory.load() / joined : 0.0, sizeof(Connection));
+    fflush(stdout);
+
+    // ---- MESSAGES ----
+    uint64_t deliveries_before = loop_counters.deliveries.load();
+    uint64_t fanout_before     = loop_counters.fanout_nanoseconds.load();
+    uint64_t flush_before      = loop_counters.flush_nanoseconds.load();
+    uint64_t bytes_before      = loop_counters.bytes_sent.load();
+    uint64_t peak_queued       = 0;
+    uint64_t injected_partial  = 0;
+    uint64_t injected_resets   = 0;
+    uint64_t injected_churn    = 0;
+    uint64_t message_start     = MonotonicNanoseconds();
+    server_time = 0;
+
+    char text[MAXIMUM_PAYLOAD_SIZE];
+    char frame[MAXIMUM_FRAME_SIZE];
+    for (uint32_t round = 0; round < rounds; ++round)
+    {
+        for (uint32_t c = 0; c < churn; ++c)
+        {
+            // Leave and come back, resuming the session. Everything the client wrote was read by the server
+            // in the last round, so nothing it sent is lost with the old connection. The server may not have
+            // noticed that the old connection is gone when the new one logs in, in which case the new one
+            // takes the session over.
+            uint32_t       index  = random.Below(count);
+            VirtualClient& client = clients[index];
+            if (!client.connected || !client.identified || client.unsent != nullptr || client.slow)
+                continue;
+            Disconnect(client);
+            Connect(index);
+            ++injected_churn;
+        }
+
+        for (VirtualClient& client : clients)
+            if (client.connected)
+                FinishWrite(client);
+
+        for (uint32_t r = 0; r < resets; ++r)
+        {
+            // Close in the middle of a frame. Before this round's messages: the server reads a client's
+            // messages over several iterations when they're over its share, and may find out that the client
+            // is gone (from a failed write) before it got to them.
+            VirtualClient& client = clients[random.Below(count)];
+            if (!client.connected || client.unsent != nullptr)
+                continue;
+            int      length     = snprintf(text, sizeof(text), "reset in round %u\n", round);
+            uint32_t frame_size = MakeFrame(frame, FRAME_TEXT, text, length);
+            send(client.socket, frame, 1 + random.Below(frame_size - 1), MSG_NOSIGNAL | MSG_DONTWAIT);
+            client.faulted = true;
+            Disconnect(client);
+            ++injected_resets;
+        }
+
+        for (uint32_t m = 0; m < rate; ++m)
+        {
+            // Slow readers don't talk either, the server may cut them off before it gets to their message.
+            VirtualClient& client = clients[random.Below(count)];
+            if (!client.connected || client.slow || client.unsent != nullptr)
+                continue;
+
+            int length = snprintf(text, sizeof(text), "round %u message %u ", round, m);
+            while (length < (int) size - 1)
+                text[length++] = '.';
+            text[length++] = '\n';
+            uint32_t frame_size = MakeFrame(frame, FRAME_TEXT, text, length);
+
+            if (random.Below(100) < partial)
+            {
+                // Only part of the frame now, the rest at the start of the next round.
+                uint32_t split   = 1 + random.Below(frame_size - 1);
+                ssize_t  written = send(client.socket, frame, split, MSG_NOSIGNAL | MSG_DONTWAIT);
+                written = written > 0 ? written : 0;
+                client.unsent_size = frame_size - (uint32_t) written;
+                client.unsent      = (char*) malloc(client.unsent_size);
+                client.unsent_broadcast = true;
+                memcpy(client.unsent, frame + written, client.unsent_size);
+                ++injected_partial;
+            }
+            else if (!Write(client, frame, frame_size, true))
+            {
+                client.faulted = true;
+                Disconnect(client);
+            }
+        }
+
+        uint64_t queued = loop_counters.queued_bytes.load();
+        server_time += Settle();
+        peak_queued = queued > peak_queued ? queued : peak_queued;
+    }
+    for (VirtualClient& client : clients)
+        if (client.connected)
+            FinishWrite(client);
+    server_time += Settle();
+    uint64_t message_time = MonotonicNanoseconds() - message_start;
+
+    // ---- REPORT ----
+    uint64_t deliveries = loop_counters.deliveries.load() - deliveries_before;
+    uint64_t fanout     = loop_counters.fanout_nanoseconds.load() - fanout_before;
+    uint64_t flush      = loop_counters.flush_nanoseconds.load() - flush_before;
+    uint64_t bytes      = loop_counters.bytes_sent.load() - bytes_before;
+
+    uint64_t checked = 0;
+    uint64_t wrong   = 0;
+    for (const VirtualClient& client : clients)
+    {
+        if (client.faulted || client.slow || !client.connected)
+            continue;
+        ++checked;
+        if (client.chats != completed - client.sent)
+            ++wrong;
+    }
+
+    printf("[Simulator]: %llu messages, %llu deliveries, %.1fMB sent in %.1fms (%.1fms in the server)\n",
+           (unsigned long long) completed, (unsigned long long) deliveries, bytes / 1e6, message_time / 1e6,
+           server_time / 1e6);
+    printf("[Simulator]: Fan-out: %.1fns per delivery to queue, %.1fns per delivery to flush, %.1fns per delivery in total\n",
+           deliveries ? (double) fanout / deliveries : 0.0, deliveries ? (double) flush / deliveries : 0.0,
+           deliveries ? (double) server_time / deliveries : 0.0);
+    printf("[Simulator]: Faults: %llu partial writes, %llu resets, %llu reconnects, %llu slow disconnects, %llu evictions (peak queued %lluB)\n",
+           (unsigned long long) injected_partial, (unsigned long long) injected_resets, (unsigned long long) injected_churn,
+           (unsigned long long) loop_counters.slow_disconnects.load(), (unsigned long long) loop_counters.evictions.load(),
+           (unsigned long long) peak_queued);
+    printf("[Simulator]: Delivery checked for %llu clients: %llu wrong\n", (unsigned long long) checked, (unsigned long long) wrong);
+    fflush(stdout);
+
+    logger.Stop();
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <math.h>
+
+#include <stdint.h>
+#include <string.h>
+
+
+// Streaming summaries that answer "who sends the most", "how many are there" and "is it there" in fixed
+// memory, however many keys there are. They're approximate, and each says how far off it can be.
+
+
+// Spreads the bits of a key over all 64, so nearby ids (users are numbered 1, 2, 3...) end up far apart.
+// The finalizer of MurmurHash3.
+inline uint64_t MixBits(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDull;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+
+// Counts per key in a table of DEPTH rows of WIDTH counters (Cormode, Muthukrishnan: "An Improved Data
+// Stream Summary: The Count-Min Sketch and its Applications"). Each row has its own hash of the key, and
+// the count of a key is the smallest of its counters, since other keys can only have added to them. The
+// estimate is never too low, and too high by at most 2/WIDTH of the total with a probability of 1 - 2^-DEPTH.
+//
+// Only the smallest counters of a key are raised (the "conservative update"), which leaves the others
+// closer to the truth for the keys that share them.
+template <uint32_t DEPTH, uint32_t WIDTH>
+struct CountMinSketch
+{
+    static_assert((WIDTH & (WIDTH - 1)) == 0, "WIDTH must be a power of 2.");
+
+    uint32_t counters[DEPTH][WIDTH] = {};
+    uint64_t total                  = 0;
+
+    // Adds to the key's count and returns its new estimate.
+    uint64_t Add(uint64_t key, uint32_t amount)
+    {
+        uint32_t slots[DEPTH];
+        uint32_t smallest = UINT32_MAX;
+        Slots(key, slots);
+        for (uint32_t row = 0; row < DEPTH; ++row)
+            smallest = std::min(smallest, counters[row][slots[row]]);
+
+        uint32_t estimate = smallest + amount < smallest ? UINT32_MAX : smallest + amount;  // Saturates.
+        for (uint32_t row = 0; row < DEPTH; ++row)
+            counters[row][slots[row]] = std::max(counters[row][slots[row]], estimate);
+        total += amount;
+        return estimate;
+    }
+
+    uint64_t Estimate(uint64_t key) const
+    {
+        uint32_t slots[DEPTH];
+        uint32_t smallest = UINT32_MAX;
+        Slots(key, slots);
+        for (uint32_t row = 0; row < DEPTH; ++row)
+            smallest = std::min(smallest, counters[row][slots[row]]);
+        return smallest;
+    }
+
+    // How much too high an estimate can be (with high probability).
+    uint64_t Error() const { return total * 2 / WIDTH; }
+
+    void Clear()
+    {
+        memset(counters, 0, sizeof(counters));
+        total = 0;
+    }
+
+private:
+    // The rows' hashes are h1 + row * h2 of two halves of one hash (Kirsch, Mitzenmacher: "Less Hashing,
+    // Same Performance"), so there's one hash per key, not one per row.
+    static void Slots(uint64_t key, uint32_t* slots)
+    {
+        uint64_t hash = MixBits(key);
+        uint32_t h1   = (uint32_t) hash;
+        uint32_t h2   = (uint32_t) (hash >> 32) | 1;
+        for (uint32_t row = 0; row < DEPTH; ++row)
+            slots[row] = (h1 + row * h2) & (WIDTH - 1);
+    }
+};
+
+
+// The K keys with the highest counts seen, as a min-heap so the one to push out is at the top. Fed with the
+// estimates of a count-min sketch, a key that's been pushed out comes back with its full count as soon as
+// it's seen again, so the heavy hitters are found without keeping a count for everyone.
+template <uint32_t K>
+struct TopK
+{
+    struct Entry
+    {
+        uint64_t key;
+        uint64_t count;
+    };
+
+    Entry    entries[K];
+    uint32_t size = 0;
+
+    void Update(uint64_t key, uint64_t count)
+    {
+        // K is small, a scan is as fast as an index would be.
+        for (uint32_t i = 0; i < size; ++i)
+        {
+            if (entries[i].key == key)
+            {
+                entries[i].count = count;
+                SiftDown(i);  // Counts only go up.
+                return;
+            }
+        }
+        if (size < K)
+        {
+            entries[size] = Entry{ key, count };
+            SiftUp(size++);
+        }
+        else if (count > entries[0].count)
+        {
+            entries[0] = Entry{ key, count };
+            SiftDown(0);
+        }
+    }
+
+    // Highest first. An insertion sort, there are only K of them.
+    uint32_t Sorted(Entry* sorted) const
+    {
+        for (uint32_t i = 0; i < size; ++i)
+        {
+            uint32_t j = i;
+            for (; j > 0 && sorted[j - 1].count < entries[i].count; --j)
+                sorted[j] = sorted[j - 1];
+            sorted[j] = entries[i];
+        }
+        return size;
+    }
+
+    void Clear() { size = 0; }
+
+private:
+    void SiftUp(uint32_t i)
+    {
+        while (i > 0 && entries[(i - 1) / 2].count > entries[i].count)
+        {
+            std::swap(entries[(i - 1) / 2], entries[i]);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void SiftDown(uint32_t i)
+    {
+        while (true)
+        {
+            uint32_t smallest = i;
+            for (uint32_t child = 2 * i + 1; child <= 2 * i + 2 && child < size; ++child)
+                if (entries[child].count < entries[smallest].count)
+                    smallest = child;
+            if (smallest == i)
+                return;
+            std::swap(entries[i], entries[smallest]);
+            i = smallest;
+        }
+    }
+};
+
+
+// The number of distinct keys, in 2^PRECISION bytes (Flajolet et al.: "HyperLogLog: the analysis of a
+// near-optimal cardinality estimation algorithm"). The hash of a key picks a register by its first bits,
+// and the register keeps the longest run of leading zeros seen in the rest. Long runs are rare, so the
+// longest run says how many keys there must have been. Off by about 1.04 / sqrt(2^PRECISION), 1.6% for 12.
+template <uint32_t PRECISION>
+struct HyperLogLog
+{
+    static constexpr uint32_t REGISTERS = 1u << PRECISION;
+
+    uint8_t registers[REGISTERS] = {};
+
+    void Add(uint64_t key)
+    {
+        uint64_t hash  = MixBits(key ^ 0x9E3779B97F4A7C15ull);  // Not the same hash as the sketch's.
+        uint32_t index = (uint32_t) (hash >> (64 - PRECISION));
+        uint64_t rest  = (hash << PRECISION) | (1ull << (PRECISION - 1));  // Never all zeros.
+        uint8_t  rank  = (uint8_t) (__builtin_clzll(rest) + 1);
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    uint64_t Estimate() const
+    {
+        double   sum   = 0;
+        uint32_t zeros = 0;
+        for (uint32_t i = 0; i < REGISTERS; ++i)
+        {
+            sum += ldexp(1.0, -registers[i]);
+            zeros += registers[i] == 0;
+        }
+        double m        = REGISTERS;
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+        // With few keys most registers are still empty, and counting those is more accurate.
+        if (estimate <= 2.5 * m && zeros > 0)
+            estimate = m * log(m / zeros);
+        return (uint64_t) (estimate + 0.5);
+    }
+
+    void Clear() { memset(registers, 0, sizeof(registers)); }
+};
+
+
+// Whether a key is in a set, in a few bits per key (Bloom: "Space/Time Trade-offs in Hash Coding with
+// Allowable Errors"). Each key sets 'hashes' bits of the array, and a key whose bits are all set was
+// probably added. A key that was added is always found, one that wasn't is found by mistake with a
+// probability of about 0.6185^(bits per key): 1% at 10 bits per key, with 7 hashes.
+//
+// The bits are a plain byte array, the same on every machine, so a filter can be built on one end of a
+// connection and checked on the other.
+struct BloomFilter
+{
+    static constexpr uint32_t MAXIMUM_HASHES = 16;
+
+    std::vector<uint8_t> bits;
+    uint32_t             hashes = 1;
+
+    // The number of hashes with the fewest mistakes for that many bits per key (ln 2 * bits / keys).
+    static uint32_t HashesFor(size_t bit_count, size_t keys)
+    {
+        if (keys == 0)
+            return 1;
+        double best = 0.693 * bit_count / keys;
+        return best < 1 ? 1 : best > MAXIMUM_HASHES ? MAXIMUM_HASHES : (uint32_t) (best + 0.5);
+    }
+
+    void Add(uint64_t key)
+    {
+        uint32_t h1, h2;
+        Hash(key, h1, h2);
+        uint32_t bit_count = (uint32_t) bits.size() * 8;
+        for (uint32_t i = 0; i < hashes && bit_count > 0; ++i)
+        {
+            uint32_t bit = (h1 + i * h2) % bit_count;
+            bits[bit >> 3] |= (uint8_t) (1 << (bit & 7));
+        }
+    }
+
+    bool MayContain(uint64_t key) const
+    {
+        uint32_t h1, h2;
+        Hash(key, h1, h2);
+        uint32_t bit_count = (uint32_t) bits.size() * 8;
+        if (bit_count == 0)
+            return false;  // Empty, nothing was added.
+        for (uint32_t i = 0; i < hashes; ++i)
+        {
+            uint32_t bit = (h1 + i * h2) % bit_count;
+            if (!(bits[bit >> 3] & (1 << (bit & 7))))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // Like the count-min sketch's rows, the bits are h1 + i * h2 of two halves of one hash.
+    static void Hash(uint64_t key, uint32_t& h1, uint32_t& h2)
+    {
+        uint64_t hash = MixBits(key ^ 0xA0761D6478BD642Full);
+        h1 = (uint32_t) hash;
+        h2 = (uint32_t) (hash >> 32) | 1;
+    }
+};
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+#include "search.h"
+
+
+// What the server would otherwise rebuild from the whole history when it starts: where every message is in
+// the history file, and the search index over them. Taken every so often by the search worker, and mapped
+// on startup. Then only the messages written after the snapshot are read and indexed, the history file is
+// the log that's replayed from the snapshot point. So starting takes as long as paging in the snapshot,
+// however long the history is.
+//
+// Nothing in the file is a pointer, everything is an array at an offset from the start. Where it's mapped
+// doesn't matter, it's used as it is: the offsets go to the history with one copy, and each posting list
+// with one copy of its blocks and bytes, nothing is decoded or tokenized again.
+//
+//     | header | offsets | times | terms | blocks | tails | bytes | words |
+//
+// The sections are in the native byte order and alignment, the header says which ones (a snapshot from
+// another machine is just ignored, it's only a cache).
+
+constexpr char     SNAPSHOT_MAGIC[8] = { 'C', 'H', 'A', 'T', 'S', 'N', 'A', 'P' };
+constexpr uint32_t SNAPSHOT_VERSION  = 1;
+
+struct SnapshotHeader
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      byte_order;    // 0x01020304, as written.
+    uint32_t      messages;
+    uint32_t      term_count;
+    uint64_t      history_size;  // Where the snapshot point is in the history file.
+    HistoryRecord last;          // The last message before it, to check that it's the same history.
+
+    // Sections, as offsets from the start of the file.
+    uint64_t offsets_at;  // uint64_t per message.
+    uint64_t times_at;    // uint64_t per message.
+    uint64_t terms_at;    // SnapshotTerm per term.
+    uint64_t blocks_at;   // PostingList::Block, all terms'.
+    uint64_t tails_at;    // uint32_t, all terms'.
+    uint64_t bytes_at;    // uint8_t, all terms'.
+    uint64_t words_at;    // The words, not terminated.
+    uint64_t size;        // Of the whole file.
+};
+
+struct SnapshotTerm
+{
+    uint64_t word;        // Offsets within the section.
+    uint64_t blocks;
+    uint64_t tail;
+    uint64_t bytes;
+    uint32_t word_size;
+    uint32_t block_count;
+    uint32_t tail_size;
+    uint32_t byte_count;
+    uint32_t total;
+    uint32_t unused;
+};
+
+
+struct Snapshot
+{
+    void*                 mapping = nullptr;
+    size_t                size    = 0;
+    const SnapshotHeader* header  = nullptr;
+
+    // Maps the snapshot, and checks that every section is inside the file. Returns false if there is none
+    // (or it's not one we can use).
+    bool Map(const char* path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+        struct stat status;
+        if (fstat(fd, &status) == -1 || (size_t) status.st_size < sizeof(SnapshotHeader))
+        {
+            close(fd);
+            return false;
+        }
+
+        // http://man7.org/linux/man-pages/man2/mmap.2.html
+        //     mmap(address, length, protection, flags, fd, offset) maps the file into memory. Pages are only
+        //     read from the disk (or the page cache) when they're first touched.
+        //         MAP_POPULATE: reads them all ahead, in big sequential reads, instead of one fault each.
+        size    = (size_t) status.st_size;
+        mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);  // The mapping stays.
+        if (mapping == MAP_FAILED)
+        {
+            mapping = nullptr;
+            return false;
+        }
+        header = (const SnapshotHeader*) mapping;
+        if (!Valid())
+        {
+            Unmap();
+            return false;
+        }
+        return true;
+    }
+
+    void Unmap()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, size);
+        mapping = nullptr;
+        header  = nullptr;
+        size    = 0;
+    }
+
+    const uint64_t* Offsets() const { return At<uint64_t>(header->offsets_at); }
+
+    // Fills the (empty) index with the snapshot's.
+    void Restore(SearchIndex& index) const
+    {
+        const SnapshotTerm*       terms  = At<SnapshotTerm>(header->terms_at);
+        const PostingList::Block* blocks = At<PostingList::Block>(header->blocks_at);
+        const uint32_t*           tails  = At<uint32_t>(header->tails_at);
+        const uint8_t*            bytes  = At<uint8_t>(header->bytes_at);
+        const char*               words  = At<char>(header->words_at);
+
+        const uint64_t* times = At<uint64_t>(header->times_at);
+        index.times.assign(times, times + header->messages);
+        index.terms.reserve(header->term_count);
+        for (uint32_t i = 0; i < header->term_count; ++i)
+        {
+            const SnapshotTerm& term = terms[i];
+            PostingList&        list = index.terms[std::string(words + term.word, term.word_size)];
+            list.blocks.assign(blocks + term.blocks, blocks + term.blocks + term.block_count);
+            list.tail.assign(tails + term.tail, tails + term.tail + term.tail_size);
+            list.bytes.assign(bytes + term.bytes, bytes + term.bytes + term.byte_count);
+            list.total = term.total;
+        }
+    }
+
+    // Writes a snapshot of the history (all of it that was flushed) and its index. It's written next to
+    // the old one, and renamed over it once it's all on the disk, so there's always a whole one.
+    static bool Write(const char* path, const HistoryStore& history, const SearchIndex& index)
+    {
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version      = SNAPSHOT_VERSION;
+        header.byte_order   = 0x01020304;
+        header.messages     = std::min(history.Count(), (uint32_t) index.times.size());
+        header.term_count   = (uint32_t) index.terms.size();
+        header.history_size = header.messages > 0 ? history.offsets[header.messages - 1] : 0;
+        if (header.messages > 0)
+        {
+            char text[HistoryStore::MAXIMUM_TEXT_SIZE];
+            if (!history.Read(header.messages - 1, header.last, text))
+                return false;
+            header.history_size += sizeof(HistoryRecord) + header.last.size;
+        }
+
+        // Where everything goes. The map isn't changed while this runs, so it's walked in the same order
+        // every time.
+        uint64_t block_count = 0, tail_size = 0, byte_count = 0, word_size = 0;
+        for (const auto& entry : index.terms)
+        {
+            block_count += entry.second.blocks.size();
+            tail_size   += entry.second.tail.size();
+            byte_count  += entry.second.bytes.size();
+            word_size   += entry.first.size();
+        }
+        header.offsets_at = sizeof(SnapshotHeader);
+        header.times_at   = header.offsets_at + (uint64_t) header.messages * sizeof(uint64_t);
+        header.terms_at   = header.times_at + (uint64_t) header.messages * sizeof(uint64_t);
+        header.blocks_at  = header.terms_at + (uint64_t) header.term_count * sizeof(SnapshotTerm);
+        header.tails_at   = header.blocks_at + block_count * sizeof(PostingList::Block);
+        header.bytes_at   = Align(header.tails_at + tail_size * sizeof(uint32_t));
+        header.words_at   = Align(header.bytes_at + byte_count);
+        header.size       = header.words_at + word_size;
+
+        std::string temporary = std::string(path) + ".new";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return false;
+
+        Output output(fd);
+        output.Put(&header, sizeof(header));
+        output.Put(history.offsets.data(), header.messages * sizeof(uint64_t));
+        output.Put(index.times.data(), header.messages * sizeof(uint64_t));
+        SnapshotTerm term{};
+        for (const auto& entry : index.terms)
+        {
+            const PostingList& list = entry.second;
+            term.word_size   = (uint32_t) entry.first.size();
+            term.block_count = (uint32_t) list.blocks.size();
+            term.tail_size   = (uint32_t) list.tail.size();
+            term.byte_count  = (uint32_t) list.bytes.size();
+            term.total       = list.total;
+            output.Put(&term, sizeof(term));
+            term.word   += term.word_size;
+            term.blocks += term.block_count;
+            term.tail   += term.tail_size;
+            term.bytes  += term.byte_count;
+        }
+        for (const auto& entry : index.terms)
+            output.Put(entry.second.blocks.data(), entry.second.blocks.size() * sizeof(PostingList::Block));
+        for (const auto& entry : index.terms)
+            output.Put(entry.second.tail.data(), entry.second.tail.size() * sizeof(uint32_t));
+        output.Pad(header.bytes_at);
+        for (const auto& entry : index.terms)
+            output.Put(entry.second.bytes.data(), entry.second.bytes.size());
+        output.Pad(header.words_at);
+        for (const auto& entry : index.terms)
+            output.Put(entry.first.data(), entry.first.size());
+
+        // http://man7.org/linux/man-pages/man2/fsync.2.html
+        //     Before the rename, or a crash could leave the new name on a file that isn't all there.
+        bool written = output.Flush() && output.written == header.size && fsync(fd) == 0;
+        close(fd);
+        if (!written || rename(temporary.c_str(), path) == -1)
+        {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    template <typename T>
+    const T* At(uint64_t offset) const { return (const T*) ((const char*) mapping + offset); }
+
+    static uint64_t Align(uint64_t offset) { return (offset + 7) & ~(uint64_t) 7; }
+
+    bool Inside(uint64_t offset, uint64_t count, size_t width) const
+    {
+        return offset <= size && count <= (size - offset) / width;
+    }
+
+    bool Valid() const
+    {
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+            header->byte_order != 0x01020304 || header->size != size)
+            return false;
+        if (!Inside(header->offsets_at, header->messages, sizeof(uint64_t)) ||
+            !Inside(header->times_at, header->messages, sizeof(uint64_t)) ||
+            !Inside(header->terms_at, header->term_count, sizeof(SnapshotTerm)) ||
+            header->blocks_at > size || header->tails_at > size || header->bytes_at > size || header->words_at > size)
+            return false;
+
+        // The sections' sizes follow from where the next one starts.
+        uint64_t blocks = (header->tails_at - std::min(header->tails_at, header->blocks_at)) / sizeof(PostingList::Block);
+        uint64_t tails  = (header->bytes_at - std::min(header->bytes_at, header->tails_at)) / sizeof(uint32_t);
+        uint64_t bytes  = header->words_at - std::min(header->words_at, header->bytes_at);
+        uint64_t words  = size - header->words_at;
+        const SnapshotTerm* terms = At<SnapshotTerm>(header->terms_at);
+        for (uint32_t i = 0; i < header->term_count; ++i)
+        {
+            const SnapshotTerm& term = terms[i];
+            if (term.blocks > blocks || term.block_count > blocks - term.blocks || term.tail > tails ||
+                term.tail_size > tails - term.tail || term.bytes > bytes || term.byte_count > bytes - term.bytes ||
+                term.word > words || term.word_size > words - term.word)
+                return false;
+            if (!ValidList(term, At<PostingList::Block>(header->blocks_at) + term.blocks,
+                           At<uint32_t>(header->tails_at) + term.tail, At<uint8_t>(header->bytes_at) + term.bytes))
+                return false;
+        }
+        return true;
+    }
+
+    // The search decodes blocks into arrays of BLOCK_SIZE ids without checking them, so a list from the
+    // disk has to be one 'PostingList' could have built: full blocks in order, each with as many deltas
+    // inside the list's bytes as it says, and adding up to its last id, then a tail that's less than a block.
+    static bool ValidList(const SnapshotTerm& term, const PostingList::Block* blocks, const uint32_t* tail,
+                          const uint8_t* bytes)
+    {
+        if (term.tail_size >= PostingList::BLOCK_SIZE || term.block_count + term.tail_size == 0 ||
+            (uint64_t) term.block_count * PostingList::BLOCK_SIZE + term.tail_size != term.total)
+            return false;
+
+        uint64_t previous = 0;  // Last id so far, plus one.
+        for (uint32_t b = 0; b < term.block_count; ++b)
+        {
+            const PostingList::Block& block = blocks[b];
+            if (block.count != PostingList::BLOCK_SIZE || block.first < previous || block.first > block.last ||
+                block.offset > term.byte_count)
+                return false;
+            uint64_t id     = block.first;
+            uint32_t cursor = block.offset;
+            for (uint32_t i = 1; i < block.count; ++i)
+            {
+                uint32_t delta = 0;
+                for (int shift = 0; ; shift += 7)
+                {
+                    if (cursor == term.byte_count || shift > 28)
+                        return false;
+                    uint8_t byte = bytes[cursor++];
+                    delta |= (uint32_t) (byte & 0x7F) << shift;
+                    if (!(byte & 0x80))
+                        break;
+                }
+                id += delta;
+            }
+            if (id != block.last)
+                return false;
+            previous = id + 1;
+        }
+        for (uint32_t i = 0; i < term.tail_size; ++i)
+        {
+            if (tail[i] < previous)
+                return false;
+            previous = (uint64_t) tail[i] + 1;
+        }
+        return true;
+    }
+
+    // Collects the sections and writes them in big chunks.
+    struct Output
+    {
+        int               fd;
+        std::vector<char> buffer;
+        uint64_t          written = 0;  // Including what's still in the buffer.
+        bool              failed  = false;
+
+        explicit Output(int fd) : fd(fd) {}
+
+        void Put(const void* data, size_t size)
+        {
+            buffer.insert(buffer.end(), (const char*) data, (const char*) data + size);
+            written += size;
+            if (buffer.size() >= (1 << 20))
+                Flush();
+        }
+
+        void Pad(uint64_t offset)
+        {
+            static const char ZEROS[8] = {};
+            if (offset > written)
+                Put(ZEROS, (size_t) (offset - written));
+        }
+
+        bool Flush()
+        {
+            size_t done = 0;
+            while (done < buffer.size() && !failed)
+            {
+                ssize_t bytes_written = write(fd, buffer.data() + done, buffer.size() - done);
+                if (bytes_written <= 0)
+                    failed = true;
+                else
+                    done += bytes_written;
+            }
+            buffer.clear();
+            return !failed;
+        }
+    };
+};
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "utf8.h"
+
+
+// Columns the text takes on the terminal, counting each character as one. Wide characters (e.g. CJK) take
+// two on most terminals, which only throws the wrapping off a little.
+inline uint32_t TextWidth(const char* text, size_t size)
+{
+    uint32_t width = 0;
+    for (size_t i = 0; i < size; ++i)
+        width += ((uint8_t) text[i] & 0xC0) != 0x80;
+    return width;
+}
+
+
+// The last lines received, to redraw the screen and scroll back through. All the text is in one ring of
+// bytes and the lines are positions in it, kept in another ring, so adding a line never allocates and the
+// oldest lines make room for the new ones. Lines are numbered from 0 in the order they were added.
+struct Scrollback
+{
+    static constexpr uint32_t BYTES = 1 << 20;  // Powers of 2.
+    static constexpr uint32_t LINES = 1 << 14;
+
+    struct Line
+    {
+        uint64_t position;  // Of its first byte, counting all bytes ever added.
+        uint32_t size;
+        uint32_t width;
+    };
+
+    std::vector<char> bytes = std::vector<char>(BYTES);
+    std::vector<Line> lines = std::vector<Line>(LINES);
+    uint64_t          first   = 0;  // Number of the oldest line kept.
+    uint64_t          end     = 0;  // Number of the next line.
+    uint64_t          written = 0;  // Bytes ever added.
+
+    uint64_t    Count() const               { return end - first; }
+    const Line& At(uint64_t number) const   { return lines[number & (LINES - 1)]; }
+
+    void Add(const char* text, size_t size)
+    {
+        size = size < BYTES ? size : BYTES;
+        while (Count() == LINES || (Count() > 0 && written + size - At(first).position > BYTES))
+            ++first;
+
+        Line& line    = lines[end & (LINES - 1)];
+        line.position = written;
+        line.size     = (uint32_t) size;
+        line.width    = TextWidth(text, size);
+
+        // The line can wrap around the end of the ring.
+        size_t offset = written & (BYTES - 1);
+        size_t part   = size < BYTES - offset ? size : BYTES - offset;
+        memcpy(&bytes[offset], text, part);
+        memcpy(&bytes[0], text + part, size - part);
+        written += size;
+        ++end;
+    }
+
+    void Append(uint64_t number, std::string& out) const
+    {
+        const Line& line   = At(number);
+        size_t      offset = line.position & (BYTES - 1);
+        size_t      part   = line.size < BYTES - offset ? line.size : BYTES - offset;
+        out.append(&bytes[offset], part);
+        out.append(&bytes[0], line.size - part);
+    }
+};
+
+
+// The chat on a terminal. Messages scroll in the upper part of the screen and what the user is typing stays
+// on the last line, instead of the two getting mixed up on the same lines.
+//
+// Nothing is written while things happen. 'Print' only adds lines to the scrollback and the keys only change
+// the input, and 'Render' then brings the screen up to date with a single write:
+//
+//     - New messages are written at the bottom of the scroll region (rows 1 to rows - 1, see DECSTBM), so
+//       the terminal moves the old ones up itself. Of a flood, only the lines that end up on the screen are
+//       written at all, so a render never costs more than a screen, however much came in.
+//     - The input line is compared with what's on the screen, and only the part after the first difference
+//       is written again.
+//     - Everything is redrawn only on start, on resize, on Ctrl-L and when scrolling (Page Up/Page Down).
+//
+// It takes over the terminal (raw mode, the alternate screen) only if stdin and stdout both are one. Otherwise
+// 'Print' writes to stdout as it is, so the client can still be scripted.
+//
+//     terminal.Start();
+//     terminal.Print(text, size);  // From any thread.
+//     terminal.Render();           // Once everything that came in (one read) is printed.
+struct Terminal
+{
+    std::mutex  lock;
+    bool        active = false;
+    termios     saved{};
+    uint32_t    rows    = 24;
+    uint32_t    columns = 80;
+    Scrollback  scrollback;
+    uint64_t    drawn   = 0;     // Lines before this one were written (or skipped as they'd be off screen).
+    uint64_t    view    = 0;     // Lines below the ones on the screen, 0 to follow the newest.
+    bool        redraw  = true;  // Everything has to be drawn again.
+    std::string input;           // What the user is typing.
+    std::string shown;           // The input line as it is on the screen.
+    std::string out;             // What a render writes, kept to reuse its memory.
+
+    // Key presses come in pieces, an escape sequence can be split over reads.
+    std::string sequence;
+    bool        escape = false;
+
+    static inline std::atomic<bool> resized{ false };
+
+    bool Start()
+    {
+        if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+            return false;
+
+        // http://man7.org/linux/man-pages/man3/termios.3.html
+        //     Without ICANON the keys are passed on as they're pressed instead of line by line, without ECHO
+        //     the terminal doesn't print them itself, and without ISIG Ctrl-C is a key instead of SIGINT (so
+        //     the terminal is restored before exiting).
+        if (tcgetattr(STDIN_FILENO, &saved) == -1)
+            return false;
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+        raw.c_iflag &= ~(IXON | ICRNL);
+        raw.c_cc[VMIN]  = 1;
+        raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+            return false;
+
+        // Without SA_RESTART, so the read of the keys returns (EINTR) and the screen is redrawn right away.
+        struct sigaction action{};
+        action.sa_handler = [](int) { resized.store(true, std::memory_order_relaxed); };
+        sigaction(SIGWINCH, &action, nullptr);
+
+        std::lock_guard<std::mutex> guard(lock);
+        active = true;
+        UpdateSize();
+        Write("\x1b[?1049h");  // The alternate screen, so the shell's screen comes back on exit.
+        RenderLocked();
+        return true;
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!active)
+            return;
+        active = false;
+        Write("\x1b[r\x1b[?1049l");
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    }
+
+    // Adds the text, which can be several lines, to the scrollback.
+    void Print(const char* text, size_t size)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!active)
+        {
+            fwrite(text, 1, size, stdout);
+            return;
+        }
+
+        // The server removes control characters, except tabs, which would throw off the widths.
+        static std::string line;
+        while (size > 0)
+        {
+            const char* newline = (const char*) memchr(text, '\n', size);
+            size_t      length  = newline ? (size_t) (newline - text) : size;
+            line.assign(text, length);
+            for (char& c : line)
+                c = c == '\t' ? ' ' : c;
+            if (CheckText(line.data(), line.size()) == TEXT_CONTROLS)
+                line.resize(StripControls(&line[0], line.size()));
+            scrollback.Add(line.data(), line.size());
+            if (view > 0 && view + 1 < scrollback.Count())
+                ++view;  // Stay on the same lines while scrolled back.
+            text += newline ? length + 1 : length;
+            size -= newline ? length + 1 : length;
+        }
+    }
+
+    void Render()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (active)
+            RenderLocked();
+        else
+            fflush(stdout);
+    }
+
+    // Handles the keys pressed, adding the lines entered to 'entered'. Returns false to quit.
+    bool HandleKeys(const char* keys, size_t size, std::vector<std::string>& entered)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < size; ++i)
+        {
+            char c = keys[i];
+            if (escape)
+            {
+                // 'ESC [ <parameters> <final byte>' or 'ESC O <byte>'. Only Page Up/Down ('5~'/'6~') are used.
+                sequence += c;
+                bool done = sequence.size() == 1 ? (c != '[' && c != 'O') : (c >= 0x40 && c <= 0x7E);
+                if (!done)
+                    continue;
+                uint64_t page = rows > 2 ? rows - 2 : 1;
+                if (sequence == "[5~")
+                    Scroll((int64_t) page);
+                else if (sequence == "[6~")
+                    Scroll(-(int64_t) page);
+                escape = false;
+                sequence.clear();
+            }
+            else if (c == '\x1b')
+                escape = true;
+            else if (c == '\r' || c == '\n')
+            {
+                if (!input.empty())
+                    entered.push_back(input + "\n");
+                input.clear();
+            }
+            else if (c == 0x7F || c == '\b')
+            {
+                // A whole character, not just its last byte.
+                while (!input.empty() && ((uint8_t) input.back() & 0xC0) == 0x80)
+                    input.pop_back();
+                if (!input.empty())
+                    input.pop_back();
+            }
+            else if (c == 0x15)  // Ctrl-U
+                input.clear();
+            else if (c == 0x0C)  // Ctrl-L
+                redraw = true;
+            else if (c == 0x03 || (c == 0x04 && input.empty()))  // Ctrl-C, Ctrl-D
+                return false;
+            else if ((uint8_t) c >= 0x20 && input.size() < MAXIMUM_PAYLOAD_SIZE - 1)
+                input += c;
+        }
+        return true;
+    }
+
+private:
+    void Write(const char* text) { Write(text, strlen(text)); }
+
+    void Write(const char* text, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = write(STDOUT_FILENO, text, size);
+            if (written == -1 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return;
+            text += written;
+            size -= (size_t) written;
+        }
+    }
+
+    void UpdateSize()
+    {
+        // http://man7.org/linux/man-pages/man4/tty_ioctl.4.html
+        winsize size{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row >= 2 && size.ws_col >= 10)
+        {
+            rows    = size.ws_row;
+            columns = size.ws_col;
+        }
+        redraw = true;
+    }
+
+    void MoveTo(uint32_t row, uint32_t column)
+    {
+        char move[32];
+        out.append(move, snprintf(move, sizeof(move), "\x1b[%u;%uH", row, column));
+    }
+
+    uint32_t Height(uint64_t number) const
+    {
+        uint32_t width = scrollback.At(number).width;
+        return width == 0 ? 1 : (width + columns - 1) / columns;
+    }
+
+    // The first of the lines before 'last' (and not before 'from') that fit in 'area' rows.
+    uint64_t FirstThatFits(uint64_t from, uint64_t last, uint32_t area) const
+    {
+        uint64_t number = last;
+        uint32_t used   = 0;
+        while (number > from && used + Height(number - 1) <= area)
+            used += Height(--number);
+        return number;
+    }
+
+    void Scroll(int64_t lines)
+    {
+        int64_t most = scrollback.Count() > 0 ? (int64_t) scrollback.Count() - 1 : 0;
+        int64_t next = (int64_t) view + lines;
+        next   = next < 0 ? 0 : next > most ? most : next;
+        redraw = redraw || (uint64_t) next != view;
+        view   = (uint64_t) next;
+    }
+
+    void RenderLocked()
+    {
+        if (resized.exchange(false, std::memory_order_relaxed))
+            UpdateSize();
+
+        out.clear();
+        uint32_t area = rows - 1;  // For the messages, the last row is the input's.
+        if (redraw)
+        {
+            // Set the scroll region and clear the screen, then the lines that fit, from the top of what's
+            // left so that the newest ends up at the bottom.
+            char region[32];
+            out += "\x1b[r\x1b[2J";
+            out.append(region, snprintf(region, sizeof(region), "\x1b[1;%ur", area));
+            uint64_t last   = scrollback.end - view;
+            uint64_t number = FirstThatFits(scrollback.first, last, area);
+            uint32_t used   = 0;
+            for (uint64_t n = number; n < last; ++n)
+                used += Height(n);
+            MoveTo(area - used + 1, 1);
+            for (uint64_t n = number; n < last; ++n)
+            {
+                scrollback.Append(n, out);
+                if (n + 1 < last)
+                    out += "\r\n";
+            }
+            drawn = scrollback.end;
+            redraw = false;
+            shown.clear();
+        }
+        else if (view == 0 && drawn < scrollback.end)
+        {
+            // A new line at the bottom of the scroll region moves the others up.
+            uint64_t from = drawn > scrollback.first ? drawn : scrollback.first;
+            MoveTo(area, 1);
+            for (uint64_t n = FirstThatFits(from, scrollback.end, area); n < scrollback.end; ++n)
+            {
+                out += "\r\n";
+                scrollback.Append(n, out);
+            }
+            drawn = scrollback.end;
+        }
+
+        // The prompt and as much of the end of the input as fits. While scrolled back, the prompt says how
+        // many lines are below.
+        char     prompt[32];
+        int      prompt_size = view > 0 ? snprintf(prompt, sizeof(prompt), "[+%llu] ", (unsigned long long) view)
+                                        : snprintf(prompt, sizeof(prompt), "> ");
+        uint32_t room        = columns - 1 - TextWidth(prompt, prompt_size);
+        size_t   start       = 0;
+        for (uint32_t width = TextWidth(input.data(), input.size()); width > room; --width)
+            while (++start < input.size() && ((uint8_t) input[start] & 0xC0) == 0x80)
+                ;
+        std::string line(prompt, prompt_size);
+        line.append(input, start, std::string::npos);
+
+        // Where it starts to differ from what's on the screen, at a character boundary.
+        size_t same = 0;
+        while (same < line.size() && same < shown.size() && line[same] == shown[same])
+            ++same;
+        while (same > 0 && same < line.size() && ((uint8_t) line[same] & 0xC0) == 0x80)
+            --same;
+
+        if (same < line.size() || line.size() != shown.size() || !out.empty())
+        {
+            MoveTo(rows, TextWidth(line.data(), same) + 1);
+            out.append(line, same, std::string::npos);
+            if (line.size() < shown.size() || shown.empty())
+                out += "\x1b[K";
+            shown = line;
+        }
+        if (!out.empty())
+            Write(out.data(), out.size());
+    }
+};
+
+static Terminal terminal;
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <chrono>
+
+#include <stdint.h>
+
+
+inline uint64_t MonotonicNanoseconds()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
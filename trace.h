@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "timing.h"
+
+
+// Records where sampled messages spend their time and writes it as a Chrome trace (JSON array format),
+// which can be opened in chrome://tracing or https://ui.perfetto.dev. Every traced message gets its own
+// row (the trace id is used as thread id), so the fan-out to the recipients shows up as a timeline.
+//
+// The closing ']' is optional in that format, so the file is valid even if the server is killed.
+struct Tracer
+{
+    FILE*                 file = nullptr;
+    std::mutex            lock;
+    unsigned              sample_rate = 0;  // Trace one in this many untraced messages. 0 means never.
+    std::atomic<uint64_t> counter{ 0 };
+    std::atomic<uint64_t> spans{ 0 };
+
+    bool Open(const char* path)
+    {
+        file = fopen(path, "w");
+        if (file == nullptr)
+            return false;
+        fprintf(file, "[\n");
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (file == nullptr)
+            return;
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Server\"}}]\n");
+        fclose(file);
+        file = nullptr;
+    }
+
+    bool Enabled() const { return file != nullptr; }
+
+    // Returns a new trace id if this message should be sampled, otherwise 0. Ids made by the server have
+    // the top bit set so they never collide with the ones clients make.
+    uint64_t Sample()
+    {
+        if (!Enabled() || sample_rate == 0)
+            return 0;
+        uint64_t n = counter.fetch_add(1, std::memory_order_relaxed);
+        if (n % sample_rate != 0)
+            return 0;
+        return (1ull << 63) | (n + 1);
+    }
+
+    // A complete event from 'start' to 'end' (both from 'MonotonicNanoseconds'), with one argument that's
+    // shown when the event is selected (e.g. which user or socket it was for).
+    void Span(uint64_t trace_id, const char* name, uint64_t start, uint64_t end, const char* key, int64_t value)
+    {
+        if (trace_id == 0 || !Enabled())
+            return;
+        if (end < start)
+            end = start;
+
+        char event[256];
+        int  length = snprintf(event, sizeof(event),
+            "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%lld}},\n",
+            name, (unsigned long long) (trace_id & 0x7FFFFFFFFFFFFFFFull), start / 1000.0, (end - start) / 1000.0,
+            key, (long long) value);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (file != nullptr && length > 0)
+            fwrite(event, 1, length < (int) sizeof(event) ? length : (int) sizeof(event) - 1, file);
+        spans.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Flush()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (file != nullptr)
+            fflush(file);
+    }
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include <stdint.h>
+
+
+// Maps a user id to the socket of the connection it's logged in on. It's an open addressing hash table
+// with linear probing, where each slot is a single 64-bit word holding both the key and the value. That
+// way a reader sees either the whole entry or none of it, and lookups never take a lock.
+//
+// Joins and leaves are rare compared to lookups, so writers simply take a mutex. Removing an entry leaves a
+// tombstone behind (so the probe chains stay intact for concurrent readers), and when there are too many
+// of them the table is rehashed in place. Readers detect that with a sequence counter and retry.
+struct UserIndex
+{
+    static constexpr uint32_t EMPTY     = 0;
+    static constexpr uint32_t TOMBSTONE = 0xFFFFFFFF;
+
+    std::atomic<uint64_t>* slots = nullptr;
+    uint32_t               mask  = 0;
+    uint32_t               used       = 0;  // Protected by 'writer'.
+    uint32_t               tombstones = 0;  // Protected by 'writer'.
+    std::atomic<uint32_t>  version{ 0 };    // Odd while rehashing.
+    std::mutex             writer;
+
+    // The table never grows (growing would need to free the old table while readers might be in it), so
+    // it's sized for the maximum number of connections up front.
+    explicit UserIndex(uint32_t maximum_number_of_users)
+    {
+        uint32_t capacity = 16;
+        while (capacity < maximum_number_of_users * 2)
+            capacity *= 2;
+
+        slots = new std::atomic<uint64_t>[capacity];
+        mask  = capacity - 1;
+        for (uint32_t i = 0; i < capacity; ++i)
+            slots[i].store(0, std::memory_order_relaxed);
+    }
+
+    ~UserIndex() { delete[] slots; }
+
+    UserIndex(const UserIndex&) = delete;
+    UserIndex& operator=(const UserIndex&) = delete;
+
+
+    // Returns the socket the user is connected on, or -1 if it isn't connected.
+    int Find(uint32_t user_id) const
+    {
+        if (user_id == EMPTY || user_id == TOMBSTONE)
+            return -1;
+
+        while (true)
+        {
+            uint32_t before = version.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+
+            int socket = Probe(user_id);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == before)
+                return socket;
+        }
+    }
+
+    // Returns false if the user is already connected or the table is full.
+    bool Insert(uint32_t user_id, int socket)
+    {
+        if (user_id == EMPTY || user_id == TOMBSTONE)
+            return false;
+
+        std::lock_guard<std::mutex> lock(writer);
+
+        if ((used + tombstones + 1) * 4 > (mask + 1) * 3)
+            Rehash();
+        if ((used + 1) * 4 > (mask + 1) * 3)
+            return false;
+
+        // Walk the whole chain to make sure the user isn't in the table already, but remember the first
+        // tombstone on the way so it can be reused.
+        int64_t free_slot = -1;
+        for (uint32_t i = Hash(user_id) & mask; ; i = (i + 1) & mask)
+        {
+            uint32_t key = Key(slots[i].load(std::memory_order_relaxed));
+            if (key == user_id)
+                return false;
+            if (key == TOMBSTONE && free_slot == -1)
+                free_slot = i;
+            if (key == EMPTY)
+            {
+                if (free_slot == -1)
+                    free_slot = i;
+                break;
+            }
+        }
+
+        if (Key(slots[free_slot].load(std::memory_order_relaxed)) == TOMBSTONE)
+            --tombstones;
+        ++used;
+        slots[free_slot].store(Pack(user_id, socket), std::memory_order_release);
+        return true;
+    }
+
+    bool Remove(uint32_t user_id)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+
+        for (uint32_t i = Hash(user_id) & mask; ; i = (i + 1) & mask)
+        {
+            uint32_t key = Key(slots[i].load(std::memory_order_relaxed));
+            if (key == EMPTY)
+                return false;
+            if (key == user_id)
+            {
+                slots[i].store(Pack(TOMBSTONE, -1), std::memory_order_release);
+                --used;
+                ++tombstones;
+                return true;
+            }
+        }
+    }
+
+
+private:
+    static uint32_t Key(uint64_t slot) { return (uint32_t) (slot >> 32); }
+    static int      Value(uint64_t slot) { return (int) (uint32_t) slot; }
+    static uint64_t Pack(uint32_t key, int socket) { return ((uint64_t) key << 32) | (uint32_t) socket; }
+
+    // Murmur3's finalizer. User ids are usually sequential, so they need to be spread out.
+    static uint32_t Hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x85ebca6b;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35;
+        x ^= x >> 16;
+        return x;
+    }
+
+    int Probe(uint32_t user_id) const
+    {
+        for (uint32_t i = Hash(user_id) & mask; ; i = (i + 1) & mask)
+        {
+            uint64_t slot = slots[i].load(std::memory_order_acquire);
+            uint32_t key  = Key(slot);
+            if (key == user_id)
+                return Value(slot);
+            if (key == EMPTY)
+                return -1;
+        }
+    }
+
+    // Gets rid of all tombstones. Must be called with 'writer' held.
+    void Rehash()
+    {
+        uint32_t capacity = mask + 1;
+        uint64_t* live    = new uint64_t[used];
+        uint32_t  count   = 0;
+        for (uint32_t i = 0; i < capacity; ++i)
+        {
+            uint64_t slot = slots[i].load(std::memory_order_relaxed);
+            uint32_t key  = Key(slot);
+            if (key != EMPTY && key != TOMBSTONE)
+                live[count++] = slot;
+        }
+
+        version.fetch_add(1, std::memory_order_acq_rel);
+        for (uint32_t i = 0; i < capacity; ++i)
+            slots[i].store(0, std::memory_order_relaxed);
+        for (uint32_t j = 0; j < count; ++j)
+        {
+            uint32_t i = Hash(Key(live[j])) & mask;
+            while (Key(slots[i].load(std::memory_order_relaxed)) != EMPTY)
+                i = (i + 1) & mask;
+            slots[i].store(live[j], std::memory_order_relaxed);
+        }
+        version.fetch_add(1, std::memory_order_release);
+
+        tombstones = 0;
+        delete[] live;
+    }
+};
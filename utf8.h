@@ -0,0 +1,437 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+// Checks that text is valid UTF-8 and has nothing a terminal would act on, and removes what it would act on.
+//
+// Clients print what they receive, so a message with escape sequences could clear other users' screens,
+// move the cursor to overwrite earlier messages, or set the window title. The things to remove are:
+//
+//     C0 controls    0x00-0x1F except tab and newline, and DEL (0x7F). ESC (0x1B) starts a sequence.
+//     C1 controls    U+0080-U+009F, encoded as 0xC2 0x80-0x9F. Some terminals treat U+009B like 'ESC ['.
+//     Sequences      'ESC [ <parameters> <final byte>' (CSI, e.g. colors and cursor movement),
+//                    'ESC ] ... BEL' or '... ESC \' (OSC, e.g. the window title), the other string
+//                    sequences (DCS, SOS, PM, APC), and 'ESC <intermediates> <final byte>'.
+//
+// Nearly every message has none of that, so 'CheckText' looks for it while validating, and only messages
+// it flags go through 'StripControls', which is plain byte by byte code.
+//
+//     switch (CheckText(text, size))
+//     {
+//         case TEXT_CLEAN:    break;
+//         case TEXT_CONTROLS: size = StripControls(text, size); break;
+//         case TEXT_INVALID:  /* Not UTF-8, drop it. */ break;
+//     }
+//
+// The validation is the "lookup" algorithm of simdjson (John Keiser, Daniel Lemire: "Validating UTF-8 In
+// Less Than One Instruction Per Byte", https://arxiv.org/abs/2010.03090). Instead of decoding characters,
+// it looks at each byte together with the 3 before it: three 16 entry tables indexed by the high nibble of
+// the previous byte, its low nibble and the high nibble of the current byte say which errors the pair
+// could be, and ANDing them leaves the errors it is. Whether a byte must be the 3rd or 4th byte of a
+// character follows from the 2 and 3 bytes before it. That's all shuffles and ANDs on 16 or 32 bytes at
+// once, with no branches per character, so it runs about as fast as the text can be read from memory.
+
+enum TextCheck
+{
+    TEXT_CLEAN,     // Valid UTF-8 with nothing to strip.
+    TEXT_CONTROLS,  // Valid UTF-8, but has control characters or escape sequences.
+    TEXT_INVALID,   // Not UTF-8.
+};
+
+
+// ---- SCALAR ----
+
+// Whether the terminal would act on the character starting at 'text[i]' (which is known to be valid).
+inline bool IsControl(const uint8_t* text, size_t size, size_t i)
+{
+    uint8_t c = text[i];
+    if (c < 0x20)
+        return c != '\t' && c != '\n';
+    if (c == 0x7F)
+        return true;
+    return c == 0xC2 && i + 1 < size && text[i + 1] < 0xA0;
+}
+
+// Table 3-7 of the Unicode standard (Well-Formed UTF-8 Byte Sequences).
+inline TextCheck CheckTextScalar(const uint8_t* text, size_t size)
+{
+    bool   controls = false;
+    size_t i        = 0;
+    while (i < size)
+    {
+        // Most text is ASCII, so skip 8 bytes at a time while none of them has the high bit set.
+        uint64_t block;
+        if (i + 8 <= size && (memcpy(&block, text + i, 8), (block & 0x8080808080808080ULL) == 0))
+        {
+            // A byte below 0x20 or equal to 0x7F.
+            uint64_t low = (block - 0x2020202020202020ULL) | ((block + 0x0101010101010101ULL) & 0x8080808080808080ULL);
+            if (low & 0x8080808080808080ULL)
+                for (size_t j = i; j < i + 8; ++j)
+                    controls |= IsControl(text, size, j);
+            i += 8;
+            continue;
+        }
+
+        uint8_t c = text[i];
+        size_t  length;
+        uint8_t second_low  = 0x80;
+        uint8_t second_high = 0xBF;
+        if (c < 0x80)
+            length = 1;
+        else if (c >= 0xC2 && c <= 0xDF)
+            length = 2;
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            length = 3;
+            second_low  = c == 0xE0 ? 0xA0 : 0x80;  // Overlong.
+            second_high = c == 0xED ? 0x9F : 0xBF;  // Surrogates.
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            length = 4;
+            second_low  = c == 0xF0 ? 0x90 : 0x80;  // Overlong.
+            second_high = c == 0xF4 ? 0x8F : 0xBF;  // Above U+10FFFF.
+        }
+        else
+            return TEXT_INVALID;
+
+        if (i + length > size)
+            return TEXT_INVALID;
+        if (length > 1 && (text[i + 1] < second_low || text[i + 1] > second_high))
+            return TEXT_INVALID;
+        for (size_t j = 2; j < length; ++j)
+            if (text[i + j] < 0x80 || text[i + j] > 0xBF)
+                return TEXT_INVALID;
+
+        controls |= IsControl(text, size, i);
+        i += length;
+    }
+    return controls ? TEXT_CONTROLS : TEXT_CLEAN;
+}
+
+
+// ---- SIMD ----
+
+#if defined(__x86_64__)
+
+namespace utf8_detail
+{
+    // Errors a pair of bytes can be, one bit each.
+    constexpr uint8_t TOO_SHORT      = 1 << 0;  // Lead byte followed by a lead byte or ASCII.
+    constexpr uint8_t TOO_LONG       = 1 << 1;  // ASCII followed by a continuation byte.
+    constexpr uint8_t OVERLONG_3     = 1 << 2;  // 11100000 100_____
+    constexpr uint8_t TOO_LARGE      = 1 << 3;  // 11110100 1001____ and up.
+    constexpr uint8_t SURROGATE      = 1 << 4;  // 11101101 101_____
+    constexpr uint8_t OVERLONG_2     = 1 << 5;  // 1100000_ 10______
+    constexpr uint8_t TOO_LARGE_1000 = 1 << 6;  // 11110101 1000____ and up.
+    constexpr uint8_t OVERLONG_4     = 1 << 6;  // 11110000 1000____
+    constexpr uint8_t TWO_CONTS      = 1 << 7;  // Continuation byte where a lead byte should be.
+    constexpr uint8_t CARRY          = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    // By the high nibble of the previous byte.
+    alignas(16) constexpr uint8_t BYTE_1_HIGH[16] = {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+    };
+
+    // By the low nibble of the previous byte.
+    alignas(16) constexpr uint8_t BYTE_1_LOW[16] = {
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+    };
+
+    // By the high nibble of the current byte.
+    alignas(16) constexpr uint8_t BYTE_2_HIGH[16] = {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    };
+
+    // A lead byte in the last 3 positions of a block needs bytes from the next one.
+    alignas(32) constexpr uint8_t INCOMPLETE[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+    };
+
+    // The two versions below are the same code for 16 and 32 bytes at a time. Each is one function with
+    // nothing but intrinsics in it, so it's compiled for its instruction set even without optimizations
+    // (helpers would be compiled for the baseline and pass the vectors the wrong way).
+    //
+    // The text is read in blocks, and the rest is copied into 'tail' padded with spaces, which are neither
+    // controls nor valid after a lead byte. One more block of spaces finds a character cut off at the end.
+
+    // Needs SSSE3 (shuffles) and SSE4.1 (the zero test).
+    __attribute__((target("sse4.1")))
+    inline TextCheck CheckSse(const uint8_t* text, size_t size)
+    {
+        const __m128i byte_1_high = _mm_load_si128((const __m128i*) BYTE_1_HIGH);
+        const __m128i byte_1_low  = _mm_load_si128((const __m128i*) BYTE_1_LOW);
+        const __m128i byte_2_high = _mm_load_si128((const __m128i*) BYTE_2_HIGH);
+        const __m128i incomplete  = _mm_load_si128((const __m128i*) (INCOMPLETE + 16));
+        const __m128i nibble      = _mm_set1_epi8(0x0F);
+
+        __m128i error               = _mm_setzero_si128();
+        __m128i controls            = _mm_setzero_si128();
+        __m128i previous            = _mm_setzero_si128();
+        __m128i previous_incomplete = _mm_setzero_si128();
+
+        size_t  full = size / 16 * 16;
+        uint8_t tail[32];
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, text + full, size - full);
+
+        for (size_t i = 0; i < full + sizeof(tail); i += 16)
+        {
+            __m128i input = _mm_loadu_si128((const __m128i*) (i < full ? text + i : tail + (i - full)));
+
+            // Bytes below 0x20 other than tab and newline, and DEL.
+            __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(input, _mm_set1_epi8(0x1F)), input);
+            low      = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(input, _mm_set1_epi8('\t')),
+                                                     _mm_cmpeq_epi8(input, _mm_set1_epi8('\n'))), low);
+            controls = _mm_or_si128(controls, _mm_or_si128(low, _mm_cmpeq_epi8(input, _mm_set1_epi8(0x7F))));
+
+            if (_mm_movemask_epi8(input) == 0)
+            {
+                // Only a character cut off at the end of the previous block can be wrong.
+                error    = _mm_or_si128(error, previous_incomplete);
+                previous = input;
+                continue;
+            }
+
+            __m128i previous_1 = _mm_alignr_epi8(input, previous, 16 - 1);
+            __m128i previous_2 = _mm_alignr_epi8(input, previous, 16 - 2);
+            __m128i previous_3 = _mm_alignr_epi8(input, previous, 16 - 3);
+            __m128i special    = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(previous_1, 4), nibble)),
+                              _mm_shuffle_epi8(byte_1_low, _mm_and_si128(previous_1, nibble))),
+                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+            // Whether a byte must be a continuation byte follows from the 2 and 3 bytes before it (0x80 bit),
+            // and 'special' has TWO_CONTS for exactly those, so any difference is an error.
+            __m128i third   = _mm_subs_epu8(previous_2, _mm_set1_epi8((char) (0xE0 - 0x80)));
+            __m128i fourth  = _mm_subs_epu8(previous_3, _mm_set1_epi8((char) (0xF0 - 0x80)));
+            __m128i must_be = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char) 0x80));
+            error = _mm_or_si128(error, _mm_xor_si128(must_be, special));
+
+            // 0xC2 followed by 0x80-0x9F (C1 controls), which is less than 0xA0 as signed bytes.
+            controls = _mm_or_si128(controls, _mm_and_si128(_mm_cmpeq_epi8(previous_1, _mm_set1_epi8((char) 0xC2)),
+                                                            _mm_cmplt_epi8(input, _mm_set1_epi8((char) 0xA0))));
+
+            previous_incomplete = _mm_subs_epu8(input, incomplete);
+            previous            = input;
+        }
+
+        if (!_mm_testz_si128(error, error))
+            return TEXT_INVALID;
+        return _mm_testz_si128(controls, controls) ? TEXT_CLEAN : TEXT_CONTROLS;
+    }
+
+    __attribute__((target("avx2")))
+    inline TextCheck CheckAvx(const uint8_t* text, size_t size)
+    {
+        const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) BYTE_1_HIGH));
+        const __m256i byte_1_low  = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) BYTE_1_LOW));
+        const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) BYTE_2_HIGH));
+        const __m256i incomplete  = _mm256_load_si256((const __m256i*) INCOMPLETE);
+        const __m256i nibble      = _mm256_set1_epi8(0x0F);
+
+        __m256i error               = _mm256_setzero_si256();
+        __m256i controls            = _mm256_setzero_si256();
+        __m256i previous            = _mm256_setzero_si256();
+        __m256i previous_incomplete = _mm256_setzero_si256();
+
+        size_t  full = size / 32 * 32;
+        uint8_t tail[64];
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, text + full, size - full);
+
+        for (size_t i = 0; i < full + sizeof(tail); i += 32)
+        {
+            __m256i input = _mm256_loadu_si256((const __m256i*) (i < full ? text + i : tail + (i - full)));
+
+            __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(input, _mm256_set1_epi8(0x1F)), input);
+            low      = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(input, _mm256_set1_epi8('\t')),
+                                                           _mm256_cmpeq_epi8(input, _mm256_set1_epi8('\n'))), low);
+            controls = _mm256_or_si256(controls, _mm256_or_si256(low, _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x7F))));
+
+            if (_mm256_movemask_epi8(input) == 0)
+            {
+                error    = _mm256_or_si256(error, previous_incomplete);
+                previous = input;
+                continue;
+            }
+
+            // The byte shifts only work within 16 byte lanes, so the upper lane of 'previous' and the lower
+            // lane of 'input' are put together first.
+            __m256i carried    = _mm256_permute2x128_si256(previous, input, 0x21);
+            __m256i previous_1 = _mm256_alignr_epi8(input, carried, 16 - 1);
+            __m256i previous_2 = _mm256_alignr_epi8(input, carried, 16 - 2);
+            __m256i previous_3 = _mm256_alignr_epi8(input, carried, 16 - 3);
+            __m256i special    = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(previous_1, 4), nibble)),
+                                 _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(previous_1, nibble))),
+                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+            __m256i third   = _mm256_subs_epu8(previous_2, _mm256_set1_epi8((char) (0xE0 - 0x80)));
+            __m256i fourth  = _mm256_subs_epu8(previous_3, _mm256_set1_epi8((char) (0xF0 - 0x80)));
+            __m256i must_be = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must_be, special));
+
+            controls = _mm256_or_si256(controls, _mm256_and_si256(_mm256_cmpeq_epi8(previous_1, _mm256_set1_epi8((char) 0xC2)),
+                                                                  _mm256_cmpgt_epi8(_mm256_set1_epi8((char) 0xA0), input)));
+
+            previous_incomplete = _mm256_subs_epu8(input, incomplete);
+            previous            = input;
+        }
+
+        if (!_mm256_testz_si256(error, error))
+            return TEXT_INVALID;
+        return _mm256_testz_si256(controls, controls) ? TEXT_CLEAN : TEXT_CONTROLS;
+    }
+}
+
+#endif
+
+
+// ---- API ----
+
+// Which implementation 'CheckText' uses on this CPU.
+inline const char* TextCheckPath()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return "avx2";
+    if (__builtin_cpu_supports("sse4.1"))
+        return "sse4.1";
+#endif
+    return "scalar";
+}
+
+inline TextCheck CheckText(const char* text, size_t size)
+{
+#if defined(__x86_64__)
+    static TextCheck (*const check)(const uint8_t*, size_t) =
+        __builtin_cpu_supports("avx2")   ? utf8_detail::CheckAvx :
+        __builtin_cpu_supports("sse4.1") ? utf8_detail::CheckSse : CheckTextScalar;
+    return check((const uint8_t*) text, size);
+#else
+    return CheckTextScalar((const uint8_t*) text, size);
+#endif
+}
+
+// How much of the text is whole characters, i.e. without a character that's cut off at the end (e.g. by a
+// read that filled the buffer). Doesn't check anything else.
+inline size_t CompleteCharacters(const char* data, size_t size)
+{
+    const uint8_t* text = (const uint8_t*) data;
+    for (size_t back = 1; back <= 3 && back <= size; ++back)
+    {
+        uint8_t c = text[size - back];
+        if (c < 0x80)
+            return size;
+        if (c >= 0xC0)
+        {
+            size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+            return length > back ? size - back : size;
+        }
+    }
+    return size;
+}
+
+// Removes control characters and escape sequences (see the top of the file) in place and returns the new
+// size. The text must be valid UTF-8. A sequence that's cut off at the end is removed up to the end.
+inline size_t StripControls(char* data, size_t size)
+{
+    enum State { TEXT, ESCAPE, CSI, STRING, STRING_ESCAPE };
+
+    uint8_t* text    = (uint8_t*) data;
+    State    state   = TEXT;
+    size_t   written = 0;
+    size_t   i       = 0;
+    while (i < size)
+    {
+        uint8_t c  = text[i];
+        uint8_t c1 = c == 0xC2 && i + 1 < size && text[i + 1] < 0xA0 ? text[i + 1] : 0;  // U+0080-U+009F.
+        switch (state)
+        {
+            case TEXT:
+                if (c == 0x1B)
+                    state = ESCAPE;
+                else if (c1 == 0x9B)
+                    state = CSI;
+                else if (c1 == 0x90 || c1 == 0x98 || c1 == 0x9D || c1 == 0x9E || c1 == 0x9F)
+                    state = STRING;
+                else if (!IsControl(text, size, i))
+                    text[written++] = c;
+                break;
+
+            case ESCAPE:
+                if (c == '[')
+                    state = CSI;
+                else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+                    state = STRING;
+                else if (c >= 0x20 && c <= 0x2F)
+                    ;  // Intermediate byte, e.g. the '(' of 'ESC ( B'.
+                else if (c >= 0x30 && c <= 0x7E)
+                    state = TEXT;
+                else
+                {
+                    state = TEXT;  // Malformed, look at the byte again as text.
+                    continue;
+                }
+                break;
+
+            case CSI:
+                if (c >= 0x40 && c <= 0x7E)
+                    state = TEXT;
+                else if (c < 0x20 || c > 0x3F)
+                {
+                    state = TEXT;
+                    continue;
+                }
+                break;
+
+            case STRING:
+                // Ends with BEL, 'ESC \' or U+009C. Everything in between is dropped, whatever it is.
+                if (c == 0x07 || c1 == 0x9C)
+                    state = TEXT;
+                else if (c == 0x1B)
+                    state = STRING_ESCAPE;
+                break;
+
+            case STRING_ESCAPE:
+                state = c == '\\' ? TEXT : STRING;
+                break;
+        }
+        i += c1 ? 2 : 1;
+    }
+    return written;
+}